@@ -0,0 +1,434 @@
+/*
+ * Shared ticket caches for krenew -J.
+ *
+ * Normally each krenew running a command copies the ticket cache and renews
+ * the copy for that command alone.  On batch systems where every job step is
+ * run under krenew, that means one krenew process, one private ticket cache,
+ * and one set of renewals per job, all for the same user.  With -J, krenew
+ * instead looks for a renewer already running for that principal, listening
+ * on a Unix domain socket in a directory private to the user.  If one is
+ * found, krenew receives the name of its ticket cache and runs the command
+ * in place of itself with KRB5CCNAME pointing to that cache.  Otherwise, it
+ * starts the renewer in the background and then does the same.
+ *
+ * Each attached command holds a connection to the renewer open, inherited
+ * across exec, and this serves as its reference count: the renewer notices
+ * when all of the connections are closed, which happens even if the command
+ * is killed, and then removes its socket and ticket cache and exits.  A lock
+ * file serializes connecting, starting a renewer, and shutting down, so that
+ * a command never attaches to a renewer that is about to exit.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_SELECT_H
+#    include <sys/select.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <commands/internal.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Not all platforms can suppress SIGPIPE per call. */
+#ifndef MSG_NOSIGNAL
+#    define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * How many times to try to attach to a renewer.  A renewer that fails its
+ * first renewal exits without sending its ticket cache, in which case we try
+ * again, but only a few times.
+ */
+#define ATTACH_TRIES 3
+
+/* The path to the socket and lock file, and the listening socket. */
+static char *socket_path = NULL;
+static char *lock_path = NULL;
+static int listen_fd = -1;
+
+/* The connections from attached commands. */
+static int *clients = NULL;
+static size_t client_count = 0;
+
+
+/*
+ * Return whether an error from a nonblocking socket call only means that
+ * there was nothing to do yet.  EWOULDBLOCK is usually the same as EAGAIN.
+ */
+static bool
+transient_error(int error)
+{
+    if (error == EAGAIN || error == EINTR)
+        return true;
+#if EAGAIN != EWOULDBLOCK
+    if (error == EWOULDBLOCK)
+        return true;
+#endif
+    return false;
+}
+
+
+/*
+ * Lock or unlock the lock file, opening it if needed.  Returns the file
+ * descriptor, which is closed when unlocking.  The lock is a POSIX record
+ * lock so that it isn't inherited by the renewer when we fork it.
+ */
+static int
+attach_lock(void)
+{
+    struct flock lock;
+    int fd;
+
+    fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        sysdie("cannot open %s", lock_path);
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
+        if (errno != EINTR)
+            sysdie("cannot lock %s", lock_path);
+    return fd;
+}
+
+static void
+attach_unlock(int fd)
+{
+    close(fd);
+}
+
+
+/*
+ * Set up the paths to the socket and lock file for the principal of the
+ * given ticket cache.  The directory holding them is created if necessary
+ * and must be owned by us and not accessible by anyone else, since anyone
+ * who can connect to the socket gets the name of our ticket cache.
+ */
+static void
+attach_paths(krb5_context ctx, krb5_ccache ccache)
+{
+    krb5_error_code code;
+    krb5_principal princ;
+    struct sockaddr_un addr;
+    struct stat st;
+    char *dir, *name, *p;
+
+    code = krb5_cc_get_principal(ctx, ccache, &princ);
+    if (code != 0)
+        die_krb5(ctx, code, "error getting principal from ticket cache");
+    code = krb5_unparse_name(ctx, princ, &name);
+    if (code != 0)
+        die_krb5(ctx, code, "error unparsing name");
+    krb5_free_principal(ctx, princ);
+    for (p = name; *p != '\0'; p++)
+        if (!isalnum((unsigned char) *p) && strchr("-.@_", *p) == NULL)
+            *p = '_';
+
+    xasprintf(&dir, "/tmp/krenew-%lu", (unsigned long) getuid());
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        sysdie("cannot create %s", dir);
+    if (lstat(dir, &st) < 0)
+        sysdie("cannot stat %s", dir);
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid()
+        || (st.st_mode & 077) != 0)
+        die("%s is not a private directory owned by us", dir);
+    xasprintf(&socket_path, "%s/%s", dir, name);
+    xasprintf(&lock_path, "%s/%s.lock", dir, name);
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        die("socket path %s is too long", socket_path);
+    krb5_free_unparsed_name(ctx, name);
+    xfree(dir);
+}
+
+
+/*
+ * Fill in a socket address for the socket path.
+ */
+static void
+attach_address(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, socket_path, strlen(socket_path));
+}
+
+
+/*
+ * Connect to the renewer.  Returns the file descriptor or -1 if no renewer is
+ * listening.
+ */
+static int
+attach_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        sysdie("cannot create socket");
+    attach_address(&addr);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            sysdie("cannot connect to %s", socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+ * Create the listening socket, replacing any left behind by a renewer that
+ * was killed.  Must be called with the lock held.
+ */
+static void
+attach_listen(void)
+{
+    struct sockaddr_un addr;
+
+    if (unlink(socket_path) < 0 && errno != ENOENT)
+        sysdie("cannot remove stale socket %s", socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        sysdie("cannot create socket");
+    attach_address(&addr);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysdie("cannot bind to %s", socket_path);
+    if (listen(listen_fd, SOMAXCONN) < 0)
+        sysdie("cannot listen on %s", socket_path);
+}
+
+
+/*
+ * Read the name of the ticket cache from the renewer.  Returns a newly
+ * allocated string, or NULL if the renewer closed the connection without
+ * sending it.
+ */
+static char *
+attach_read(int fd)
+{
+    char buffer[BUFSIZ];
+    size_t used = 0;
+    ssize_t status;
+    char *end;
+
+    while (used < sizeof(buffer) - 1) {
+        status = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return NULL;
+        used += (size_t) status;
+        buffer[used] = '\0';
+        end = strchr(buffer, '\n');
+        if (end != NULL) {
+            *end = '\0';
+            return xstrdup(buffer);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Attach a command to the shared renewer for the principal of the ticket
+ * cache, starting the renewer if none is running.  In the calling process,
+ * this never returns: the command is run in place of krenew once the renewer
+ * sends the name of its ticket cache.  It returns only in the new renewer,
+ * which should then set up its ticket cache and call run_framework with
+ * config->attach set.
+ */
+void
+attach_command(krb5_context ctx, struct config *config, krb5_ccache ccache)
+{
+    int fd, lock, i, flags;
+    pid_t pid;
+    char *cache;
+
+    attach_paths(ctx, ccache);
+    for (i = 0; i < ATTACH_TRIES; i++) {
+        lock = attach_lock();
+        fd = attach_connect();
+        if (fd < 0) {
+            attach_listen();
+            fflush(stdout);
+            fflush(stderr);
+            pid = fork();
+            if (pid < 0)
+                sysdie("cannot fork");
+            else if (pid == 0) {
+                close(lock);
+                if (daemon(0, 0) < 0)
+                    sysdie("cannot background");
+                return;
+            }
+            if (waitpid(pid, NULL, 0) < 0)
+                sysdie("cannot wait for renewer");
+            if (config->verbose)
+                notice("started shared renewer for %s", socket_path);
+            fd = attach_connect();
+            close(listen_fd);
+            listen_fd = -1;
+            if (fd < 0)
+                die("cannot connect to new renewer at %s", socket_path);
+        }
+        attach_unlock(lock);
+        cache = attach_read(fd);
+        if (cache != NULL)
+            break;
+        close(fd);
+    }
+    if (i == ATTACH_TRIES)
+        die("cannot attach to renewer at %s", socket_path);
+
+    /*
+     * Run the command in place of ourselves, keeping the connection to the
+     * renewer open so that it knows the command is still running.
+     */
+    if (config->verbose)
+        notice("attached to shared ticket cache %s", cache);
+    flags = fcntl(fd, F_GETFD);
+    if (flags >= 0)
+        fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+    if (setenv("KRB5CCNAME", cache, 1) != 0)
+        die("cannot set KRB5CCNAME environment variable");
+    krb5_cc_close(ctx, ccache);
+    krb5_free_context(ctx);
+    execvp(config->command[0], config->command);
+    sysdie("cannot run %s", config->command[0]);
+}
+
+
+/*
+ * Accept all pending connections and send each the name of the ticket cache.
+ * Returns the number accepted.
+ */
+static size_t
+attach_accept(struct config *config)
+{
+    char *message;
+    int fd, flags;
+    size_t count = 0;
+
+    xasprintf(&message, "%s\n", config->cache);
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        flags = fcntl(fd, F_GETFD);
+        if (flags >= 0)
+            fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+        if (send(fd, message, strlen(message), MSG_NOSIGNAL) < 0) {
+            close(fd);
+            continue;
+        }
+        clients = xreallocarray(clients, client_count + 1, sizeof(int));
+        clients[client_count++] = fd;
+        count++;
+    }
+    if (!transient_error(errno))
+        syswarn("cannot accept connection on %s", socket_path);
+    xfree(message);
+    if (config->verbose && count > 0)
+        notice("%lu commands attached", (unsigned long) client_count);
+    return count;
+}
+
+
+/*
+ * Add the listening socket and client connections to a set of file
+ * descriptors to wait on, returning the highest plus one.
+ */
+int
+attach_fds(fd_set *fds)
+{
+    size_t i;
+    int maxfd = 0;
+
+    if (listen_fd >= 0 && listen_fd < FD_SETSIZE) {
+        FD_SET(listen_fd, fds);
+        maxfd = listen_fd + 1;
+    }
+    for (i = 0; i < client_count; i++)
+        if (clients[i] < FD_SETSIZE) {
+            FD_SET(clients[i], fds);
+            if (clients[i] >= maxfd)
+                maxfd = clients[i] + 1;
+        }
+    return maxfd;
+}
+
+
+/*
+ * Accept new connections and drop closed ones without blocking.  Returns
+ * false if no commands are attached any more, in which case the renewer
+ * should exit.  The final check is done with the lock held and removes the
+ * socket, so that no command can attach between the check and our exit.
+ */
+bool
+attach_service(struct config *config)
+{
+    char buffer[BUFSIZ];
+    ssize_t status;
+    size_t i;
+    int lock, flags;
+
+    if (listen_fd < 0)
+        return false;
+    flags = fcntl(listen_fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK))
+        fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+    attach_accept(config);
+    for (i = 0; i < client_count;) {
+        status = recv(clients[i], buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (status == 0 || (status < 0 && !transient_error(errno))) {
+            close(clients[i]);
+            clients[i] = clients[--client_count];
+            if (config->verbose)
+                notice("%lu commands attached", (unsigned long) client_count);
+        } else {
+            i++;
+        }
+    }
+    if (client_count > 0)
+        return true;
+    lock = attach_lock();
+    if (attach_accept(config) > 0) {
+        attach_unlock(lock);
+        return true;
+    }
+    attach_close();
+    attach_unlock(lock);
+    return false;
+}
+
+
+/*
+ * Stop listening and remove the socket.  Called on exit, as well as when the
+ * last command detaches.
+ */
+void
+attach_close(void)
+{
+    size_t i;
+
+    if (listen_fd < 0)
+        return;
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+    for (i = 0; i < client_count; i++)
+        close(clients[i]);
+    client_count = 0;
+}
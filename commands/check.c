@@ -0,0 +1,705 @@
+/*
+ * Ticket status checks for k5start and krenew.
+ *
+ * Implements the -E option, which only checks whether the ticket cache holds
+ * a ticket-granting ticket that is good for at least a given number of
+ * minutes and reports the result through the exit status.  This is meant to
+ * be run frequently by monitoring probes, so for the common case of a FILE
+ * ticket cache named in KRB5CCNAME or with -k, the cache is read and the
+ * default principal and its krbtgt entry are parsed directly, without
+ * initializing a Kerberos context (which reads and parses the profile).  Any
+ * other cache type, and any cache that can't be parsed (such as one being
+ * written at the same time), is checked through the Kerberos libraries.
+ * The same parser gives krenew -A the ticket times of every cache it watches
+ * and is used by -z to compact the ticket cache of a daemon, rewriting it
+ * without expired or superseded entries.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <commands/internal.h>
+#include <util/clock.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * The FILE cache format versions we parse directly.  Versions 1 and 2 use
+ * host byte order and an older principal encoding and haven't been written
+ * by default in decades, so they're left to the library.
+ */
+#define FCC_VERSION_3 0x0503
+#define FCC_VERSION_4 0x0504
+
+/*
+ * The most of a FILE cache we read to find its ticket times.  Caches are
+ * normally a few KB, and the krbtgt entry is normally the first one.
+ */
+#define CACHE_READ_MAX (64 * 1024)
+
+/*
+ * Older systems may not have O_NOFOLLOW.  The check that we opened the file
+ * we expected still catches a symlink swapped in for a cache.
+ */
+#ifndef O_NOFOLLOW
+#    define O_NOFOLLOW 0
+#endif
+
+/* The result of checking a cache directly. */
+enum check_result {
+    CHECK_GOOD,    /* Found a ticket good for long enough. */
+    CHECK_BAD,     /* Found a ticket that isn't good for long enough. */
+    CHECK_MISSING, /* Parsed the cache but found no ticket. */
+    CHECK_UNKNOWN  /* Couldn't parse the cache, so ask the library. */
+};
+
+/* A cursor for reading cache data, with bounds checking. */
+struct reader {
+    const unsigned char *data;
+    size_t length;
+    size_t offset;
+};
+
+/* A counted string in cache data, not nul-terminated. */
+struct counted {
+    const unsigned char *data;
+    uint32_t length;
+};
+
+/*
+ * A principal in cache data, with up to two name components.  The encoding
+ * after the name type is also kept for comparing whole principals.
+ */
+struct fcc_principal {
+    struct counted realm;
+    uint32_t count;
+    struct counted name[2];
+    struct counted encoded;
+};
+
+/*
+ * An entry in cache data: the parts we look at and its offset and length, so
+ * that it can be copied unchanged.
+ */
+struct fcc_entry {
+    struct fcc_principal client;
+    struct fcc_principal server;
+    uint16_t keytype;
+    uint32_t endtime;
+    uint32_t renew_till;
+    unsigned char is_skey;
+    size_t offset;
+    size_t length;
+};
+
+
+/*
+ * Functions to read big-endian integers, counted strings, and principals
+ * from the cache.  All return false if the data runs past the end of the
+ * cache.
+ */
+static bool
+read_skip(struct reader *r, size_t length)
+{
+    if (r->length - r->offset < length)
+        return false;
+    r->offset += length;
+    return true;
+}
+
+static bool
+read_uint16(struct reader *r, uint16_t *value)
+{
+    const unsigned char *p = r->data + r->offset;
+
+    if (!read_skip(r, 2))
+        return false;
+    *value = (uint16_t) ((p[0] << 8) | p[1]);
+    return true;
+}
+
+static bool
+read_uint32(struct reader *r, uint32_t *value)
+{
+    const unsigned char *p = r->data + r->offset;
+
+    if (!read_skip(r, 4))
+        return false;
+    *value = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+             | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+    return true;
+}
+
+static bool
+read_counted(struct reader *r, struct counted *counted)
+{
+    if (!read_uint32(r, &counted->length))
+        return false;
+    counted->data = r->data + r->offset;
+    return read_skip(r, counted->length);
+}
+
+static bool
+read_principal(struct reader *r, struct fcc_principal *princ)
+{
+    uint32_t type, i;
+    struct counted component;
+
+    if (!read_uint32(r, &type))
+        return false;
+    princ->encoded.data = r->data + r->offset;
+    if (!read_uint32(r, &princ->count))
+        return false;
+    if (!read_counted(r, &princ->realm))
+        return false;
+    for (i = 0; i < princ->count; i++) {
+        if (!read_counted(r, &component))
+            return false;
+        if (i < 2)
+            princ->name[i] = component;
+    }
+    princ->encoded.length = (uint32_t) (r->data + r->offset
+                                        - princ->encoded.data);
+    return true;
+}
+
+
+/*
+ * Return true if the counted string matches the given string.
+ */
+static bool
+counted_equal(const struct counted *counted, const char *string)
+{
+    size_t length = strlen(string);
+
+    return counted->length == length
+           && memcmp(counted->data, string, length) == 0;
+}
+
+
+/*
+ * Return true if two counted strings are equal.
+ */
+static bool
+counted_same(const struct counted *a, const struct counted *b)
+{
+    return a->length == b->length && memcmp(a->data, b->data, a->length) == 0;
+}
+
+
+/*
+ * Read the header and default principal of FILE cache data and store the
+ * cache version.  Returns false if the cache couldn't be parsed or is a
+ * version we don't parse.
+ */
+static bool
+read_header(struct reader *r, uint16_t *version, struct fcc_principal *def)
+{
+    uint16_t header;
+
+    if (!read_uint16(r, version))
+        return false;
+    if (*version != FCC_VERSION_3 && *version != FCC_VERSION_4)
+        return false;
+    if (*version == FCC_VERSION_4)
+        if (!read_uint16(r, &header) || !read_skip(r, header))
+            return false;
+    return read_principal(r, def);
+}
+
+
+/*
+ * Read the next entry from FILE cache data of the given version.  Returns
+ * false if the entry couldn't be parsed.
+ */
+static bool
+read_entry(struct reader *r, uint16_t version, struct fcc_entry *entry)
+{
+    struct counted ignored;
+    uint32_t authtime, starttime, flags, count, i;
+
+    entry->offset = r->offset;
+    if (!read_principal(r, &entry->client)
+        || !read_principal(r, &entry->server))
+        return false;
+    if (!read_uint16(r, &entry->keytype))
+        return false;
+    if (version == FCC_VERSION_3 && !read_uint16(r, &entry->keytype))
+        return false;
+    if (!read_counted(r, &ignored))
+        return false;
+    if (!read_uint32(r, &authtime) || !read_uint32(r, &starttime)
+        || !read_uint32(r, &entry->endtime)
+        || !read_uint32(r, &entry->renew_till))
+        return false;
+    if (!read_skip(r, 1))
+        return false;
+    entry->is_skey = r->data[r->offset - 1];
+    if (!read_uint32(r, &flags))
+        return false;
+    if (!read_uint32(r, &count))
+        return false;
+    for (i = 0; i < count; i++)
+        if (!read_skip(r, 2) || !read_counted(r, &ignored))
+            return false;
+    if (!read_uint32(r, &count))
+        return false;
+    for (i = 0; i < count; i++)
+        if (!read_skip(r, 2) || !read_counted(r, &ignored))
+            return false;
+    if (!read_counted(r, &ignored) || !read_counted(r, &ignored))
+        return false;
+    entry->length = r->offset - entry->offset;
+    return true;
+}
+
+
+/*
+ * Parse the contents of a FILE cache and store the expiration and renewal
+ * times of the krbtgt ticket for the realm of the default principal, or 0 if
+ * there is no such ticket.  As with the Kerberos libraries, the first
+ * matching entry is used.  complete says whether data holds the whole cache
+ * or only its start.  Returns false if the cache couldn't be parsed or if the
+ * ticket wasn't found in an incomplete cache.
+ */
+static bool
+parse_data(const unsigned char *data, size_t length, bool complete,
+           time_t *endtime, time_t *renew_till)
+{
+    struct reader r = {data, length, 0};
+    struct fcc_principal def;
+    struct fcc_entry entry;
+    uint16_t version;
+
+    /* The header and the default principal. */
+    if (!read_header(&r, &version, &def))
+        return false;
+
+    /* Walk the entries looking for krbtgt/REALM@REALM. */
+    while (r.offset < r.length) {
+        if (!read_entry(&r, version, &entry))
+            return false;
+        if (entry.server.count != 2
+            || !counted_equal(&entry.server.name[0], "krbtgt"))
+            continue;
+        if (!counted_same(&entry.server.name[1], &def.realm)
+            || !counted_same(&entry.server.realm, &def.realm))
+            continue;
+        if (!counted_same(&entry.client.encoded, &def.encoded))
+            continue;
+        *endtime = clock_from_real((time_t) entry.endtime);
+        *renew_till = clock_from_real((time_t) entry.renew_till);
+        return true;
+    }
+    if (!complete)
+        return false;
+    *endtime = 0;
+    *renew_till = 0;
+    return true;
+}
+
+
+/*
+ * Read the ticket times from a FILE cache directly given its path.  The file
+ * is opened non-blocking so that a FIFO in its place can't hang us, and is
+ * read rather than mapped, since the cache may be rewritten or truncated by
+ * its owner while we look at it.  Only the first CACHE_READ_MAX bytes are
+ * read.
+ *
+ * krenew -A runs as root and reads caches in directories that their owners
+ * can write, so it passes what lstat said about the cache as expected.  The
+ * owner could replace the cache between that lstat and our open, so refuse
+ * to follow a symlink and check that we opened the same file.
+ */
+bool
+cache_times(const char *path, const struct stat *expected, time_t *endtime,
+            time_t *renew_till)
+{
+    struct stat st;
+    unsigned char *data;
+    size_t size, used;
+    ssize_t status;
+    int fd;
+    bool okay = false;
+
+    if (expected == NULL)
+        fd = open(path, O_RDONLY | O_NONBLOCK);
+    else
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    if (expected != NULL
+        && (st.st_dev != expected->st_dev || st.st_ino != expected->st_ino
+            || st.st_uid != expected->st_uid)) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > CACHE_READ_MAX)
+        size = CACHE_READ_MAX;
+    else
+        size = (size_t) st.st_size;
+    data = xmalloc(size);
+    for (used = 0; used < size; used += (size_t) status) {
+        status = pread(fd, data + used, size - used, (off_t) used);
+        if (status < 0 && errno == EINTR)
+            status = 0;
+        else if (status <= 0)
+            break;
+    }
+    close(fd);
+    if (used > 0)
+        okay = parse_data(data, used, (off_t) used == st.st_size, endtime,
+                          renew_till);
+    explicit_bzero(data, size);
+    xfree(data);
+    return okay;
+}
+
+
+/*
+ * Check a FILE cache directly given its path.
+ */
+static enum check_result
+check_file(const char *path, time_t needed)
+{
+    time_t endtime, renew_till;
+
+    if (!cache_times(path, NULL, &endtime, &renew_till))
+        return CHECK_UNKNOWN;
+    if (endtime == 0)
+        return CHECK_MISSING;
+    return (endtime < needed) ? CHECK_BAD : CHECK_GOOD;
+}
+
+
+/*
+ * Check the cache through the Kerberos libraries, used for anything we can't
+ * parse directly.  Only the cache is consulted; the KDC is never contacted.
+ */
+static enum check_result
+check_library(const char *cache, time_t needed)
+{
+    krb5_context ctx;
+    krb5_ccache ccache = NULL;
+    krb5_creds in, *out = NULL;
+    const char *realm;
+    enum check_result result = CHECK_MISSING;
+
+    memset(&in, 0, sizeof(in));
+    if (krb5_init_context(&ctx) != 0)
+        return CHECK_MISSING;
+    if (cache == NULL) {
+        if (krb5_cc_default(ctx, &ccache) != 0)
+            goto done;
+    } else {
+        if (krb5_cc_resolve(ctx, cache, &ccache) != 0)
+            goto done;
+    }
+    if (krb5_cc_get_principal(ctx, ccache, &in.client) != 0)
+        goto done;
+    realm = krb5_principal_get_realm(ctx, in.client);
+    if (realm == NULL)
+        goto done;
+    if (krb5_build_principal(ctx, &in.server, (unsigned int) strlen(realm),
+                             realm, "krbtgt", realm, (const char *) NULL)
+        != 0)
+        goto done;
+    if (krb5_get_credentials(ctx, KRB5_GC_CACHED, ccache, &in, &out) != 0)
+        goto done;
+    if (clock_from_real(out->times.endtime) < needed)
+        result = CHECK_BAD;
+    else
+        result = CHECK_GOOD;
+
+done:
+    if (out != NULL)
+        krb5_free_creds(ctx, out);
+    krb5_free_cred_contents(ctx, &in);
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    krb5_free_context(ctx);
+    return result;
+}
+
+
+/*
+ * Check whether the given ticket cache, or the default cache if it is NULL,
+ * has a ticket-granting ticket good for at least the given number of minutes.
+ * Returns the exit status to use: 0 if it does and 1 otherwise.
+ *
+ * If neither a cache nor KRB5CCNAME is set, first try the usual default FILE
+ * cache, /tmp/krb5cc_<uid>, directly.  Only if that can't be read do we ask
+ * the Kerberos libraries for the default, which covers other default cache
+ * types configured in krb5.conf.
+ */
+int
+check_ticket(const char *cache, long minutes)
+{
+    const char *name = cache;
+    char path[64];
+    time_t needed;
+    enum check_result result = CHECK_UNKNOWN;
+
+    needed = clock_now() + minutes * 60;
+    if (name == NULL)
+        name = getenv("KRB5CCNAME");
+    if (name == NULL) {
+        snprintf(path, sizeof(path), "/tmp/krb5cc_%lu",
+                 (unsigned long) getuid());
+        result = check_file(path, needed);
+    } else if (strncmp(name, "FILE:", strlen("FILE:")) == 0)
+        result = check_file(name + strlen("FILE:"), needed);
+    else if (strchr(name, ':') == NULL)
+        result = check_file(name, needed);
+    if (result == CHECK_UNKNOWN)
+        result = check_library(name, needed);
+    return (result == CHECK_GOOD) ? 0 : 1;
+}
+
+
+/*
+ * Return the path to the file holding a FILE ticket cache or a DIR
+ * subsidiary cache given its name, or NULL for any other cache type.
+ */
+const char *
+cache_path(const char *cache)
+{
+    if (strncmp(cache, "FILE:", strlen("FILE:")) == 0)
+        return cache + strlen("FILE:");
+    if (strncmp(cache, "DIR::", strlen("DIR::")) == 0)
+        return cache + strlen("DIR::");
+    if (strchr(cache, ':') == NULL)
+        return cache;
+    return NULL;
+}
+
+
+/*
+ * Return true if an entry is a cache configuration entry, which the Kerberos
+ * libraries store with a server realm of X-CACHECONF:, rather than a ticket.
+ */
+static bool
+entry_is_config(const struct fcc_entry *entry)
+{
+    return counted_equal(&entry->server.realm, "X-CACHECONF:");
+}
+
+
+/*
+ * Return true if two entries are tickets for the same client and server with
+ * the same session key type, so that one supersedes the other.
+ */
+static bool
+entry_same(const struct fcc_entry *a, const struct fcc_entry *b)
+{
+    return a->keytype == b->keytype && a->is_skey == b->is_skey
+           && counted_same(&a->client.encoded, &b->client.encoded)
+           && counted_same(&a->server.encoded, &b->server.encoded);
+}
+
+
+/*
+ * Choose the entries of a mapped FILE cache to keep when compacting it: all
+ * configuration entries, and for each client, server, and key type, the
+ * unexpired ticket that expires last (or the later one if two expire at the
+ * same time).  Stores the length of the header and default principal in
+ * header, the kept entries in order in a newly allocated array in kept, the
+ * number kept in count, and the number of entries in the cache in total.
+ * Returns false if the cache couldn't be parsed.
+ */
+static bool
+compact_data(const unsigned char *data, size_t length, size_t *header,
+             struct fcc_entry **kept, size_t *count, size_t *total)
+{
+    struct reader r = {data, length, 0};
+    struct fcc_principal def;
+    struct fcc_entry entry;
+    uint16_t version;
+    size_t size = 0, i;
+    time_t now;
+
+    *kept = NULL;
+    *count = 0;
+    *total = 0;
+    if (!read_header(&r, &version, &def))
+        return false;
+    *header = r.offset;
+    now = clock_now();
+    while (r.offset < r.length) {
+        if (!read_entry(&r, version, &entry))
+            return false;
+        (*total)++;
+
+        /*
+         * Drop expired tickets (including any the libraries marked as
+         * removed by clearing their times), and replace an earlier ticket
+         * for the same service in place if this one lasts at least as long.
+         */
+        if (!entry_is_config(&entry)) {
+            if (entry.endtime == 0
+                || clock_from_real((time_t) entry.endtime) <= now)
+                continue;
+            for (i = 0; i < *count; i++)
+                if (entry_same(&(*kept)[i], &entry))
+                    break;
+            if (i < *count) {
+                if (entry.endtime >= (*kept)[i].endtime)
+                    (*kept)[i] = entry;
+                continue;
+            }
+        }
+        if (*count == size) {
+            size += 16;
+            *kept = xreallocarray(*kept, size, sizeof(**kept));
+        }
+        (*kept)[(*count)++] = entry;
+    }
+    return true;
+}
+
+
+/*
+ * Compact the FILE ticket cache at the given path, dropping expired tickets
+ * and tickets superseded by a later one for the same service, and atomically
+ * replace it with the result if anything was dropped.  The cache is locked
+ * while it is read and replaced, as the Kerberos libraries lock it, so that
+ * nothing added to it at the same time is lost except by a process that
+ * opened it before it was replaced.  The replacement gets the owner, group,
+ * and mode of the original.  If verbose is true, report what was dropped.
+ *
+ * Errors are reported but otherwise ignored, since a cache that isn't
+ * compacted still works.  A missing cache, or one that was replaced while we
+ * waited for the lock, is skipped silently.
+ */
+void
+compact_cache(const char *path, bool verbose)
+{
+    struct stat st, current;
+    struct flock lock;
+    void *data = MAP_FAILED;
+    struct fcc_entry *kept = NULL;
+    size_t header, count, total, written, i;
+    size_t used = 0;
+    ssize_t status;
+    char *buffer = NULL;
+    char *tmp = NULL;
+    int fd, tmpfd = -1;
+
+    /* Open and lock the cache and make sure it's still the current one. */
+    fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            syswarn("cannot open ticket cache %s", path);
+        return;
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
+        if (errno != EINTR) {
+            syswarn("cannot lock ticket cache %s", path);
+            goto done;
+        }
+    if (fstat(fd, &st) < 0) {
+        syswarn("cannot stat ticket cache %s", path);
+        goto done;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+        goto done;
+    if (stat(path, &current) < 0 || current.st_dev != st.st_dev
+        || current.st_ino != st.st_ino)
+        goto done;
+
+    /* Decide what to keep.  If we're keeping everything, we're done. */
+    data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        syswarn("cannot map ticket cache %s", path);
+        goto done;
+    }
+    if (!compact_data(data, (size_t) st.st_size, &header, &kept, &count,
+                      &total)) {
+        warn("cannot parse ticket cache %s for compaction", path);
+        goto done;
+    }
+    if (count == total)
+        goto done;
+
+    /* Assemble the new cache. */
+    buffer = xmalloc((size_t) st.st_size);
+    memcpy(buffer, data, header);
+    used = header;
+    for (i = 0; i < count; i++) {
+        memcpy(buffer + used, (const char *) data + kept[i].offset,
+               kept[i].length);
+        used += kept[i].length;
+    }
+
+    /* Write it to a temporary file and rename it into place. */
+    xasprintf(&tmp, "%s_XXXXXX", path);
+    tmpfd = mkstemp(tmp);
+    if (tmpfd < 0) {
+        syswarn("cannot create temporary ticket cache %s", tmp);
+        goto done;
+    }
+    if (fstat(tmpfd, &current) < 0) {
+        syswarn("cannot stat temporary ticket cache %s", tmp);
+        goto fail;
+    }
+    if (current.st_uid != st.st_uid || current.st_gid != st.st_gid)
+        if (fchown(tmpfd, st.st_uid, st.st_gid) < 0) {
+            syswarn("cannot chown %s to %ld:%ld", tmp, (long) st.st_uid,
+                    (long) st.st_gid);
+            goto fail;
+        }
+    if (fchmod(tmpfd, st.st_mode & 07777) < 0) {
+        syswarn("cannot chmod %s to %o", tmp,
+                (unsigned int) (st.st_mode & 07777));
+        goto fail;
+    }
+    for (written = 0; written < used; written += (size_t) status) {
+        status = write(tmpfd, buffer + written, used - written);
+        if (status < 0 && errno == EINTR)
+            status = 0;
+        else if (status < 0) {
+            syswarn("cannot write temporary ticket cache %s", tmp);
+            goto fail;
+        }
+    }
+    if (rename(tmp, path) < 0) {
+        syswarn("cannot rename %s to %s", tmp, path);
+        goto fail;
+    }
+    if (verbose)
+        notice("compacted ticket cache %s, dropping %lu of %lu entries", path,
+               (unsigned long) (total - count), (unsigned long) total);
+    goto done;
+
+fail:
+    unlink(tmp);
+
+done:
+    if (tmpfd >= 0)
+        close(tmpfd);
+    if (data != MAP_FAILED)
+        munmap(data, (size_t) st.st_size);
+    if (buffer != NULL)
+        explicit_bzero(buffer, used);
+    xfree(buffer);
+    xfree(tmp);
+    xfree(kept);
+    close(fd);
+}
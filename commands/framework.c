@@ -5,7 +5,7 @@
  *
  * 1. Parse command-line options and initialize parameters.
  * 2. Do an initial authentication or ticket renewal, reporting errors.
- * 3. Run the aklog command, if any.
+ * 3. Run the aklog command or obtain AFS tokens directly, if requested.
  * 4. Background and write out PID files if necessary.
  * 5. Spawn the external command, if any.
  * 6. If running a command or as a daemon, loop and reauthenticate as needed.
@@ -37,26 +37,28 @@
 #    include <keyutils.h>
 #endif
 #include <signal.h>
+#ifdef HAVE_SYS_SELECT_H
+#    include <sys/select.h>
+#endif
 #include <sys/stat.h>
+#include <syslog.h>
 #ifdef HAVE_SYS_TIME_H
 #    include <sys/time.h>
 #endif
+#ifdef HAVE_SYS_TIMERFD_H
+#    include <sys/timerfd.h>
+#endif
 #include <time.h>
 
 #include <commands/internal.h>
+#include <util/clock.h>
 #include <util/command.h>
 #include <util/macros.h>
 #include <util/messages-krb5.h>
 #include <util/messages.h>
+#include <util/status.h>
 #include <util/xmalloc.h>
 
-/*
- * The number of seconds of fudge to add to the check for whether we need to
- * obtain a new ticket.  This is here to make sure that we don't wake up just
- * as the ticket is expiring.
- */
-#define EXPIRE_FUDGE (2 * 60)
-
 /*
  * Set when the program receives SIGALRM, which indicates that it should wake
  * up immediately and reauthenticate.
@@ -70,6 +72,69 @@ static volatile sig_atomic_t alarm_signaled = 0;
  */
 static volatile sig_atomic_t exit_signaled = 0;
 
+/*
+ * Running token refreshes.  Each is either aklog or, when obtaining tokens
+ * natively for several cells, a child process obtaining tokens for one cell.
+ * They are run asynchronously so that a hung AFS server or KDC cannot stop
+ * ticket renewal or delay tokens for other cells, and are killed if they run
+ * longer than the configured timeout.  There are config->jobs slots.
+ */
+struct token_job {
+    const char *cell;     /* Cell for this job, or NULL for aklog. */
+    pid_t pid;            /* PID of the job, or 0 if the slot is free. */
+    struct timeval start; /* When the job was started. */
+    bool killed;          /* Whether it has been killed for timing out. */
+};
+static struct token_job *token_jobs = NULL;
+static size_t token_slots = 0;
+
+/*
+ * Cells waiting for a free slot, as a parallel array to config->cells.  A cell
+ * is queued when its tokens should be refreshed and is removed from the queue
+ * when a job is started for it.
+ */
+static bool *cells_pending = NULL;
+
+/*
+ * Older headers may not define the flag to cancel a timerfd when the clock is
+ * set discontinuously.  It was added in Linux 3.0.
+ */
+#if defined(HAVE_SYS_TIMERFD_H) && !defined(TFD_TIMER_CANCEL_ON_SET)
+#    define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+/*
+ * A timerfd used to wait for wakeups, or -1 if it hasn't been created yet or
+ * can't be.  Our wakeups are times on the real-time clock, but a relative
+ * timeout only counts time while the system is running, so after a suspend,
+ * VM pause, or clock change we would wake up late, possibly after the ticket
+ * has expired.  A real-time timer set to an absolute time fires at the right
+ * time after a resume, and it is canceled if the clock is set so that we can
+ * recheck everything.
+ */
+#ifdef HAVE_SYS_TIMERFD_H
+static int timer_fd = -1;
+static bool timer_failed = false;
+#endif
+
+/*
+ * The restart state of the command when restarting it on exit.  The count and
+ * delay are of restarts in a row, and are reset once the command stays up for
+ * at least the maximum delay.
+ */
+static struct {
+    time_t started; /* When the command was last started. */
+    long count;     /* Number of restarts in a row. */
+    long delay;     /* Seconds waited before the last restart. */
+} restart_state;
+
+/*
+ * The status file, if one was requested with -O, and the record published to
+ * it.  The record is kept up to date before the file is opened so that it
+ * includes the initial authentication.
+ */
+static struct status *status_file = NULL;
+static struct status_record status_state;
 
 /*
  * Convert from a string to a number, checking errors, and return -1 on any
@@ -111,6 +176,448 @@ exit_handler(int s UNUSED)
 }
 
 
+/*
+ * Signal handler for SIGCHLD.  Does nothing; it only exists so that waiting
+ * for a timeout is interrupted when aklog or the command exits.
+ */
+static void
+child_handler(int s UNUSED)
+{
+    /* Do nothing. */
+}
+
+
+/*
+ * Return the number of seconds elapsed since start as a double.  Token jobs
+ * are external processes, so they are timed on the real-time clock even if
+ * our clock is scaled.
+ */
+static double
+elapsed_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double) (now.tv_sec - start->tv_sec)
+           + (double) (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+
+/*
+ * Return the name to use for a token job in messages.
+ */
+static const char *
+job_name(struct config *config, const struct token_job *job)
+{
+    return (job->cell != NULL) ? job->cell : config->aklog;
+}
+
+
+/*
+ * Return true if a job for the given cell (NULL for aklog) is running.
+ */
+static bool
+job_running(const char *cell)
+{
+    size_t i;
+
+    for (i = 0; i < token_slots; i++)
+        if (token_jobs[i].pid != 0 && token_jobs[i].cell == cell)
+            return true;
+    return false;
+}
+
+
+/*
+ * Obtain tokens for a single cell in a child process so that a slow cell
+ * doesn't hold up the others.  The child exits 0 on success and 1 on
+ * failure.  Returns the PID of the child or -1 on failure to fork.
+ */
+static pid_t
+cell_spawn(krb5_context ctx, struct config *config, const char *cell)
+{
+    pid_t pid;
+    krb5_error_code code;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid != 0)
+        return pid;
+
+    /* Messages already queued are the parent's to write. */
+    if (config->queue_logs)
+        message_queue_init(LOG_QUEUE_SIZE, LOG_DAEMON);
+    code = tokens_set(ctx, config, cell);
+    if (config->queue_logs)
+        message_queue_flush();
+    fflush(stdout);
+    _exit(code == 0 ? 0 : 1);
+}
+
+
+/*
+ * Start a token job in a free slot, running aklog if cell is NULL and
+ * otherwise obtaining tokens for that cell.  Returns false if there was no
+ * free slot.
+ */
+static bool
+job_start(krb5_context ctx, struct config *config, const char *cell)
+{
+    struct token_job *job = NULL;
+    size_t i;
+
+    for (i = 0; i < token_slots; i++)
+        if (token_jobs[i].pid == 0) {
+            job = &token_jobs[i];
+            break;
+        }
+    if (job == NULL)
+        return false;
+    job->cell = cell;
+    if (cell == NULL)
+        job->pid = command_spawn(config->aklog);
+    else
+        job->pid = cell_spawn(ctx, config, cell);
+    if (job->pid < 0) {
+        if (cell == NULL)
+            syswarn("cannot run %s", config->aklog);
+        else
+            syswarn("cannot start token refresh for %s", cell);
+        job->pid = 0;
+        return true;
+    }
+    gettimeofday(&job->start, NULL);
+    job->killed = false;
+    return true;
+}
+
+
+/*
+ * Start jobs for queued cells until we run out of queued cells or free
+ * slots.
+ */
+static void
+jobs_start_pending(krb5_context ctx, struct config *config)
+{
+    size_t i;
+
+    if (cells_pending == NULL)
+        return;
+    for (i = 0; config->cells[i] != NULL; i++) {
+        if (!cells_pending[i] || job_running(config->cells[i]))
+            continue;
+        if (!job_start(ctx, config, config->cells[i]))
+            return;
+        cells_pending[i] = false;
+    }
+}
+
+
+/*
+ * Return true if there is work left for the token jobs, meaning either a job
+ * that hasn't yet been killed for its timeout or a cell waiting for a slot.
+ */
+static bool
+jobs_busy(struct config *config)
+{
+    size_t i;
+
+    for (i = 0; i < token_slots; i++)
+        if (token_jobs[i].pid != 0 && !token_jobs[i].killed)
+            return true;
+    if (cells_pending != NULL)
+        for (i = 0; config->cells[i] != NULL; i++)
+            if (cells_pending[i])
+                return true;
+    return false;
+}
+
+
+/*
+ * Check on the running token jobs.  Reap any that have exited and report
+ * their status and how long they took, kill any that have run past their
+ * timeout (they will be reaped on a later call), and start queued cells in
+ * any slots that have become free.
+ */
+static void
+jobs_check(krb5_context ctx, struct config *config)
+{
+    struct token_job *job;
+    int result, status;
+    double elapsed;
+    size_t i;
+
+    for (i = 0; i < token_slots; i++) {
+        job = &token_jobs[i];
+        if (job->pid == 0)
+            continue;
+        result = command_finish(job->pid, &status);
+        elapsed = elapsed_since(&job->start);
+        if (result < 0) {
+            syswarn("waitpid for %s failed", job_name(config, job));
+            job->pid = 0;
+        } else if (result > 0) {
+            if (job->killed)
+                warn("%s killed after timeout of %ld seconds",
+                     job_name(config, job), config->aklog_timeout);
+            else if (job->cell == NULL && config->verbose)
+                notice("%s exited with status %d after %.3fs", config->aklog,
+                       status, elapsed);
+            else if (job->cell != NULL && status != 0)
+                warn("%s: token refresh failed after %.3fs", job->cell,
+                     elapsed);
+            else if (job->cell != NULL && config->verbose)
+                notice("%s: obtained tokens in %.3fs", job->cell, elapsed);
+            job->pid = 0;
+        } else if (config->aklog_timeout > 0 && !job->killed
+                   && elapsed >= (double) config->aklog_timeout) {
+            kill(job->pid, SIGKILL);
+            job->killed = true;
+        }
+    }
+    jobs_start_pending(ctx, config);
+}
+
+
+#ifdef HAVE_SYS_TIMERFD_H
+/*
+ * Wait for the given relative timeout, the receipt of a signal, or activity
+ * on one of the given file descriptors using an absolute real-time timerfd,
+ * so that time spent suspended counts towards the timeout and a change to the
+ * clock wakes us up.  Returns false if the timer could not be used, in which
+ * case the caller should fall back on a plain timeout.
+ */
+static bool
+timer_wait(const struct timespec *timeout, const sigset_t *mask, fd_set *fds,
+           int maxfd)
+{
+    struct itimerspec spec;
+    struct timespec now;
+    uint64_t count;
+
+    if (timer_failed)
+        return false;
+    if (timer_fd < 0) {
+        timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0 || timer_fd >= FD_SETSIZE) {
+            if (timer_fd >= 0)
+                close(timer_fd);
+            timer_fd = -1;
+            timer_failed = true;
+            return false;
+        }
+    }
+    if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+        return false;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = now.tv_sec + timeout->tv_sec;
+    spec.it_value.tv_nsec = now.tv_nsec + timeout->tv_nsec;
+    if (spec.it_value.tv_nsec >= 1000000000L) {
+        spec.it_value.tv_sec++;
+        spec.it_value.tv_nsec -= 1000000000L;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                        &spec, NULL)
+        < 0) {
+        close(timer_fd);
+        timer_fd = -1;
+        timer_failed = true;
+        return false;
+    }
+    FD_SET(timer_fd, fds);
+    if (timer_fd >= maxfd)
+        maxfd = timer_fd + 1;
+    if (pselect(maxfd, fds, NULL, NULL, NULL, mask) > 0
+        && FD_ISSET(timer_fd, fds)) {
+        /*
+         * Clear the expiration.  If the clock was set, this fails with
+         * ECANCELED, which is fine since we'll recheck everything anyway.
+         */
+        if (read(timer_fd, &count, sizeof(count)) < 0 && errno != ECANCELED
+            && errno != EAGAIN)
+            syswarn("cannot read timer");
+    }
+    return true;
+}
+#endif
+
+
+/*
+ * Wait until the given time, the earliest deadline of the running token jobs,
+ * or the receipt of a signal, whichever comes first.  A wakeup of 0 means to
+ * wait only for the token jobs or a signal.  The caller must have the signals
+ * that it handles blocked and pass in the mask to use while waiting so that a
+ * signal received after the caller checks its state is not lost.  A shared
+ * renewer for krenew -J also wakes up when a command attaches or detaches.
+ *
+ * The wakeup is a time on our clock, which may run faster than real time, so
+ * it is converted to an interval of real time before waiting.
+ */
+static void
+wait_until(struct config *config, time_t wakeup, const sigset_t *mask)
+{
+    struct timespec timeout;
+    struct timespec *tp = NULL;
+    double left, deadline;
+    fd_set fds;
+    int maxfd = 0;
+    size_t i;
+
+    if (wakeup == 0)
+        left = -1;
+    else {
+        left = clock_interval((double) (wakeup - clock_now()));
+        if (left < 0)
+            left = 0;
+    }
+    for (i = 0; i < token_slots; i++) {
+        if (token_jobs[i].pid == 0 || token_jobs[i].killed)
+            continue;
+        if (config->aklog_timeout <= 0)
+            continue;
+        deadline = (double) config->aklog_timeout
+                   - elapsed_since(&token_jobs[i].start);
+        if (left < 0 || deadline < left)
+            left = deadline;
+    }
+    if (wakeup != 0 || left >= 0) {
+        if (left < 0)
+            left = 0;
+        timeout.tv_sec = (time_t) left;
+        timeout.tv_nsec = (long) ((left - (double) timeout.tv_sec) * 1e9);
+        tp = &timeout;
+    }
+    FD_ZERO(&fds);
+    if (config->attach)
+        maxfd = attach_fds(&fds);
+#ifdef HAVE_SYS_TIMERFD_H
+    if (tp != NULL && left > 0 && timer_wait(&timeout, mask, &fds, maxfd))
+        return;
+#endif
+    pselect(maxfd, &fds, NULL, NULL, tp, mask);
+}
+
+
+/*
+ * Wait for the running token jobs and any queued cells to finish or to be
+ * killed for exceeding their timeout.  Used for the initial token refresh so
+ * that the command is not started until tokens have been obtained.  A job
+ * that doesn't exit even when killed (such as one stuck in the kernel) is
+ * left to be reaped later.
+ */
+static void
+jobs_wait(krb5_context ctx, struct config *config)
+{
+    sigset_t block, mask;
+    size_t i;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &mask);
+    jobs_check(ctx, config);
+    while (jobs_busy(config)) {
+        wait_until(config, 0, &mask);
+        jobs_check(ctx, config);
+    }
+
+    /* If we killed any jobs, give them a second to exit and reap them. */
+    for (i = 0; i < token_slots; i++)
+        if (token_jobs[i].pid != 0) {
+            wait_until(config, clock_now() + 1, &mask);
+            jobs_check(ctx, config);
+            break;
+        }
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+
+/*
+ * Refresh AFS tokens, either by obtaining them directly for the configured
+ * cells or by starting aklog.  With only one cell, tokens are obtained
+ * in-process.  With several, each cell is refreshed in its own child process,
+ * with up to config->jobs running at once.  Cells or an aklog whose previous
+ * refresh is still running are not started again.  If wait is true, wait for
+ * all of the refreshes to finish (up to their timeout) before returning.
+ */
+static void
+refresh_tokens(krb5_context ctx, struct config *config, bool wait)
+{
+    size_t i, count;
+
+    if (config->cells != NULL && config->cells[1] == NULL) {
+        tokens_set(ctx, config, config->cells[0]);
+        return;
+    }
+    if (token_jobs == NULL) {
+        token_slots = (config->cells == NULL) ? 1 : (size_t) config->jobs;
+        token_jobs = xcalloc(token_slots, sizeof(struct token_job));
+        if (config->cells != NULL) {
+            for (count = 0; config->cells[count] != NULL; count++)
+                ;
+            cells_pending = xcalloc(count, sizeof(bool));
+        }
+    }
+    if (config->cells == NULL) {
+        if (job_running(NULL)) {
+            if (config->verbose)
+                notice("%s still running, not starting it again",
+                       config->aklog);
+        } else
+            job_start(ctx, config, NULL);
+    } else {
+        for (i = 0; config->cells[i] != NULL; i++) {
+            if (job_running(config->cells[i])) {
+                if (config->verbose)
+                    notice("%s: token refresh still running, not starting it"
+                           " again", config->cells[i]);
+            } else
+                cells_pending[i] = true;
+        }
+        jobs_start_pending(ctx, config);
+    }
+    if (wait)
+        jobs_wait(ctx, config);
+}
+
+
+/*
+ * Refresh AFS tokens after getting or renewing a ticket, or when it's time
+ * to check on them, and return the time at which they should next be
+ * checked.  Without a token refresh window, always refresh them and return
+ * 0.  Otherwise, only refresh them if they are missing or expire within the
+ * window, and return the time at which they will enter the window.  If we
+ * can't tell when the new tokens expire (because AFS isn't running, their
+ * expiration can't be read, or aklog is still running, for example), fall
+ * back on refreshing them each time the ticket is renewed by returning 0.
+ */
+static time_t
+check_tokens(krb5_context ctx, struct config *config, bool wait)
+{
+    time_t expires, window;
+
+    if (config->token_window == 0) {
+        refresh_tokens(ctx, config, wait);
+        return 0;
+    }
+    window = config->token_window * 60;
+    expires = tokens_expiration(config);
+    if (expires == 0 || clock_from_real(expires) <= clock_now() + window) {
+        if (config->verbose)
+            notice("AFS tokens missing or expiring, refreshing");
+        refresh_tokens(ctx, config, wait);
+        expires = tokens_expiration(config);
+        if (expires == 0 || clock_from_real(expires) <= clock_now() + window) {
+            if (config->verbose)
+                notice("cannot determine AFS token expiration, refreshing"
+                       " with each ticket renewal");
+            return 0;
+        }
+    }
+    return clock_from_real(expires) - window;
+}
+
+
 /*
  * Get the principal name for the krbtgt ticket for the local realm.  The
  * caller is responsible for freeing the principal.  Takes an existing
@@ -170,8 +677,8 @@ ticket_expired(krb5_context ctx, struct config *config)
     increds_valid = true;
 
     /* Check the expiration time and renewal limit. */
-    now = time(NULL);
-    then = outcreds->times.endtime;
+    now = clock_now();
+    then = clock_from_real(outcreds->times.endtime);
     if (config->happy_ticket > 0)
         offset = 60 * (config->keep_ticket + config->happy_ticket);
     else
@@ -190,7 +697,7 @@ ticket_expired(krb5_context ctx, struct config *config)
      * lifespan if it was not renewable.
      */
     if (code == KRB5KRB_AP_ERR_TKT_EXPIRED) {
-        then = outcreds->times.renew_till;
+        then = clock_from_real(outcreds->times.renew_till);
         if (then < now + offset)
             code = KRB5KDC_ERR_KEY_EXP;
     }
@@ -214,6 +721,123 @@ done:
 }
 
 
+/*
+ * Copy a string into a fixed-size field of the status record, truncating it
+ * if necessary.
+ */
+static void
+status_string(char *field, size_t size, const char *string)
+{
+    if (string == NULL)
+        string = "";
+    snprintf(field, size, "%s", string);
+}
+
+
+/*
+ * Fill in the principal in the status record if it isn't already known.  For
+ * krenew, and for k5start when the principal came from the keytab, this has
+ * to come from the ticket cache, so it may not be known until the first
+ * successful authentication.
+ */
+static void
+status_principal(krb5_context ctx, struct config *config)
+{
+    krb5_ccache ccache;
+    krb5_principal princ = NULL;
+    char *name;
+
+    if (status_state.principal[0] != '\0')
+        return;
+    if (config->client == NULL) {
+        if (krb5_cc_resolve(ctx, config->cache, &ccache) != 0)
+            return;
+        if (krb5_cc_get_principal(ctx, ccache, &princ) != 0)
+            princ = NULL;
+        krb5_cc_close(ctx, ccache);
+        if (princ == NULL)
+            return;
+    }
+    if (krb5_unparse_name(ctx, princ == NULL ? config->client : princ, &name)
+        == 0) {
+        status_string(status_state.principal, sizeof(status_state.principal),
+                      name);
+        krb5_free_unparsed_name(ctx, name);
+    }
+    if (princ != NULL)
+        krb5_free_principal(ctx, princ);
+}
+
+
+/*
+ * Publish the status record if we have a status file.
+ */
+static void
+status_update(void)
+{
+    if (status_file != NULL)
+        status_publish(status_file, &status_state);
+}
+
+
+/*
+ * Open the status file and publish the initial record.  Called after
+ * backgrounding so that the PID is correct.  As with PID files, errors are
+ * reported but otherwise ignored.
+ */
+static void
+status_start(krb5_context ctx, struct config *config)
+{
+    status_file = status_open(config->statusfile);
+    if (status_file == NULL)
+        return;
+    status_state.pid = getpid();
+    status_state.started = clock_now();
+    status_string(status_state.program, sizeof(status_state.program),
+                  message_program_name);
+    status_string(status_state.cache, sizeof(status_state.cache),
+                  config->cache);
+    status_principal(ctx, config);
+    status_update();
+}
+
+
+/*
+ * Call the authentication callback, timing it and recording the result in the
+ * status record.  With -M, also publish the new tickets to the command's
+ * memory file.  Takes and returns the same status codes as the callback.
+ */
+static krb5_error_code
+authenticate(krb5_context ctx, struct config *config, krb5_error_code status)
+{
+    krb5_error_code code;
+    struct timeval start;
+    const char *message;
+
+    gettimeofday(&start, NULL);
+    code = config->auth(ctx, config, status);
+    if (code == 0 && config->memfd)
+        code = memfd_cache_export(ctx, config);
+    if (config->statusfile == NULL)
+        return code;
+    status_state.latency = (int64_t) (elapsed_since(&start) * 1000000.0);
+    if (code == 0) {
+        status_state.last_success = clock_now();
+        status_state.successes++;
+        status_principal(ctx, config);
+    } else {
+        status_state.last_failure = clock_now();
+        status_state.failures++;
+        message = krb5_get_error_message(ctx, code);
+        status_string(status_state.error, sizeof(status_state.error),
+                      message);
+        krb5_free_error_message(ctx, message);
+    }
+    status_update();
+    return code;
+}
+
+
 /*
  * Retry the initial authentication when the program is first starting.  Retry
  * the authentication immediately, then after one second, and keep trying with
@@ -226,16 +850,19 @@ retry_auth(krb5_context ctx, struct config *config)
     krb5_error_code code;
     struct timeval timeout;
     unsigned int delay = 1;
+    double wait;
 
-    code = config->auth(ctx, config, 0);
+    code = authenticate(ctx, config, 0);
     while (code != 0) {
-        timeout.tv_sec = delay;
-        timeout.tv_usec = 0;
+        wait = clock_interval(delay);
+        timeout.tv_sec = (time_t) wait;
+        timeout.tv_usec =
+            (suseconds_t) ((wait - (double) timeout.tv_sec) * 1e6);
         delay = (delay < 30) ? delay * 2 : delay;
         select(0, NULL, NULL, NULL, &timeout);
         if (exit_signaled)
             exit_cleanup(ctx, config, 1);
-        code = config->auth(ctx, config, 0);
+        code = authenticate(ctx, config, 0);
     }
     return code;
 }
@@ -245,7 +872,7 @@ retry_auth(krb5_context ctx, struct config *config)
  * Write out a PID file given the path to the file and the PID to write.
  * Errors are reported but otherwise ignored.
  */
-static void
+void
 write_pidfile(const char *path, pid_t pid)
 {
     FILE *file;
@@ -262,10 +889,37 @@ write_pidfile(const char *path, pid_t pid)
 }
 
 
+/*
+ * Do the setup that has to happen before anything else, including any memory
+ * allocation.  Start the clock, which the builds of k5start and krenew for
+ * the test suite run faster than real time if KSTART_CLOCK_SCALE is set.
+ * That must never be honored by the installed programs since it changes how
+ * long tickets are requested for and when they are renewed.  The test suite
+ * builds also start counting allocations here if KSTART_ALLOC_STATS is set,
+ * so that every block freed later was counted when it was allocated.
+ */
+void
+start_framework(void)
+{
+#ifdef KSTART_TEST_HOOKS
+    const char *value;
+
+    if (getenv("KSTART_ALLOC_STATS") != NULL)
+        xmalloc_accounting = true;
+    value = getenv("KSTART_CLOCK_SCALE");
+    if (value != NULL && *value != '\0') {
+        clock_init(clock_parse_scale(value));
+        return;
+    }
+#endif
+    clock_init(1);
+}
+
+
 /*
  * Add a signal handler, exiting if there was a failure.
  */
-static void
+void
 add_handler(krb5_context ctx, struct config *config, void (*handler)(int),
             int sig, const char *name)
 {
@@ -283,7 +937,7 @@ add_handler(krb5_context ctx, struct config *config, void (*handler)(int),
 /*
  * Probe to see if the Linux kafs subsystem is available.
  */
-static bool
+bool
 has_kafs(void)
 {
     struct stat st;
@@ -328,6 +982,130 @@ create_keyring(krb5_context ctx UNUSED, struct config *config UNUSED)
 #endif
 
 
+#ifdef KSTART_TEST_HOOKS
+/*
+ * Report allocation statistics for the test suite: the number of allocations
+ * and bytes allocated through xmalloc and not yet freed, and the resident set
+ * size in KB if we can find it.
+ */
+static void
+report_allocations(void)
+{
+    struct xmalloc_stats stats;
+    FILE *status;
+    char line[256];
+    unsigned long rss = 0;
+
+    xmalloc_stats(&stats);
+    status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        while (fgets(line, sizeof(line), status) != NULL)
+            if (sscanf(line, "VmRSS: %lu", &rss) == 1)
+                break;
+        fclose(status);
+    }
+    notice("allocations: %ld live, %lld bytes live, %lu KB RSS", stats.count,
+           stats.bytes, rss);
+}
+#endif
+
+
+/*
+ * Switch notice and warn to the queued message handlers so that neither
+ * authentication nor the main loop ever blocks writing messages if standard
+ * output or syslog backs up.  The queue is drained from the main loop.  die
+ * is left alone, since it exits anyway and flushes the queue first.
+ */
+static void
+queue_messages(struct config *config)
+{
+    message_queue_init(LOG_QUEUE_SIZE, LOG_DAEMON);
+    if (config->log_syslog) {
+        message_handlers_notice(2, message_log_queue_stdout,
+                                message_log_queue_syslog_notice);
+        message_handlers_warn(2, message_log_queue_stderr,
+                              message_log_queue_syslog_warning);
+    } else {
+        message_handlers_notice(1, message_log_queue_stdout);
+        message_handlers_warn(1, message_log_queue_stderr);
+    }
+}
+
+
+/*
+ * Called when the command exits with the given status.  Decide whether to
+ * restart it and, if so, return the time at which to restart it.  Otherwise,
+ * return 0.  The command is not restarted if we propagated a signal to it,
+ * since then it was asked to stop.  The delay before the restart starts at
+ * one second and doubles with each restart in a row, up to the configured
+ * maximum.
+ */
+static time_t
+restart_schedule(krb5_context ctx, struct config *config, int status)
+{
+    time_t now;
+
+    if (!config->restart || command_signal() != 0)
+        return 0;
+    now = clock_now();
+    if (now - restart_state.started >= config->restart_delay) {
+        restart_state.count = 0;
+        restart_state.delay = 0;
+    }
+    if (config->restart_limit > 0
+        && restart_state.count >= config->restart_limit) {
+        warn("%s exited with status %d, not restarting after %ld restarts",
+             config->command[0], status, restart_state.count);
+        return 0;
+    }
+    restart_state.count++;
+    if (restart_state.delay == 0)
+        restart_state.delay = 1;
+    else
+        restart_state.delay *= 2;
+    if (restart_state.delay > config->restart_delay)
+        restart_state.delay = config->restart_delay;
+    warn("%s exited with status %d, restarting in %ld seconds",
+         config->command[0], status, restart_state.delay);
+
+    /*
+     * The signal handlers installed by command_start would propagate signals
+     * to the exited command, so catch them ourselves until it is restarted.
+     */
+    add_handler(ctx, config, exit_handler, SIGHUP, "SIGHUP");
+    add_handler(ctx, config, exit_handler, SIGINT, "SIGINT");
+    add_handler(ctx, config, exit_handler, SIGQUIT, "SIGQUIT");
+    add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
+    return now + restart_state.delay;
+}
+
+
+/*
+ * Start the command, exiting on failure, and return its PID.  The existing
+ * ticket cache and tokens are used as is, so restarting the command doesn't
+ * require reauthenticating.  The command is started with an empty signal
+ * mask, so this may be called with signals blocked.
+ */
+static pid_t
+start_command(krb5_context ctx, struct config *config)
+{
+    pid_t child;
+
+    child = command_start(config->command[0], config->command);
+    if (child < 0) {
+        syswarn("unable to run command %s", config->command[0]);
+        exit_cleanup(ctx, config, 1);
+    }
+    if (config->childfile != NULL)
+        write_pidfile(config->childfile, child);
+    config->child = child;
+    restart_state.started = clock_now();
+    status_state.child = child;
+    status_update();
+    return child;
+}
+
+
 /*
  * The primary entry point of the framework.  Both k5start and krenew call
  * this function after setting up the options and configuration to do the real
@@ -341,6 +1119,10 @@ run_framework(krb5_context ctx, struct config *config)
     pid_t child = 0;
     int result;
     int status = 0;
+    time_t token_check = 0;
+#ifdef KSTART_TEST_HOOKS
+    bool alloc_stats;
+#endif
 
     /* Set aklog from AKLOG, KINIT_PROG, or the compiled-in default. */
     aklog = getenv("AKLOG");
@@ -348,7 +1130,17 @@ run_framework(krb5_context ctx, struct config *config)
         aklog = getenv("KINIT_PROG");
     if (aklog == NULL)
         aklog = PATH_AKLOG;
-    if (aklog[0] == '\0' && config->do_aklog) {
+    config->aklog = aklog;
+
+#ifdef KSTART_TEST_HOOKS
+    /*
+     * If start_framework started counting allocations, report allocation
+     * statistics after each authentication in the main loop.  This is used by
+     * the test suite to check that a long-running daemon doesn't grow.
+     */
+    alloc_stats = xmalloc_accounting;
+#endif
+    if (aklog[0] == '\0' && config->do_aklog && config->cells == NULL) {
         warn("set AKLOG to specify the path to aklog");
         exit_cleanup(ctx, config, 1);
     }
@@ -373,6 +1165,10 @@ run_framework(krb5_context ctx, struct config *config)
         }
     }
 
+    /* Catch SIGCHLD so that we notice promptly when token jobs finish. */
+    if (config->do_aklog)
+        add_handler(ctx, config, child_handler, SIGCHLD, "SIGCHLD");
+
     /*
      * Do the authentication once even if not necessary so that we can check
      * for any problems while we still have standard error.  If -H wasn't set,
@@ -380,20 +1176,23 @@ run_framework(krb5_context ctx, struct config *config)
      * isn't expired.
      */
     if (config->happy_ticket == 0)
-        code = config->auth(ctx, config, 0);
+        code = authenticate(ctx, config, 0);
     else {
         code = ticket_expired(ctx, config);
         if (code != 0)
-            code = config->auth(ctx, config, code);
+            code = authenticate(ctx, config, code);
     }
     if (code != 0)
         status = 1;
     if (code != 0 && !config->ignore_errors)
         exit_cleanup(ctx, config, status);
 
-    /* If requested, run the aklog program. */
+    /*
+     * If requested, run the aklog program.  Wait for it to finish, up to its
+     * timeout, so that the command isn't started without tokens.
+     */
     if (code == 0 && config->do_aklog)
-        command_run(aklog, config->verbose);
+        token_check = check_tokens(ctx, config, true);
 
     /*
      * If told to background, background ourselves.  We do this late so that
@@ -407,9 +1206,11 @@ run_framework(krb5_context ctx, struct config *config)
             exit_cleanup(ctx, config, 1);
         }
 
-    /* Write out the PID file. */
+    /* Write out the PID file and start the status file. */
     if (config->pidfile != NULL)
         write_pidfile(config->pidfile, getpid());
+    if (config->statusfile != NULL)
+        status_start(ctx, config);
 
     /*
      * Now, if the initial authentication failed and we're ignoring initial
@@ -428,59 +1229,124 @@ run_framework(krb5_context ctx, struct config *config)
         add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
         code = retry_auth(ctx, config);
         if (code == 0 && config->do_aklog)
-            command_run(aklog, config->verbose);
+            token_check = check_tokens(ctx, config, true);
     }
 
     /* Spawn the external command, if we were told to run one. */
     if (config->command != NULL) {
-        child = command_start(config->command[0], config->command);
-        if (child < 0) {
-            syswarn("unable to run command %s", config->command[0]);
-            exit_cleanup(ctx, config, 1);
-        }
+        child = start_command(ctx, config);
         if (config->keep_ticket == 0)
             config->keep_ticket = 60;
-        if (config->childfile != NULL)
-            write_pidfile(config->childfile, child);
-        config->child = child;
     }
 
-    /* Loop if we're running as a daemon. */
+    /*
+     * Loop if we're running as a daemon.  The signals whose handlers we check
+     * are blocked except while waiting so that none of them are lost between
+     * checking for them and going to sleep.  Besides the regular wakeups to
+     * check the ticket, we also wake up when a token job exits or reaches
+     * its timeout, but those wakeups don't count as a check.  If we have a
+     * token refresh window, we also wake up to check tokens on their own
+     * schedule, and if we're restarting the command, we wake up to restart
+     * it.  With -z, every check also compacts the ticket cache.
+     */
     if (config->keep_ticket > 0) {
-        struct timeval timeout;
+        sigset_t block, mask;
+        time_t wakeup, next;
+        time_t restart = 0;
+
+        /*
+         * Messages are only queued once we reach the main loop, since that's
+         * what drains the queue, and so that initial errors are reported
+         * directly before we background.
+         */
+        if (config->queue_logs)
+            queue_messages(config);
 
         add_handler(ctx, config, alarm_handler, SIGALRM, "SIGALRM");
         if (config->command == NULL) {
             add_handler(ctx, config, exit_handler, SIGHUP, "SIGHUP");
             add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
         }
+        sigemptyset(&block);
+        sigaddset(&block, SIGALRM);
+        sigaddset(&block, SIGCHLD);
+        sigaddset(&block, SIGHUP);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGQUIT);
+        sigaddset(&block, SIGTERM);
+        sigprocmask(SIG_BLOCK, &block, &mask);
+#ifdef KSTART_TEST_HOOKS
+        /*
+         * Report once before the first check so that the test suite knows
+         * our signal handlers are in place.
+         */
+        if (alloc_stats)
+            report_allocations();
+#endif
+        wakeup = clock_now() + ((code == 0) ? config->keep_ticket * 60 : 60);
         while (1) {
-            if (config->command != NULL) {
+            if (config->command != NULL && child != 0) {
                 result = command_finish(child, &status);
                 if (result < 0) {
                     syswarn("waitpid for %lu failed", (unsigned long) child);
                     exit_cleanup(ctx, config, 1);
                 }
                 if (result > 0) {
+                    child = 0;
                     config->child = 0;
-                    break;
+                    status_state.child = 0;
+                    status_update();
+                    restart = restart_schedule(ctx, config, status);
+                    if (restart == 0)
+                        break;
                 }
             }
-            timeout.tv_sec = (code == 0) ? config->keep_ticket * 60 : 60;
-            timeout.tv_usec = 0;
-            select(0, NULL, NULL, NULL, &timeout);
+            if (config->do_aklog)
+                jobs_check(ctx, config);
             if (exit_signaled)
                 exit_cleanup(ctx, config, 0);
-            code = ticket_expired(ctx, config);
-            if (alarm_signaled || config->always_renew || code != 0) {
-                code = config->auth(ctx, config, code);
-                if (code != 0 && config->exit_errors)
-                    exit_cleanup(ctx, config, 1);
-                if (code == 0 && config->do_aklog)
-                    command_run(aklog, config->verbose);
+            if (config->attach && !attach_service(config))
+                break;
+            if (alarm_signaled || clock_now() >= wakeup) {
+                code = ticket_expired(ctx, config);
+                if (alarm_signaled || config->always_renew || code != 0) {
+                    code = authenticate(ctx, config, code);
+#ifdef KSTART_TEST_HOOKS
+                    if (alloc_stats)
+                        report_allocations();
+#endif
+                    if (code != 0 && config->exit_errors)
+                        exit_cleanup(ctx, config, 1);
+                    if (code == 0 && config->do_aklog)
+                        token_check = check_tokens(ctx, config, false);
+                }
+                if (config->compact)
+                    compact_cache(cache_path(config->cache), config->verbose);
+                alarm_signaled = 0;
+                wakeup = clock_now();
+                wakeup += (code == 0) ? config->keep_ticket * 60 : 60;
+            }
+            if (token_check != 0 && clock_now() >= token_check)
+                token_check = check_tokens(ctx, config, false);
+            if (restart != 0 && clock_now() >= restart) {
+                child = start_command(ctx, config);
+                restart = 0;
+            }
+            if (status_state.next_wakeup != wakeup) {
+                status_state.next_wakeup = wakeup;
+                status_update();
             }
-            alarm_signaled = 0;
+            next = wakeup;
+            if (token_check != 0 && token_check < next)
+                next = token_check;
+            if (restart != 0 && restart < next)
+                next = restart;
+            if (config->queue_logs && !message_queue_drain()
+                && clock_now() + 1 < next)
+                next = clock_now() + 1;
+            wait_until(config, next, &mask);
         }
+        sigprocmask(SIG_SETMASK, &mask, NULL);
     }
 
     /* All done. */
@@ -512,6 +1378,12 @@ exit_cleanup(krb5_context ctx, struct config *config, int status)
         unlink(config->pidfile);
     if (config->childfile != NULL)
         unlink(config->childfile);
+    status_close(status_file, true);
+    if (config->attach)
+        attach_close();
     krb5_free_context(ctx);
+    message_repeats_flush();
+    if (config->queue_logs)
+        message_queue_flush();
     exit(status);
 }
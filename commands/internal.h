@@ -22,6 +22,34 @@
 #include <portable/macros.h>
 #include <portable/stdbool.h>
 
+#ifdef HAVE_SYS_SELECT_H
+#    include <sys/select.h>
+#endif
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * The number of seconds of fudge to add to the check for whether we need to
+ * obtain a new ticket.  This is here to make sure that we don't wake up just
+ * as the ticket is expiring.
+ */
+#define EXPIRE_FUDGE (2 * 60)
+
+/* The default number of seconds to wait for aklog before killing it. */
+#define DEFAULT_AKLOG_TIMEOUT 60
+
+/*
+ * The default number of parallel jobs, used for k5start batch mode and for
+ * obtaining tokens for several cells.
+ */
+#define DEFAULT_JOBS 8
+
+/* The number of messages that can be queued with -Q. */
+#define LOG_QUEUE_SIZE 256
+
+/* The default maximum seconds to wait before restarting a command. */
+#define DEFAULT_RESTART_DELAY 300
+
 /* Private structs used by krenew and k5start for internal configuration. */
 struct k5start_private;
 struct krenew_private;
@@ -29,21 +57,35 @@ struct krenew_private;
 /* The struct used to pass configuration details to run_framework. */
 struct config {
     bool always_renew;  /* Whether to renew on every wakeup. */
+    bool attach;        /* Whether to share the cache with krenew -J. */
     bool background;    /* Whether to run in the background. */
     bool clean_cache;   /* Whether to destroy ticket cache at exit. */
+    bool compact;       /* Whether to compact the ticket cache on wakeup. */
     bool do_aklog;      /* Whether to run aklog. */
     bool exit_errors;   /* Whether to exit on error as a daemon. */
     bool ignore_errors; /* Ignore errors on initial authentication. */
+    bool log_syslog;    /* Whether messages also go to syslog. */
+    bool memfd;         /* Whether to give the command a memfd cache. */
+    bool queue_logs;    /* Whether to queue messages rather than block. */
     bool verbose;       /* Whether to do verbose logging. */
 
     char **command;    /* NULL-terminated command to run, if any. */
     long happy_ticket; /* Remaining life of ticket required. */
     long keep_ticket;  /* How often to wake up to check ticket. */
 
-    const char *aklog; /* Path to aklog. */
+    bool restart;       /* Whether to restart the command when it exits. */
+    long restart_limit; /* Maximum restarts in a row, or 0 for no limit. */
+    long restart_delay; /* Maximum seconds to wait before a restart. */
+
+    const char *aklog;  /* Path to aklog. */
+    long aklog_timeout; /* Seconds to wait for aklog, or 0 for no limit. */
+    char **cells;       /* Cells for native tokens instead of aklog. */
+    long token_window;  /* Refresh tokens this many minutes before expiry. */
+    long jobs;          /* Maximum token refreshes to run at once. */
 
-    const char *childfile; /* Path to child PID file to write out. */
-    const char *pidfile;   /* Path to PID file to write out. */
+    const char *childfile;  /* Path to child PID file to write out. */
+    const char *pidfile;    /* Path to PID file to write out. */
+    const char *statusfile; /* Path to status file to maintain. */
 
     const char *cache; /* Ticket cache to maintain. */
 
@@ -89,9 +131,109 @@ void run_framework(krb5_context, struct config *)
 void exit_cleanup(krb5_context, struct config *, int status)
     __attribute__((__nonnull__, __noreturn__));
 
+/*
+ * Check whether the given ticket cache, or the default cache if it is NULL,
+ * has a ticket-granting ticket good for at least the given number of minutes
+ * and return the exit status to use: 0 if so and 1 if not.  Reads FILE caches
+ * directly without initializing a Kerberos context where possible.
+ */
+int check_ticket(const char *cache, long minutes);
+
+/*
+ * Read the expiration and renewable lifetime of the ticket-granting ticket
+ * from a FILE ticket cache directly.  Returns false if the file can't be
+ * parsed and sets both times to 0 if the cache has no ticket-granting ticket.
+ * If expected is not NULL, path must not be a symlink and must still be the
+ * file, with the same owner, that expected was returned by lstat for.
+ */
+bool cache_times(const char *path, const struct stat *expected,
+                 time_t *endtime, time_t *renew_till)
+    __attribute__((__nonnull__(1, 3, 4)));
+
+/*
+ * Return the path to the file holding a FILE ticket cache or DIR subsidiary
+ * cache, or NULL for other cache types.  compact_cache rewrites such a file
+ * without expired or superseded tickets, reporting but otherwise ignoring
+ * errors (-z).
+ */
+const char *cache_path(const char *cache) __attribute__((__nonnull__));
+void compact_cache(const char *path, bool verbose)
+    __attribute__((__nonnull__));
+
+/*
+ * The main loop of krenew -A, which renews every ticket cache found in a
+ * NULL-terminated list of directories using config->auth.  Never returns.
+ */
+void run_scan(krb5_context, struct config *, char **dirs)
+    __attribute__((__nonnull__, __noreturn__));
+
+/*
+ * Run the command in config->command with the ticket cache of the shared
+ * renewer for the principal of the given cache, starting the renewer if
+ * necessary (krenew -J).  Returns only in a newly started renewer, which
+ * should then copy the cache and run the framework with config->attach set.
+ */
+void attach_command(krb5_context, struct config *, krb5_ccache)
+    __attribute__((__nonnull__));
+
+/*
+ * Used by the framework in a shared renewer.  attach_fds adds the sockets to
+ * wait on to a set and returns the highest plus one, attach_service handles
+ * attaching and detaching commands and returns false once none are left, and
+ * attach_close removes the socket.
+ */
+int attach_fds(fd_set *) __attribute__((__nonnull__));
+bool attach_service(struct config *) __attribute__((__nonnull__));
+void attach_close(void);
+
+/*
+ * Create the memory file for the command's ticket cache with -M, returning
+ * its FILE cache name, and write the ticket cache we maintain to it after
+ * each authentication.
+ */
+const char *memfd_cache_init(void);
+krb5_error_code memfd_cache_export(krb5_context, struct config *)
+    __attribute__((__nonnull__));
+
+/*
+ * Do the setup that must come before any memory allocation: start the clock
+ * and, in the builds for the test suite, allocation accounting.  The builds
+ * for the test suite may run the clock faster than real time; the installed
+ * programs always use real time.
+ */
+void start_framework(void);
+
+/* Write out a PID file, reporting but otherwise ignoring errors. */
+void write_pidfile(const char *path, pid_t pid) __attribute__((__nonnull__));
+
+/* Add a signal handler, exiting through exit_cleanup on failure. */
+void add_handler(krb5_context, struct config *, void (*handler)(int), int sig,
+                 const char *name) __attribute__((__nonnull__));
+
+/* Probe to see if the Linux kafs subsystem is available. */
+bool has_kafs(void);
+
 /* A small helper routine for parsing command-line options. */
 long convert_number(const char *string, int base) __attribute__((__nonnull__));
 
+/* Add a cell to the list of cells for which to obtain tokens natively. */
+void tokens_add_cell(struct config *, const char *cell)
+    __attribute__((__nonnull__));
+
+/*
+ * Obtain AFS tokens for a cell directly rather than by running aklog, using
+ * the ticket cache being maintained.  Returns a Kerberos error code or errno
+ * value after reporting any errors.
+ */
+krb5_error_code tokens_set(krb5_context, struct config *, const char *cell)
+    __attribute__((__nonnull__));
+
+/*
+ * Return the expiration time of our AFS tokens, or 0 if they are missing or
+ * their expiration can't be determined.
+ */
+time_t tokens_expiration(struct config *) __attribute__((__nonnull__));
+
 END_DECLS
 
 #endif /* !INTERNAL_H */
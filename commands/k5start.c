@@ -27,10 +27,15 @@
 #include <grp.h>
 #include <pwd.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#    include <sys/time.h>
+#endif
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 
 #include <commands/internal.h>
+#include <util/clock.h>
 #include <util/macros.h>
 #include <util/messages-krb5.h>
 #include <util/messages.h>
@@ -39,12 +44,30 @@
 /* The default ticket lifetime in minutes.  Default to 10 hours. */
 #define DEFAULT_LIFETIME (10 * 60)
 
+/*
+ * An additional ticket cache to which each new set of credentials is written,
+ * along with the owner, group, and mode to give it.
+ */
+struct destination {
+    const char *cache; /* Path to the ticket cache. */
+    uid_t owner;       /* Owner of the ticket cache. */
+    gid_t group;       /* Group of the ticket cache. */
+    mode_t mode;       /* Mode of the ticket cache. */
+    bool set_perms;    /* Whether to set owner and perms on cache. */
+};
+
 /*
  * Holds the various command-line options for passing to functions, after
  * processing in the main routine and conversion to internal Kerberos data
  * structures where appropriate.
  */
 struct k5start_internal {
+    const char *sname;      /* Service name, if not krbtgt. */
+    const char *sinst;      /* Service instance, if not the realm. */
+    const char *srealm;     /* Service realm, if not the client realm. */
+    int lifetime;           /* Ticket lifetime in minutes. */
+    bool nonforwardable;    /* Whether to force non-forwardable tickets. */
+    bool nonproxiable;      /* Whether to force non-proxiable tickets. */
     char *service;          /* Service for which to get credentials. */
     krb5_principal ksprinc; /* Service principal. */
     const char *keytab;     /* Keytab to use to authenticate. */
@@ -55,7 +78,28 @@ struct k5start_internal {
     mode_t mode;            /* Mode of created ticket cache. */
     bool set_perms;         /* Whether to set owner and perms on cache. */
     const char *cache;      /* Path to destination cache. */
+    const char *armor;      /* Ticket cache for FAST armor, if any. */
+    struct destination *dests; /* Additional caches to write, from -d. */
+    size_t ndests;             /* Number of additional caches. */
+    const char **realms;       /* Realms for cross-realm tickets, from -X. */
+    size_t nrealms;            /* Number of cross-realm realms. */
     krb5_get_init_creds_opt *kopts;
+    krb5_get_init_creds_opt *armor_kopts;
+};
+
+/*
+ * An entry in the list of credentials to obtain in batch mode, along with
+ * the state of the worker process obtaining it.
+ */
+struct batch_entry {
+    char *keytab;          /* Keytab to use to authenticate. */
+    char *principal;       /* Client principal. */
+    char *cache;           /* Ticket cache to create. */
+    uid_t owner;           /* Owner of created ticket cache. */
+    gid_t group;           /* Group of created ticket cache. */
+    mode_t mode;           /* Mode of created ticket cache. */
+    pid_t pid;             /* PID of the worker, or 0 if not running. */
+    struct timeval start;  /* When the worker was started. */
 };
 
 /* The usage message. */
@@ -68,8 +112,18 @@ Usage: k5start [options] [name [command]]\n\
    -r <service realm>           (default: local realm)\n\
 \n\
    -a                   Renew on each wakeup when running as a daemon\n\
+   -B <file>            Obtain all credentials listed in <file> and exit\n\
    -b                   Fork and run in the background\n\
+   -C <cell>            Get AFS tokens for <cell> directly rather than\n\
+                        running aklog (may be given multiple times)\n\
    -c <file>            Write child process ID (PID) to <file>\n\
+   -D <seconds>         Wait at most <seconds> between restarts with -R\n\
+                        (default 300)\n\
+   -d <cache>[,<mode>[,<owner>[,<group>]]]\n\
+                        Also write the tickets to <cache> with the given\n\
+                        permissions (may be given multiple times)\n\
+   -E <minutes>         Only check the ticket, exiting 0 if it doesn't\n\
+                        expire in less than <minutes> minutes, otherwise 1\n\
    -F                   Force non-forwardable tickets\n\
    -f <keytab>          Use <keytab> for authentication rather than password\n\
    -g <group>           Set ticket cache group to <group>\n\
@@ -77,23 +131,44 @@ Usage: k5start [options] [name [command]]\n\
                         less than <limit> minutes, and exit 0 if it's okay,\n\
                         otherwise obtain a ticket\n\
    -h                   Display this usage message and exit\n\
+   -j <jobs>            Run at most <jobs> authentications at once with -B\n\
+                        or token refreshes at once with several -C\n\
    -K <interval>        Run as daemon, check ticket every <interval> minutes\n\
                         (implies -q unless -v is given)\n\
    -k <file>            Use <file> as the ticket cache\n\
    -L                   Log messages via syslog as well as stderr\n\
    -l <lifetime>        Ticket lifetime in minutes\n\
+   -M                   Give the command its ticket cache in memory via a\n\
+                        memfd rather than in a file in /tmp\n\
    -m <mode>            Set ticket cache permissions to <mode> (octal)\n\
+   -N <minutes>         Only refresh AFS tokens when they are missing or\n\
+                        expire within <minutes>, checking them separately\n\
+                        from the ticket\n\
+   -O <file>            Publish daemon status to <file> for kstart-status\n\
    -o <owner>           Set ticket cache owner to <owner>\n\
    -P                   Force non-proxiable tickets\n\
    -p <file>            Write process ID (PID) to <file>\n\
+   -Q                   Queue messages when running as a daemon rather than\n\
+                        blocking if output or syslog backs up\n\
    -q                   Don't output any unnecessary text\n\
+   -R <limit>           Restart the command when it exits, up to <limit>\n\
+                        times in a row (0 for no limit)\n\
    -s                   Read password on standard input\n\
+   -T <cache>           Use <cache> for FAST armor, refreshing it as needed\n\
    -t                   Get AFS token via aklog or AKLOG\n\
    -U                   Use the first principal in the keytab as the client\n\
                         principal and don't look for a principal on the\n\
                         command line\n\
    -v                   Verbose\n\
+   -W <seconds>         Report repeated identical warnings at most once\n\
+                        every <seconds>, with a count of repeats\n\
+   -w <seconds>         Kill aklog if it runs longer than <seconds> (0 for\n\
+                        no limit, default 60)\n\
+   -X <realm>           Also get cross-realm tickets for <realm> on each\n\
+                        authentication (may be given multiple times)\n\
    -x                   Exit immediately on any error\n\
+   -z                   Drop expired and superseded tickets from the ticket\n\
+                        cache on each check when running as a daemon\n\
 \n\
 If the environment variable AKLOG (or KINIT_PROG for backward compatibility)\n\
 is set to a program (such as aklog) then this program will be executed when\n\
@@ -127,27 +202,24 @@ usage(int status)
 
 
 /*
- * Given the path to a file and the internal configuration information, set the
- * owner, group, or mode.  Owner and group may be either the name of a user or
- * group or a numeric UID or GID (as a string).  If the owner is specified as
- * a username (but not if it is specified as a UID), set the GID, if
- * unspecified, to the primary group of that user.
+ * Given the path to a file and a destination, set the owner, group, or mode
+ * of the file to those of the destination.  An owner or group of -1 or a mode
+ * of 0 leaves that setting unchanged.
  *
  * Returns an errno on failure and zero on success.
  */
 static krb5_error_code
-set_permissions(const char *file, const struct k5start_internal *internal)
+set_permissions(const char *file, const struct destination *dest)
 {
-    if (internal->owner != (uid_t) -1 || internal->group != (gid_t) -1)
-        if (chown(file, internal->owner, internal->group) < 0) {
-            syswarn("cannot chown %s to %ld:%ld", file, (long) internal->owner,
-                    (long) internal->group);
+    if (dest->owner != (uid_t) -1 || dest->group != (gid_t) -1)
+        if (chown(file, dest->owner, dest->group) < 0) {
+            syswarn("cannot chown %s to %ld:%ld", file, (long) dest->owner,
+                    (long) dest->group);
             return errno;
         }
-    if (internal->mode != 0)
-        if (chmod(file, internal->mode) < 0) {
-            syswarn("cannot chmod %s to %o", file,
-                    (unsigned int) internal->mode);
+    if (dest->mode != 0)
+        if (chmod(file, dest->mode) < 0) {
+            syswarn("cannot chmod %s to %o", file, (unsigned int) dest->mode);
             return errno;
         }
     return 0;
@@ -155,46 +227,335 @@ set_permissions(const char *file, const struct k5start_internal *internal)
 
 
 /*
- * Authenticate, given the context and the processed command-line options.
- * Dies on failure.
+ * Parse an owner given either as a username or as a numeric UID and return
+ * the UID.  If the owner was given as a username, also store the primary
+ * group of that user in group; otherwise, set group to -1.  Dies if the
+ * username is unknown.
+ */
+static uid_t
+parse_owner(const char *owner, gid_t *group)
+{
+    struct passwd *pw;
+    uid_t uid;
+
+    *group = (gid_t) -1;
+    uid = (uid_t) convert_number(owner, 10);
+    if (uid == (uid_t) -1) {
+        pw = getpwnam(owner);
+        if (pw == NULL)
+            die("unknown user %s", owner);
+        uid = pw->pw_uid;
+        *group = pw->pw_gid;
+    }
+    return uid;
+}
+
+
+/*
+ * Parse a group given either as a group name or as a numeric GID and return
+ * the GID.  Dies if the group name is unknown.
+ */
+static gid_t
+parse_group(const char *group)
+{
+    struct group *gr;
+    gid_t gid;
+
+    gid = (gid_t) convert_number(group, 10);
+    if (gid == (gid_t) -1) {
+        gr = getgrnam(group);
+        if (gr == NULL)
+            die("unknown group %s", group);
+        gid = gr->gr_gid;
+    }
+    return gid;
+}
+
+
+/*
+ * Return the expiration time of the armor ticket in the given cache, or 0 if
+ * the cache doesn't contain a ticket-granting ticket for the realm of the
+ * client principal.  The armor cache generally holds anonymous credentials,
+ * so only the server principal is known in advance.
+ */
+static time_t
+armor_expiration(krb5_context ctx, struct config *config, krb5_ccache ccache)
+{
+    krb5_creds mcreds, creds;
+    const char *realm;
+    krb5_error_code code;
+    time_t expires = 0;
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    realm = krb5_principal_get_realm(ctx, config->client);
+    if (realm == NULL)
+        return 0;
+    code = krb5_cc_get_principal(ctx, ccache, &mcreds.client);
+    if (code != 0)
+        return 0;
+    code = krb5_build_principal(ctx, &mcreds.server,
+                                (unsigned int) strlen(realm), realm, "krbtgt",
+                                realm, (const char *) NULL);
+    if (code != 0)
+        goto done;
+    code = krb5_cc_retrieve_cred(ctx, ccache, 0, &mcreds, &creds);
+    if (code == 0) {
+        expires = creds.times.endtime;
+        krb5_free_cred_contents(ctx, &creds);
+    }
+
+done:
+    krb5_free_cred_contents(ctx, &mcreds);
+    return expires;
+}
+
+
+/*
+ * Make sure the FAST armor cache holds a ticket-granting ticket that will
+ * last until after our next wakeup.  If it does, reuse it, so that steady
+ * state authentication costs no more KDC exchanges than it would without
+ * FAST.  Otherwise, obtain a new armor ticket with anonymous PKINIT and store
+ * it in the armor cache.
+ *
+ * Failure to refresh the armor ticket is only reported as an error if the
+ * existing armor ticket has already expired.  Returns a Kerberos status code.
  */
 static krb5_error_code
-authenticate(krb5_context ctx, struct config *config,
-             krb5_error_code status UNUSED)
+refresh_armor(krb5_context ctx, struct config *config)
 {
     struct k5start_internal *internal = config->internal.k5start;
-    krb5_error_code code;
-    krb5_keytab keytab = NULL;
+    krb5_ccache ccache;
+    krb5_principal anon = NULL;
     krb5_creds creds;
-    const char *cache = config->cache;
-    krb5_ccache ccache = NULL;
-    int oerrno;
+    const char *realm;
+    time_t now, expires;
+    krb5_error_code code;
 
-    /*
-     * If we have owner, group, or mode information, we have to create a
-     * separate temporary ticket cache, change its ownership, and then rename
-     * it.
-     */
-    if (internal->set_perms) {
-        int fd;
-        char *tmp;
+    code = krb5_cc_resolve(ctx, internal->armor, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error opening armor cache %s", internal->armor);
+        return code;
+    }
+    now = clock_now();
+    expires = clock_from_real(armor_expiration(ctx, config, ccache));
+    if (expires > now + 60 * config->keep_ticket + EXPIRE_FUDGE) {
+        krb5_cc_close(ctx, ccache);
+        return 0;
+    }
+    if (config->verbose)
+        notice("getting FAST armor ticket in %s", internal->armor);
+
+    /* Obtain new anonymous credentials and store them in the cache. */
+    memset(&creds, 0, sizeof(creds));
+    realm = krb5_principal_get_realm(ctx, config->client);
+    if (realm == NULL) {
+        code = KRB5_CONFIG_NODEFREALM;
+        goto done;
+    }
+    code = krb5_build_principal(ctx, &anon, (unsigned int) strlen(realm),
+                                realm, "WELLKNOWN", "ANONYMOUS",
+                                (const char *) NULL);
+    if (code != 0)
+        goto done;
+    code = krb5_get_init_creds_password(ctx, &creds, anon, NULL, NULL, NULL,
+                                        0, NULL, internal->armor_kopts);
+    if (code != 0)
+        goto done;
+    code = krb5_cc_initialize(ctx, ccache, creds.client);
+    if (code != 0)
+        goto done;
+    code = krb5_cc_store_cred(ctx, ccache, &creds);
 
-        xasprintf(&tmp, "%s_XXXXXX", config->cache);
+done:
+    if (code != 0) {
+        warn_krb5(ctx, code, "error getting FAST armor ticket");
+        if (expires > now)
+            code = 0;
+    }
+    if (anon != NULL)
+        krb5_free_principal(ctx, anon);
+    krb5_free_cred_contents(ctx, &creds);
+    krb5_cc_close(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Store a set of credentials in the ticket cache for a destination, or all of
+ * the credentials in the source cache if one is given.  If we have owner,
+ * group, or mode information, we have to create a separate temporary ticket
+ * cache, change its ownership, and then rename it into place.  Returns a
+ * Kerberos error code or errno value after reporting any errors.
+ */
+static krb5_error_code
+store_creds(krb5_context ctx, krb5_principal client, krb5_creds *creds,
+            krb5_ccache source, const struct destination *dest)
+{
+    krb5_error_code code;
+    krb5_ccache ccache = NULL;
+    const char *cache = dest->cache;
+    char *tmp = NULL;
+    int fd;
+
+    if (dest->set_perms) {
+        xasprintf(&tmp, "%s_XXXXXX", dest->cache);
         fd = mkstemp(tmp);
         if (fd < 0) {
+            code = errno;
             syswarn("cannot create temporary ticket cache file");
-            return errno;
+            xfree(tmp);
+            return code;
         }
         if (fchmod(fd, 0600) < 0) {
+            code = errno;
             syswarn("cannot chmod temporary ticket cache file");
-            oerrno = errno;
-            unlink(tmp);
-            return oerrno;
+            close(fd);
+            goto done;
         }
         close(fd);
         cache = tmp;
     }
 
+    /* Set up the new ticket cache. */
+    code = krb5_cc_resolve(ctx, cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error creating ticket cache");
+        goto done;
+    }
+    code = krb5_cc_initialize(ctx, ccache, client);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error initializing ticket cache");
+        goto done;
+    }
+    if (source != NULL)
+        code = krb5_cc_copy_cache(ctx, source, ccache);
+    else
+        code = krb5_cc_store_cred(ctx, ccache, creds);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error storing credentials");
+        goto done;
+    }
+    krb5_cc_close(ctx, ccache);
+    ccache = NULL;
+
+    /*
+     * If we aren't changing ownership or permissions, we're done.  If we are,
+     * set the owner, group, and mode of the resulting cache, and then rename
+     * it into place.
+     */
+    if (dest->set_perms) {
+        code = set_permissions(tmp, dest);
+        if (code != 0)
+            goto done;
+        if (rename(tmp, dest->cache) < 0) {
+            code = errno;
+            syswarn("cannot rename %s to %s", tmp, dest->cache);
+            goto done;
+        }
+    }
+
+done:
+    /* If we failed and were generating a separate cache, unlink it. */
+    if (tmp != NULL) {
+        unlink(tmp);
+        xfree(tmp);
+    }
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Put the newly obtained credentials in a MEMORY cache and use them to get
+ * tickets for each realm given with -X.  We ask for that realm's own TGT,
+ * krbtgt/REALM@REALM, rather than krbtgt/REALM@LOCAL, since the latter only
+ * exists if our realm directly trusts that realm.  To get krbtgt/REALM@REALM,
+ * the Kerberos libraries walk the path to that realm given by capaths (or the
+ * realm hierarchy), and they cache every cross-realm TGT along the way, so
+ * the cache ends up with all of the TGTs needed to reach that realm.  Failing
+ * to get one of these tickets is reported but isn't fatal, since the main
+ * ticket is still good.  Returns the MEMORY cache, which the caller is
+ * responsible for destroying, or NULL if it couldn't be created.
+ */
+static krb5_ccache
+get_cross_realm(krb5_context ctx, struct config *config, krb5_creds *creds)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    krb5_error_code code;
+    krb5_ccache ccache;
+    krb5_creds in, *out;
+    const char *local, *realm;
+    char *name;
+    size_t i;
+
+    xasprintf(&name, "MEMORY:k5start_xrealm_%lu", (unsigned long) getpid());
+    code = krb5_cc_resolve(ctx, name, &ccache);
+    xfree(name);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error creating cross-realm ticket cache");
+        return NULL;
+    }
+    code = krb5_cc_initialize(ctx, ccache, config->client);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, ccache, creds);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error initializing cross-realm ticket cache");
+        krb5_cc_destroy(ctx, ccache);
+        return NULL;
+    }
+    local = krb5_principal_get_realm(ctx, config->client);
+    if (local == NULL) {
+        warn("cannot determine realm for cross-realm tickets");
+        return ccache;
+    }
+    for (i = 0; i < internal->nrealms; i++) {
+        realm = internal->realms[i];
+        if (strcmp(realm, local) == 0)
+            continue;
+        if (config->verbose)
+            notice("getting cross-realm ticket for %s", realm);
+        memset(&in, 0, sizeof(in));
+        in.client = config->client;
+        code = krb5_build_principal(ctx, &in.server,
+                                    (unsigned int) strlen(realm), realm,
+                                    "krbtgt", realm, (const char *) NULL);
+        if (code != 0) {
+            warn_krb5(ctx, code, "error creating principal for %s", realm);
+            continue;
+        }
+        code = krb5_get_credentials(ctx, 0, ccache, &in, &out);
+        krb5_free_principal(ctx, in.server);
+        if (code != 0) {
+            warn_krb5(ctx, code, "cannot get cross-realm ticket for %s",
+                      realm);
+            continue;
+        }
+        krb5_free_creds(ctx, out);
+    }
+    return ccache;
+}
+
+
+/*
+ * Authenticate, given the context and the processed command-line options, and
+ * store the credentials in our ticket cache and in each additional ticket
+ * cache given with -d.  Every cache is tried even if writing to an earlier
+ * one fails.  Returns a Kerberos error code or errno value after reporting
+ * any errors, which is the first error if several caches failed.
+ */
+static krb5_error_code
+authenticate(krb5_context ctx, struct config *config,
+             krb5_error_code status UNUSED)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    krb5_error_code code, dcode;
+    krb5_keytab keytab = NULL;
+    krb5_creds creds;
+    krb5_ccache source = NULL;
+    struct destination primary;
+    size_t i;
+
     /* Verbose logging of what we're doing. */
     if (config->verbose) {
         char *p;
@@ -209,8 +570,13 @@ authenticate(krb5_context ctx, struct config *config,
         notice("getting tickets for %s", internal->service);
     }
 
-    /* Obtain new credentials. */
+    /* Obtain new credentials, refreshing the FAST armor first if needed. */
     memset(&creds, 0, sizeof(creds));
+    if (internal->armor != NULL) {
+        code = refresh_armor(ctx, config);
+        if (code != 0)
+            goto done;
+    }
     if (internal->keytab != NULL) {
         code = krb5_kt_resolve(ctx, internal->keytab, &keytab);
         if (code != 0) {
@@ -254,53 +620,40 @@ authenticate(krb5_context ctx, struct config *config,
         goto done;
     }
 
-    /* Set up the new ticket cache. */
-    code = krb5_cc_resolve(ctx, cache, &ccache);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error creating ticket cache");
-        goto done;
-    }
-    code = krb5_cc_initialize(ctx, ccache, config->client);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error initializing ticket cache");
-        goto done;
-    }
-    code = krb5_cc_store_cred(ctx, ccache, &creds);
-    if (code != 0) {
-        warn_krb5(ctx, code, "error storing credentials");
-        goto done;
-    }
-    krb5_cc_close(ctx, ccache);
-    ccache = NULL;
+    /* Get any cross-realm tickets requested with -X. */
+    if (internal->nrealms > 0)
+        source = get_cross_realm(ctx, config, &creds);
 
     /*
-     * If we aren't changing ownership or permissions, we're done.  If we are,
-     * set the owner, group, and mode of the resulting cache, and then rename
-     * it into place.
+     * Store the credentials in our ticket cache, and then fan the same
+     * credentials out to any additional caches even if that failed so that
+     * one bad cache doesn't leave the others to expire.
      */
-    if (internal->set_perms) {
-        code = set_permissions(cache, internal);
-        if (code != 0)
-            goto done;
-        if (rename(cache, config->cache) < 0) {
-            code = errno;
-            goto done;
+    primary.cache = config->cache;
+    primary.owner = internal->owner;
+    primary.group = internal->group;
+    primary.mode = internal->mode;
+    primary.set_perms = internal->set_perms;
+    code = store_creds(ctx, config->client, &creds, source, &primary);
+    for (i = 0; i < internal->ndests; i++) {
+        dcode = store_creds(ctx, config->client, &creds, source,
+                            &internal->dests[i]);
+        if (dcode != 0) {
+            warn("cannot update ticket cache %s", internal->dests[i].cache);
+            if (code == 0)
+                code = dcode;
+        } else if (config->verbose) {
+            notice("updated ticket cache %s", internal->dests[i].cache);
         }
     }
 
 done:
-    /* If we failed and were generating a separate cache, unlink it. */
-    if (internal->set_perms)
-        unlink(cache);
-
     /* Make sure that we don't free princ; we use it later. */
     if (creds.client == config->client)
         creds.client = NULL;
-    if (cache != config->cache)
-        free((char *) cache);
-    if (ccache != NULL)
-        krb5_cc_close(ctx, ccache);
     krb5_free_cred_contents(ctx, &creds);
+    if (source != NULL)
+        krb5_cc_destroy(ctx, source);
     if (keytab != NULL)
         krb5_kt_close(ctx, keytab);
     return code;
@@ -370,56 +723,465 @@ strip_cache_prefix(const char *cache)
 }
 
 
+/*
+ * Parse the argument to -d, which is a ticket cache optionally followed by a
+ * mode, owner, and group for it, separated by commas, and add it to the list
+ * of additional ticket caches.  As in a batch file, a mode, owner, or group
+ * of - (or an empty one) leaves that setting unchanged.  Dies on any syntax
+ * error.
+ */
+static void
+add_destination(struct k5start_internal *internal, const char *arg)
+{
+    struct destination *dest;
+    char *copy, *field[4], *p;
+    size_t n = 0, i;
+    gid_t group = (gid_t) -1;
+
+    /* Split the argument into fields. */
+    copy = xstrdup(arg);
+    field[n++] = copy;
+    for (p = strchr(copy, ','); p != NULL; p = strchr(p + 1, ',')) {
+        if (n == ARRAY_SIZE(field))
+            die("-d argument %s has too many fields", arg);
+        *p = '\0';
+        field[n++] = p + 1;
+    }
+    if (field[0][0] == '\0')
+        die("-d argument %s has no ticket cache", arg);
+
+    /* Add the new destination and fill it out. */
+    internal->dests = xreallocarray(internal->dests, internal->ndests + 1,
+                                    sizeof(*internal->dests));
+    dest = &internal->dests[internal->ndests++];
+    memset(dest, 0, sizeof(*dest));
+    dest->owner = (uid_t) -1;
+    dest->group = (gid_t) -1;
+    for (i = 1; i < n; i++) {
+        if (field[i][0] == '\0' || strcmp(field[i], "-") == 0)
+            continue;
+        if (i == 1) {
+            dest->mode = (mode_t) convert_number(field[i], 8);
+            if (dest->mode <= 0)
+                die("-d mode %s invalid", field[i]);
+        } else if (i == 2) {
+            dest->owner = parse_owner(field[i], &group);
+        } else {
+            dest->group = parse_group(field[i]);
+        }
+        dest->set_perms = true;
+    }
+    if (dest->group == (gid_t) -1)
+        dest->group = group;
+    if (dest->set_perms)
+        dest->cache = strip_cache_prefix(field[0]);
+    else
+        dest->cache = field[0];
+}
+
+
+/*
+ * Build the name of the service ticket that we're obtaining from the sname,
+ * sinst, and srealm settings, defaulting to the TGT for the client realm.
+ * Stores the results in the internal configuration.  Dies on error.
+ */
+static void
+setup_service(krb5_context ctx, struct config *config)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    const char *sname = internal->sname;
+    const char *sinst = internal->sinst;
+    const char *srealm = internal->srealm;
+    krb5_error_code code;
+
+    if (srealm == NULL)
+        srealm = krb5_principal_get_realm(ctx, config->client);
+    if (srealm == NULL)
+        die("cannot get service ticket realm");
+    if (sname == NULL)
+        sname = "krbtgt";
+    if (sinst == NULL)
+        sinst = srealm;
+    xasprintf(&internal->service, "%s/%s@%s", sname, sinst, srealm);
+    code = krb5_build_principal(ctx, &internal->ksprinc,
+                                (unsigned int) strlen(srealm), srealm, sname,
+                                sinst, (const char *) NULL);
+    if (code != 0)
+        die_krb5(ctx, code, "error creating service principal name");
+}
+
+
+/*
+ * Figure out our ticket lifetime and initialize the credential options,
+ * including the options for FAST armor if an armor cache was requested.
+ * Dies on error.
+ */
+static void
+setup_options(krb5_context ctx, struct config *config)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    krb5_deltat life_secs;
+    krb5_error_code code;
+    double life;
+
+    life = clock_interval(internal->lifetime * 60.0);
+    life_secs = (life < 1) ? 1 : (krb5_deltat) life;
+    code = krb5_get_init_creds_opt_alloc(ctx, &internal->kopts);
+    if (code != 0)
+        die_krb5(ctx, code, "error allocating credential options");
+    krb5_get_init_creds_opt_set_default_flags(
+        ctx, "k5start", config->client->realm, internal->kopts);
+    krb5_get_init_creds_opt_set_tkt_life(internal->kopts, life_secs);
+    if (internal->nonforwardable)
+        krb5_get_init_creds_opt_set_forwardable(internal->kopts, 0);
+    if (internal->nonproxiable)
+        krb5_get_init_creds_opt_set_proxiable(internal->kopts, 0);
+
+    /*
+     * If we were given a FAST armor cache, set up the options used to get
+     * anonymous armor tickets and tell the library to armor our requests.
+     * The armor ticket is refreshed by authenticate when it nears expiration.
+     */
+    if (internal->armor != NULL) {
+#if defined(HAVE_KRB5_GET_INIT_CREDS_OPT_SET_FAST_CCACHE_NAME) \
+    && defined(HAVE_KRB5_GET_INIT_CREDS_OPT_SET_ANONYMOUS)
+        code = krb5_get_init_creds_opt_alloc(ctx, &internal->armor_kopts);
+        if (code != 0)
+            die_krb5(ctx, code, "error allocating credential options");
+        krb5_get_init_creds_opt_set_anonymous(internal->armor_kopts, 1);
+        krb5_get_init_creds_opt_set_tkt_life(internal->armor_kopts,
+                                             life_secs);
+        code = krb5_get_init_creds_opt_set_fast_ccache_name(
+            ctx, internal->kopts, internal->armor);
+        if (code != 0)
+            die_krb5(ctx, code, "error setting FAST armor cache");
+#else
+        die("-T option requires FAST support in the Kerberos libraries");
+#endif
+    }
+}
+
+
+/*
+ * Read the list of credentials to obtain in batch mode.  Each non-blank line
+ * not starting with # contains a keytab, a principal, a ticket cache, and
+ * optionally a mode, owner, and group for the ticket cache, separated by
+ * whitespace.  A principal of - means to use the first principal in the
+ * keytab, and a mode, owner, or group of - leaves that setting unchanged.
+ * Returns a newly allocated array of entries and stores the count in count.
+ * Dies on any syntax error.
+ */
+static struct batch_entry *
+read_batch(const char *path, size_t *count)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+    char *field[6], *p;
+    struct batch_entry *entries = NULL;
+    struct batch_entry *entry;
+    size_t size = 0, n, i;
+    unsigned long line = 0;
+    gid_t group;
+
+    *count = 0;
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysdie("cannot open batch file %s", path);
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line++;
+        p = strchr(buffer, '\n');
+        if (p == NULL && !feof(file))
+            die("%s:%lu: line too long", path, line);
+        if (p != NULL)
+            *p = '\0';
+        n = 0;
+        for (p = strtok(buffer, " \t"); p != NULL; p = strtok(NULL, " \t")) {
+            if (n == 0 && p[0] == '#')
+                break;
+            if (n == ARRAY_SIZE(field))
+                die("%s:%lu: too many fields", path, line);
+            field[n++] = p;
+        }
+        if (n == 0)
+            continue;
+        if (n < 3)
+            die("%s:%lu: keytab, principal, and cache required", path, line);
+
+        /* Grow the array if needed and fill out the new entry. */
+        if (*count == size) {
+            size += 16;
+            entries = xreallocarray(entries, size, sizeof(*entries));
+        }
+        entry = &entries[(*count)++];
+        memset(entry, 0, sizeof(*entry));
+        entry->owner = (uid_t) -1;
+        entry->group = (gid_t) -1;
+        entry->keytab = xstrdup(field[0]);
+        if (strcmp(field[1], "-") != 0)
+            entry->principal = xstrdup(field[1]);
+        for (i = 3; i < n; i++) {
+            if (strcmp(field[i], "-") == 0)
+                continue;
+            if (i == 3) {
+                entry->mode = (mode_t) convert_number(field[i], 8);
+                if (entry->mode <= 0)
+                    die("%s:%lu: mode %s invalid", path, line, field[i]);
+            } else if (i == 4) {
+                entry->owner = parse_owner(field[i], &group);
+                if (entry->group == (gid_t) -1)
+                    entry->group = group;
+            } else {
+                entry->group = parse_group(field[i]);
+            }
+        }
+
+        /*
+         * Always drop a FILE: prefix so that the cache name doesn't depend on
+         * how many fields were given.  If the permissions will be changed,
+         * the cache must also be a file.
+         */
+        if (entry->owner != (uid_t) -1 || entry->group != (gid_t) -1
+            || entry->mode != 0)
+            entry->cache = xstrdup(strip_cache_prefix(field[2]));
+        else if (strncmp(field[2], "FILE:", strlen("FILE:")) == 0)
+            entry->cache = xstrdup(field[2] + strlen("FILE:"));
+        else
+            entry->cache = xstrdup(field[2]);
+    }
+    if (ferror(file))
+        sysdie("cannot read batch file %s", path);
+    fclose(file);
+    if (*count == 0)
+        die("no entries found in batch file %s", path);
+    return entries;
+}
+
+
+/*
+ * Obtain the credentials for a single batch entry.  This runs in a child
+ * process and uses its own Kerberos context.  Never returns; exits with
+ * status 0 on success and 1 on failure.
+ */
+__attribute__((__noreturn__)) static void
+batch_worker(struct config *config, struct batch_entry *entry)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    krb5_context ctx;
+    krb5_error_code code;
+    char *principal = entry->principal;
+    char *name;
+
+    /* Identify the entry in any error messages. */
+    xasprintf(&name, "k5start: %s", entry->cache);
+    message_program_name = name;
+
+    /* Copy the entry settings into our configuration. */
+    internal->keytab = entry->keytab;
+    internal->owner = entry->owner;
+    internal->group = entry->group;
+    internal->mode = entry->mode;
+    internal->set_perms = (entry->owner != (uid_t) -1
+                           || entry->group != (gid_t) -1 || entry->mode != 0);
+    config->cache = entry->cache;
+
+    /* Set up our own Kerberos context and authenticate. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        die_krb5(ctx, code, "error initializing Kerberos");
+    if (principal == NULL)
+        principal = first_principal(ctx, internal->keytab);
+    code = krb5_parse_name(ctx, principal, &config->client);
+    if (code != 0)
+        die_krb5(ctx, code, "error parsing %s", principal);
+    setup_service(ctx, config);
+    setup_options(ctx, config);
+    code = authenticate(ctx, config, 0);
+    exit(code == 0 ? 0 : 1);
+}
+
+
+/*
+ * Return the number of seconds elapsed since start as a double.
+ */
+static double
+elapsed_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (double) (now.tv_sec - start->tv_sec)
+           + (double) (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+
+/*
+ * Obtain all of the credentials listed in a batch file, running up to jobs
+ * worker processes at a time, and report the status and time taken for each
+ * entry.  If a FAST armor cache is in use, refresh it once up front so that
+ * the workers don't race to replace it.  Returns the exit status: 0 if all
+ * entries succeeded and 1 otherwise.
+ */
+static int
+run_batch(struct config *config, const char *path, long jobs)
+{
+    struct k5start_internal *internal = config->internal.k5start;
+    struct batch_entry *entries, *entry;
+    size_t count, next, i;
+    long running = 0;
+    unsigned long failed = 0;
+    krb5_context ctx;
+    krb5_error_code code;
+    char *principal;
+    int status;
+    pid_t pid;
+    struct timeval start;
+
+    entries = read_batch(path, &count);
+    gettimeofday(&start, NULL);
+    if (internal->armor != NULL) {
+        code = krb5_init_context(&ctx);
+        if (code != 0)
+            die_krb5(ctx, code, "error initializing Kerberos");
+        principal = entries[0].principal;
+        if (principal == NULL)
+            principal = first_principal(ctx, entries[0].keytab);
+        code = krb5_parse_name(ctx, principal, &config->client);
+        if (code != 0)
+            die_krb5(ctx, code, "error parsing %s", principal);
+        setup_options(ctx, config);
+        if (refresh_armor(ctx, config) != 0)
+            die("cannot obtain FAST armor ticket");
+        krb5_get_init_creds_opt_free(ctx, internal->kopts);
+        krb5_get_init_creds_opt_free(ctx, internal->armor_kopts);
+        krb5_free_principal(ctx, config->client);
+        krb5_free_context(ctx);
+        config->client = NULL;
+    }
+
+    /* Keep up to jobs workers running until every entry is finished. */
+    fflush(stdout);
+    fflush(stderr);
+    next = 0;
+    while (next < count || running > 0) {
+        if (next < count && running < jobs) {
+            entry = &entries[next++];
+            gettimeofday(&entry->start, NULL);
+            pid = fork();
+            if (pid < 0)
+                sysdie("cannot fork");
+            else if (pid == 0)
+                batch_worker(config, entry);
+            entry->pid = pid;
+            running++;
+            continue;
+        }
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            sysdie("cannot wait for child process");
+        }
+        for (i = 0; i < next; i++)
+            if (entries[i].pid == pid)
+                break;
+        if (i == next)
+            continue;
+        entry = &entries[i];
+        entry->pid = 0;
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            if (!internal->quiet)
+                notice("%s: obtained tickets in %.3fs", entry->cache,
+                       elapsed_since(&entry->start));
+        } else {
+            failed++;
+            warn("%s: failed after %.3fs", entry->cache,
+                 elapsed_since(&entry->start));
+        }
+    }
+    if (!internal->quiet || failed > 0)
+        notice("%lu of %lu entries succeeded in %.3fs",
+               (unsigned long) count - failed, (unsigned long) count,
+               elapsed_since(&start));
+
+    /* Clean up. */
+    for (i = 0; i < count; i++) {
+        xfree(entries[i].keytab);
+        xfree(entries[i].principal);
+        xfree(entries[i].cache);
+    }
+    xfree(entries);
+    return (failed > 0) ? 1 : 0;
+}
+
+
 int
 main(int argc, char *argv[])
 {
     struct config config;
     struct k5start_internal internal;
     int opt;
+    long repeats;
+    long check = 0;
     const char *inst = NULL;
-    const char *sname = NULL;
-    const char *sinst = NULL;
-    const char *srealm = NULL;
+    const char *batch = NULL;
+    const char *command_cache;
     char *principal = NULL;
-    bool nonforwardable = false;
-    bool nonproxiable = false;
-    int lifetime = DEFAULT_LIFETIME;
     krb5_error_code code;
-    struct passwd *pw = NULL;
-    struct group *gr;
+    gid_t owner_group = (gid_t) -1;
     krb5_context ctx;
     krb5_deltat life_secs;
     bool run_as_daemon;
     bool search_keytab = false;
     static const char optstring[] =
-        "abc:Ff:g:H:hI:i:K:k:Ll:m:no:Pp:qr:S:stUu:vx";
+        "aB:bC:c:D:d:E:Ff:g:H:hI:i:j:K:k:Ll:Mm:N:nO:o:Pp:QqR:r:S:sT:tUu:vW:w:"
+        "X:xz";
 
     /* Initialize logging. */
     message_program_name = "k5start";
 
+    /* Start our clock and anything else that must precede allocation. */
+    start_framework();
+
     /* Set up confguration and parse command-line options. */
     memset(&config, 0, sizeof(config));
     memset(&internal, 0, sizeof(internal));
     config.internal.k5start = &internal;
     config.auth = authenticate;
+    config.aklog_timeout = DEFAULT_AKLOG_TIMEOUT;
+    config.jobs = DEFAULT_JOBS;
+    config.restart_delay = DEFAULT_RESTART_DELAY;
     internal.owner = (uid_t) -1;
     internal.group = (gid_t) -1;
+    internal.lifetime = DEFAULT_LIFETIME;
     while ((opt = getopt(argc, argv, optstring)) != EOF)
         switch (opt) {
         case 'a':
             config.always_renew = true;
             break;
+        case 'B':
+            batch = optarg;
+            break;
         case 'b':
             config.background = true;
             break;
+        case 'C':
+            tokens_add_cell(&config, optarg);
+            config.do_aklog = true;
+            break;
         case 'c':
             config.childfile = optarg;
             break;
+        case 'E':
+            check = convert_number(optarg, 10);
+            if (check <= 0)
+                die("-E minutes argument %s invalid", optarg);
+            break;
         case 'F':
-            nonforwardable = true;
+            internal.nonforwardable = true;
             break;
         case 'I':
-            sinst = optarg;
+            internal.sinst = optarg;
             break;
         case 'i':
             inst = optarg;
@@ -429,20 +1191,29 @@ main(int argc, char *argv[])
             break;
         case 'n': /* Ignored */
             break;
+        case 'O':
+            config.statusfile = optarg;
+            break;
         case 'P':
-            nonproxiable = true;
+            internal.nonproxiable = true;
             break;
         case 'p':
             config.pidfile = optarg;
             break;
+        case 'Q':
+            config.queue_logs = true;
+            break;
         case 'q':
             internal.quiet = true;
             break;
         case 'r':
-            srealm = optarg;
+            internal.srealm = optarg;
             break;
         case 'S':
-            sname = optarg;
+            internal.sname = optarg;
+            break;
+        case 'T':
+            internal.armor = optarg;
             break;
         case 't':
             config.do_aklog = true;
@@ -456,21 +1227,43 @@ main(int argc, char *argv[])
         case 'u':
             principal = optarg;
             break;
+        case 'W':
+            repeats = convert_number(optarg, 10);
+            if (repeats <= 0)
+                die("-W interval argument %s invalid", optarg);
+            message_limit_repeats((time_t) repeats);
+            break;
+        case 'w':
+            config.aklog_timeout = convert_number(optarg, 10);
+            if (config.aklog_timeout < 0)
+                die("-w timeout argument %s invalid", optarg);
+            break;
+        case 'X':
+            internal.realms = xreallocarray(internal.realms,
+                                            internal.nrealms + 1,
+                                            sizeof(const char *));
+            internal.realms[internal.nrealms++] = optarg;
+            break;
         case 'x':
             config.exit_errors = true;
             break;
+        case 'z':
+            config.compact = true;
+            break;
 
+        case 'D':
+            config.restart_delay = convert_number(optarg, 10);
+            if (config.restart_delay <= 0)
+                die("-D delay argument %s invalid", optarg);
+            break;
+        case 'd':
+            add_destination(&internal, optarg);
+            break;
         case 'f':
             internal.keytab = optarg;
             break;
         case 'g':
-            internal.group = (gid_t) convert_number(optarg, 10);
-            if (internal.group == (gid_t) -1) {
-                gr = getgrnam(optarg);
-                if (gr == NULL)
-                    die("unknown group %s", optarg);
-                internal.group = gr->gr_gid;
-            }
+            internal.group = parse_group(optarg);
             internal.set_perms = true;
             break;
         case 'H':
@@ -480,6 +1273,11 @@ main(int argc, char *argv[])
             break;
         case 'h':
             usage(0);
+        case 'j':
+            config.jobs = convert_number(optarg, 10);
+            if (config.jobs <= 0)
+                die("-j jobs argument %s invalid", optarg);
+            break;
         case 'K':
             config.keep_ticket = convert_number(optarg, 10);
             if (config.keep_ticket <= 0)
@@ -487,6 +1285,7 @@ main(int argc, char *argv[])
             config.ignore_errors = true;
             break;
         case 'L':
+            config.log_syslog = true;
             openlog(message_program_name, LOG_PID, LOG_DAEMON);
             message_handlers_notice(2, message_log_stdout,
                                     message_log_syslog_notice);
@@ -499,7 +1298,10 @@ main(int argc, char *argv[])
             code = krb5_string_to_deltat(optarg, &life_secs);
             if (code != 0 || life_secs == 0)
                 die("bad lifetime value %s, use 10h 10m format", optarg);
-            lifetime = (int) life_secs / 60;
+            internal.lifetime = (int) life_secs / 60;
+            break;
+        case 'M':
+            config.memfd = true;
             break;
         case 'm':
             internal.mode = (mode_t) convert_number(optarg, 8);
@@ -507,16 +1309,21 @@ main(int argc, char *argv[])
                 die("-m mode argument %s invalid", optarg);
             internal.set_perms = true;
             break;
+        case 'N':
+            config.token_window = convert_number(optarg, 10);
+            if (config.token_window <= 0)
+                die("-N window argument %s invalid", optarg);
+            break;
         case 'o':
-            internal.owner = (uid_t) convert_number(optarg, 10);
-            if (internal.owner == (uid_t) -1) {
-                pw = getpwnam(optarg);
-                if (pw == NULL)
-                    die("unknown user %s", optarg);
-                internal.owner = pw->pw_uid;
-            }
+            internal.owner = parse_owner(optarg, &owner_group);
             internal.set_perms = true;
             break;
+        case 'R':
+            config.restart_limit = convert_number(optarg, 10);
+            if (config.restart_limit < 0)
+                die("-R limit argument %s invalid", optarg);
+            config.restart = true;
+            break;
         case 's':
             internal.stdin_passwd = true;
             break;
@@ -547,12 +1354,60 @@ main(int argc, char *argv[])
     if (config.exit_errors)
         config.ignore_errors = false;
 
+    /* -z only applies to the main loop, so check it before -B and -E. */
+    if (config.compact && config.keep_ticket == 0 && config.command == NULL)
+        die("-z only makes sense with -K or a command to run");
+
+    /* -X needs the initial ticket to be a TGT for the client realm. */
+    if (internal.nrealms > 0
+        && (internal.sname != NULL || internal.sinst != NULL
+            || internal.srealm != NULL))
+        die("-X option cannot be used with -I, -r, or -S");
+
     /*
      * If an owner was provided but no group, and the owner was given as a
      * username, set the group to the primary group of that user.
      */
-    if (internal.group == (gid_t) -1 && pw != NULL)
-        internal.group = pw->pw_gid;
+    if (internal.group == (gid_t) -1)
+        internal.group = owner_group;
+
+    /*
+     * In check mode, we only look at the existing ticket cache, so reject
+     * anything that would obtain tickets.  Check the cache before creating a
+     * Kerberos context, since that's most of the cost of a check.
+     */
+    if (check > 0) {
+        if (principal != NULL || search_keytab || inst != NULL)
+            die("-E option cannot be used with a principal");
+        if (batch != NULL || config.command != NULL || config.keep_ticket > 0
+            || config.happy_ticket > 0 || config.background
+            || internal.ndests > 0 || internal.nrealms > 0)
+            die("-E option cannot be used with -B, -H, -K, -X, -b, -d, or a"
+                " command");
+        exit(check_ticket(config.cache, check));
+    }
+
+    /*
+     * In batch mode, everything about the credentials comes from the batch
+     * file, so reject options that conflict with that.  Then run the batch
+     * and exit.
+     */
+    if (batch != NULL) {
+        if (principal != NULL || search_keytab || inst != NULL)
+            die("-B option cannot be used with a principal");
+        if (config.command != NULL || config.keep_ticket > 0
+            || config.happy_ticket > 0 || config.background)
+            die("-B option cannot be used with -H, -K, -b, or a command");
+        if (internal.keytab != NULL || internal.stdin_passwd
+            || config.cache != NULL || internal.set_perms
+            || internal.ndests > 0)
+            die("-B option cannot be used with -f, -s, -k, -d, -o, -g, or"
+                " -m");
+        if (config.pidfile != NULL || config.childfile != NULL
+            || config.statusfile != NULL || config.do_aklog)
+            die("-B option cannot be used with -C, -c, -O, -p, or -t");
+        exit(run_batch(&config, batch, config.jobs));
+    }
 
     /* Check the arguments for consistency. */
     run_as_daemon = (config.keep_ticket != 0 || config.command != NULL);
@@ -566,9 +1421,9 @@ main(int argc, char *argv[])
         die("-K option requires a keytab be specified with -f");
     if (config.command != NULL && internal.keytab == NULL)
         die("running a command requires a keytab be specified with -f");
-    if (lifetime > 0 && config.keep_ticket > lifetime)
+    if (internal.lifetime > 0 && config.keep_ticket > internal.lifetime)
         die("-K limit %ld must be smaller than lifetime %d",
-            config.keep_ticket, lifetime);
+            config.keep_ticket, internal.lifetime);
     if (principal != NULL && strchr(principal, '/') != NULL && inst != NULL)
         die("instance specified in the principal and with -i");
     if (search_keytab && internal.keytab == NULL)
@@ -579,8 +1434,19 @@ main(int argc, char *argv[])
         die("-H option cannot be used with a command");
     if (config.childfile != NULL && config.command == NULL)
         die("-c option only makes sense with a command to run");
+    if (config.restart && config.command == NULL)
+        die("-R option only makes sense with a command to run");
+    if (config.statusfile != NULL && !run_as_daemon)
+        die("-O only makes sense with -K or a command to run");
     if (internal.keytab != NULL && internal.stdin_passwd)
         die("cannot use both -s and -f flags");
+    if (config.token_window > 0 && !config.do_aklog)
+        die("-N option requires -t or -C");
+    if (config.memfd && config.command == NULL)
+        die("-M option only makes sense with a command to run");
+    if (config.memfd
+        && (config.background || config.cache != NULL || internal.set_perms))
+        die("-M option cannot be used with -b, -g, -k, -m, or -o");
 
     /* Establish a Kerberos context. */
     code = krb5_init_context(&ctx);
@@ -603,11 +1469,18 @@ main(int argc, char *argv[])
 
     /*
      * If requested, set a ticket cache.  Otherwise, if we're running a
-     * command, set the ticket cache to a mkstemp-generated file.  Also put it
-     * into the environment in case we're going to run aklog.  Either way, set
-     * up the cache in the Kerberos libraries.
+     * command, set the ticket cache to a mkstemp-generated file, or with -M
+     * to a MEMORY cache that is copied to a memory file for the command.
+     * Also put it into the environment in case we're going to run aklog.
+     * Either way, set up the cache in the Kerberos libraries.
      */
-    if (config.cache == NULL && config.command != NULL) {
+    if (config.memfd) {
+        char *cache;
+
+        xasprintf(&cache, "MEMORY:k5start_%lu", (unsigned long) getpid());
+        config.cache = cache;
+        config.clean_cache = true;
+    } else if (config.cache == NULL && config.command != NULL) {
         int fd;
         char *tmp, *cache;
 
@@ -618,7 +1491,7 @@ main(int argc, char *argv[])
         if (fchmod(fd, 0600) < 0)
             sysdie("cannot chmod ticket cache file");
         xasprintf(&cache, "FILE:%s", tmp);
-        free(tmp);
+        xfree(tmp);
         config.cache = cache;
         config.clean_cache = true;
     } else {
@@ -635,10 +1508,13 @@ main(int argc, char *argv[])
             die_krb5(ctx, code, "error getting ticket cache name");
         krb5_cc_close(ctx, ccache);
     }
-    if (setenv("KRB5CCNAME", config.cache, 1) != 0)
+    command_cache = config.memfd ? memfd_cache_init() : config.cache;
+    if (setenv("KRB5CCNAME", command_cache, 1) != 0)
         die("cannot set KRB5CCNAME environment variable");
     if (internal.set_perms)
         config.cache = strip_cache_prefix(config.cache);
+    if (config.compact && cache_path(config.cache) == NULL)
+        die("-z option requires a FILE ticket cache");
 
     /*
      * If -K, -H, or -b were given, set quiet automatically unless verbose was
@@ -676,44 +1552,19 @@ main(int argc, char *argv[])
             die_krb5(ctx, code, "error unparsing name %s", principal);
         printf("Kerberos initialization for %s", p);
         krb5_free_unparsed_name(ctx, p);
-        if (sname != NULL) {
-            printf(" for service %s", sname);
-            if (sinst != NULL)
-                printf("/%s", sinst);
-            if (srealm != NULL)
-                printf("@%s", srealm);
+        if (internal.sname != NULL) {
+            printf(" for service %s", internal.sname);
+            if (internal.sinst != NULL)
+                printf("/%s", internal.sinst);
+            if (internal.srealm != NULL)
+                printf("@%s", internal.srealm);
         }
         printf("\n");
     }
 
-    /* Flesh out the name of the service ticket that we're obtaining. */
-    if (srealm == NULL)
-        srealm = krb5_principal_get_realm(ctx, config.client);
-    if (srealm == NULL)
-        die_krb5(ctx, code, "cannot get service ticket realm");
-    if (sname == NULL)
-        sname = "krbtgt";
-    if (sinst == NULL)
-        sinst = srealm;
-    xasprintf(&internal.service, "%s/%s@%s", sname, sinst, srealm);
-    code = krb5_build_principal(ctx, &internal.ksprinc,
-                                (unsigned int) strlen(srealm), srealm, sname,
-                                sinst, (const char *) NULL);
-    if (code != 0)
-        die_krb5(ctx, code, "error creating service principal name");
-
-    /* Figure out our ticket lifetime and initialize the options. */
-    life_secs = lifetime * 60;
-    code = krb5_get_init_creds_opt_alloc(ctx, &internal.kopts);
-    if (code != 0)
-        die_krb5(ctx, code, "error allocating credential options");
-    krb5_get_init_creds_opt_set_default_flags(
-        ctx, "k5start", config.client->realm, internal.kopts);
-    krb5_get_init_creds_opt_set_tkt_life(internal.kopts, life_secs);
-    if (nonforwardable)
-        krb5_get_init_creds_opt_set_forwardable(internal.kopts, 0);
-    if (nonproxiable)
-        krb5_get_init_creds_opt_set_proxiable(internal.kopts, 0);
+    /* Set up the service principal and the credential options. */
+    setup_service(ctx, &config);
+    setup_options(ctx, &config);
 
     /* Do the actual work. */
     run_framework(ctx, &config);
@@ -19,12 +19,15 @@
 #include <portable/krb5.h>
 #include <portable/system.h>
 
+#include <errno.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
 #include <time.h>
 
 #include <commands/internal.h>
+#include <util/clock.h>
 #include <util/macros.h>
 #include <util/messages-krb5.h>
 #include <util/messages.h>
@@ -32,29 +35,80 @@
 
 /* Holds the command-line options we need to pass to our callbacks. */
 struct krenew_internal {
-    bool signal_child; /* Kill child on abnormal exit. */
+    bool renew_services; /* Also renew renewable service tickets. */
+    bool signal_child;   /* Kill child on abnormal exit. */
+};
+
+/*
+ * A service ticket from the ticket cache, which with -r is renewed by a
+ * worker process at the same time as the ticket-granting ticket and is kept
+ * when the ticket cache is reinitialized.
+ */
+struct service {
+    krb5_creds creds; /* The ticket from the ticket cache. */
+    char *name;       /* Server principal, if the ticket is renewable. */
+    char *path;       /* Temporary ticket cache for the renewed ticket. */
+    pid_t pid;        /* Worker renewing the ticket, or 0 if none. */
+    bool renewed;     /* Whether the ticket was renewed. */
+};
+
+/* The service tickets being renewed and the progress of their workers. */
+struct services {
+    struct service *tickets; /* Service tickets from the cache. */
+    size_t count;            /* Number of service tickets. */
+    size_t next;             /* Next ticket to consider starting. */
+    size_t done;             /* Tickets before this are finished. */
+    long running;            /* Number of workers running. */
 };
 
 /* The usage message. */
 static const char usage_message[] = "\
 Usage: krenew [options] [command]\n\
+   -A <directory>       Renew every ticket cache in <directory> (may be\n\
+                        given multiple times)\n\
    -a                   Renew on each wakeup when running as a daemon\n\
    -b                   Fork and run in the background\n\
+   -C <cell>            Get AFS tokens for <cell> directly rather than\n\
+                        running aklog (may be given multiple times)\n\
    -c <file>            Write child process ID (PID) to <file>\n\
+   -E <minutes>         Only check the ticket, exiting 0 if it doesn't\n\
+                        expire in less than <minutes> minutes, otherwise 1\n\
    -H <limit>           Check for a happy ticket, one that doesn't expire in\n\
                         less than <limit> minutes, and exit 0 if it's okay,\n\
                         otherwise renew the ticket\n\
    -h                   Display this usage message and exit\n\
    -i                   Keep running even if the ticket cache goes away or\n\
                         the ticket can no longer be renewed\n\
+   -J                   Run the command with the ticket cache of a shared\n\
+                        renewer for the same principal, starting one if\n\
+                        needed\n\
+   -j <jobs>            Run at most <jobs> token refreshes at once with\n\
+                        several -C options or service ticket renewals with\n\
+                        -r\n\
    -K <interval>        Run as daemon, check ticket every <interval> minutes\n\
    -k <cache>           Use <cache> as the ticket cache\n\
    -L                   Log messages via syslog as well as stderr\n\
+   -M                   Give the command its ticket cache in memory via a\n\
+                        memfd rather than in a file in /tmp\n\
+   -N <minutes>         Only refresh AFS tokens when they are missing or\n\
+                        expire within <minutes>, checking them separately\n\
+                        from the ticket\n\
+   -O <file>            Publish daemon status to <file> for kstart-status\n\
    -p <file>            Write process ID (PID) to <file>\n\
+   -Q                   Queue messages when running as a daemon rather than\n\
+                        blocking if output or syslog backs up\n\
+   -r                   Also renew renewable service tickets, up to -j at\n\
+                        once, and keep service tickets across renewals\n\
    -s                   Send SIGHUP to command when ticket cannot be renewed\n\
    -t                   Get AFS token via aklog or AKLOG\n\
    -v                   Verbose\n\
+   -W <seconds>         Report repeated identical warnings at most once\n\
+                        every <seconds>, with a count of repeats\n\
+   -w <seconds>         Kill aklog if it runs longer than <seconds> (0 for\n\
+                        no limit, default 60)\n\
    -x                   Exit immediately on any error\n\
+   -z                   Drop expired and superseded tickets from the ticket\n\
+                        cache on each check when running as a daemon\n\
 \n\
 If the environment variable AKLOG (or KINIT_PROG for backward compatibility)\n\
 is set to a program (such as aklog) then this program will be executed when\n\
@@ -91,10 +145,11 @@ usage(int status)
 /*
  * Given the Kerberos context and a pointer to the ticket cache, copy that
  * ticket cache to a new cache and return a newly allocated string for the
- * name of the cache.
+ * name of the cache.  The new cache is a file in /tmp unless memory is set,
+ * in which case it's a MEMORY cache for -M.
  */
 static char *
-copy_cache(krb5_context ctx, krb5_ccache *ccache)
+copy_cache(krb5_context ctx, krb5_ccache *ccache, bool memory)
 {
     krb5_error_code code;
     krb5_ccache old, new;
@@ -102,12 +157,16 @@ copy_cache(krb5_context ctx, krb5_ccache *ccache)
     char *name;
     int fd;
 
-    xasprintf(&name, "/tmp/krb5cc_%d_XXXXXX", (int) getuid());
-    fd = mkstemp(name);
-    if (fd < 0)
-        sysdie("cannot create ticket cache file");
-    if (fchmod(fd, 0600) < 0)
-        sysdie("cannot chmod ticket cache file");
+    if (memory)
+        xasprintf(&name, "MEMORY:krenew_%lu", (unsigned long) getpid());
+    else {
+        xasprintf(&name, "/tmp/krb5cc_%d_XXXXXX", (int) getuid());
+        fd = mkstemp(name);
+        if (fd < 0)
+            sysdie("cannot create ticket cache file");
+        if (fchmod(fd, 0600) < 0)
+            sysdie("cannot chmod ticket cache file");
+    }
     code = krb5_cc_resolve(ctx, name, &new);
     if (code != 0)
         die_krb5(ctx, code, "error initializing new ticket cache");
@@ -130,6 +189,270 @@ copy_cache(krb5_context ctx, krb5_ccache *ccache)
 }
 
 
+/*
+ * Find the service tickets in the ticket cache that haven't expired, skipping
+ * the ticket-granting ticket for the realm of the user and any configuration
+ * entries.  If there are several tickets for the same service, keep the one
+ * that expires last.  Tickets that can still be renewed are given a name so
+ * that they will be renewed.  Returns false and reports an error if the cache
+ * couldn't be read.
+ */
+static bool
+find_services(krb5_context ctx, krb5_ccache ccache, krb5_principal user,
+              struct services *services)
+{
+    krb5_error_code code;
+    krb5_principal tgt = NULL;
+    krb5_cc_cursor cursor;
+    krb5_creds creds;
+    struct service *service;
+    const char *realm;
+    size_t size = 0, i;
+    time_t now;
+
+    memset(services, 0, sizeof(*services));
+    realm = krb5_principal_get_realm(ctx, user);
+    if (realm == NULL) {
+        warn("cannot get realm of ticket cache principal");
+        return false;
+    }
+    code = krb5_build_principal(ctx, &tgt, (unsigned int) strlen(realm),
+                                realm, "krbtgt", realm, (const char *) NULL);
+    if (code != 0) {
+        warn_krb5(ctx, code, "cannot create krbtgt principal");
+        return false;
+    }
+    code = krb5_cc_start_seq_get(ctx, ccache, &cursor);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error reading ticket cache");
+        krb5_free_principal(ctx, tgt);
+        return false;
+    }
+    now = clock_now();
+    while (krb5_cc_next_cred(ctx, ccache, &cursor, &creds) == 0) {
+        realm = krb5_principal_get_realm(ctx, creds.server);
+        if (realm == NULL || strcmp(realm, "X-CACHECONF:") == 0
+            || krb5_principal_compare(ctx, creds.server, tgt)
+            || clock_from_real(creds.times.endtime) <= now) {
+            krb5_free_cred_contents(ctx, &creds);
+            continue;
+        }
+        for (i = 0; i < services->count; i++) {
+            service = &services->tickets[i];
+            if (krb5_principal_compare(ctx, service->creds.server,
+                                       creds.server))
+                break;
+        }
+        if (i < services->count) {
+            if (creds.times.endtime < service->creds.times.endtime) {
+                krb5_free_cred_contents(ctx, &creds);
+                continue;
+            }
+            krb5_free_cred_contents(ctx, &service->creds);
+            free(service->name);
+        } else {
+            if (services->count == size) {
+                size += 16;
+                services->tickets = xreallocarray(services->tickets, size,
+                                                  sizeof(struct service));
+            }
+            service = &services->tickets[services->count++];
+        }
+        memset(service, 0, sizeof(*service));
+        service->creds = creds;
+        if (clock_from_real(creds.times.renew_till) > now) {
+            code = krb5_unparse_name(ctx, creds.server, &service->name);
+            if (code != 0) {
+                warn_krb5(ctx, code, "error unparsing name");
+                service->name = NULL;
+            }
+        }
+    }
+    krb5_cc_end_seq_get(ctx, ccache, &cursor);
+    krb5_free_principal(ctx, tgt);
+    return true;
+}
+
+
+/*
+ * Renew a single service ticket in a worker process and store the result in
+ * its temporary ticket cache.  The worker exits 0 on success and 1 on
+ * failure.  Returns the PID of the worker or -1 on failure to fork.
+ */
+static pid_t
+service_spawn(krb5_context ctx, struct config *config, krb5_principal user,
+              struct service *service)
+{
+    krb5_error_code code;
+    krb5_ccache ccache = NULL, out = NULL;
+    krb5_creds creds;
+    char *name;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid != 0)
+        return pid;
+
+    /* Messages already queued are the parent's to write. */
+    if (config->queue_logs)
+        message_queue_init(LOG_QUEUE_SIZE, LOG_DAEMON);
+    memset(&creds, 0, sizeof(creds));
+    code = krb5_cc_resolve(ctx, config->cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error opening ticket cache");
+        goto done;
+    }
+    code = krb5_get_renewed_creds(ctx, &creds, user, ccache, service->name);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error renewing credentials for %s",
+                  service->name);
+        goto done;
+    }
+    xasprintf(&name, "FILE:%s", service->path);
+    code = krb5_cc_resolve(ctx, name, &out);
+    xfree(name);
+    if (code == 0)
+        code = krb5_cc_initialize(ctx, out, user);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, out, &creds);
+    if (code != 0)
+        warn_krb5(ctx, code, "error storing credentials for %s",
+                  service->name);
+
+done:
+    if (config->queue_logs)
+        message_queue_flush();
+    fflush(stdout);
+    _exit(code == 0 ? 0 : 1);
+}
+
+
+/*
+ * Start workers to renew the renewable service tickets, keeping at most the
+ * configured number of jobs running.  If wait is false, start as many as we
+ * can and return so that the caller can renew the ticket-granting ticket
+ * while they run.  Otherwise, wait for each worker in order, starting more
+ * as others finish, until all are done.
+ */
+static void
+services_run(krb5_context ctx, struct config *config, krb5_principal user,
+             struct services *services, bool wait)
+{
+    struct service *service;
+    int fd, status;
+
+    while (services->done < services->count) {
+        if (services->next < services->count
+            && services->running < config->jobs) {
+            service = &services->tickets[services->next++];
+            if (service->name == NULL)
+                continue;
+            if (config->verbose)
+                notice("renewing credentials for %s", service->name);
+            xasprintf(&service->path, "/tmp/krenew_%d_XXXXXX", (int) getuid());
+            fd = mkstemp(service->path);
+            if (fd < 0) {
+                syswarn("cannot create temporary ticket cache file");
+                xfree(service->path);
+                service->path = NULL;
+                continue;
+            }
+            close(fd);
+            service->pid = service_spawn(ctx, config, user, service);
+            if (service->pid < 0) {
+                syswarn("cannot fork to renew %s", service->name);
+                service->pid = 0;
+                continue;
+            }
+            services->running++;
+            continue;
+        }
+        if (!wait)
+            return;
+
+        /* Wait for the oldest worker, skipping tickets that have none. */
+        service = &services->tickets[services->done];
+        if (service->pid != 0) {
+            while (waitpid(service->pid, &status, 0) < 0)
+                if (errno != EINTR) {
+                    syswarn("waitpid for %lu failed",
+                            (unsigned long) service->pid);
+                    status = 1;
+                    break;
+                }
+            service->renewed = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            service->pid = 0;
+            services->running--;
+        }
+        services->done++;
+    }
+}
+
+
+/*
+ * Store the service tickets in the ticket cache: the renewed ticket for each
+ * one that was renewed and, if all is true, the ticket from the cache for any
+ * others that haven't expired.  Then free the service tickets and remove the
+ * temporary ticket caches.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+services_store(krb5_context ctx, krb5_ccache ccache,
+               struct services *services, bool all)
+{
+    krb5_error_code code = 0;
+    krb5_error_code status;
+    krb5_ccache renewed;
+    krb5_cc_cursor cursor;
+    krb5_creds creds;
+    struct service *service;
+    char *name;
+    size_t i;
+
+    for (i = 0; i < services->count; i++) {
+        service = &services->tickets[i];
+        if (service->renewed) {
+            renewed = NULL;
+            xasprintf(&name, "FILE:%s", service->path);
+            status = krb5_cc_resolve(ctx, name, &renewed);
+            xfree(name);
+            if (status == 0)
+                status = krb5_cc_start_seq_get(ctx, renewed, &cursor);
+            if (status == 0) {
+                while (krb5_cc_next_cred(ctx, renewed, &cursor, &creds) == 0) {
+                    if (status == 0)
+                        status = krb5_cc_store_cred(ctx, ccache, &creds);
+                    krb5_free_cred_contents(ctx, &creds);
+                }
+                krb5_cc_end_seq_get(ctx, renewed, &cursor);
+            }
+            if (renewed != NULL)
+                krb5_cc_close(ctx, renewed);
+        } else if (all && clock_from_real(service->creds.times.endtime)
+                              > clock_now()) {
+            status = krb5_cc_store_cred(ctx, ccache, &service->creds);
+        } else {
+            status = 0;
+        }
+        if (status != 0) {
+            warn_krb5(ctx, status, "error storing credentials");
+            if (code == 0)
+                code = status;
+        }
+        if (service->path != NULL) {
+            unlink(service->path);
+            xfree(service->path);
+        }
+        free(service->name);
+        krb5_free_cred_contents(ctx, &service->creds);
+    }
+    xfree(services->tickets);
+    memset(services, 0, sizeof(*services));
+    return code;
+}
+
+
 /*
  * Renew the user's tickets, warning if this isn't possible.  This is the
  * callback passed to the generic framework.  Takes the context, the
@@ -146,11 +469,14 @@ copy_cache(krb5_context ctx, krb5_ccache *ccache)
 static krb5_error_code
 renew(krb5_context ctx, struct config *config, krb5_error_code status)
 {
+    struct krenew_internal *internal = config->internal.krenew;
     krb5_ccache ccache = NULL;
     krb5_error_code code;
     krb5_principal user = NULL;
     krb5_creds creds;
+    struct services services;
     bool creds_valid = false;
+    bool reinitialized = false;
 
     /*
      * If we can't read the cache, or if we can't renew tickets for long
@@ -166,6 +492,7 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
         return status;
     }
     memset(&creds, 0, sizeof(creds));
+    memset(&services, 0, sizeof(services));
     code = krb5_cc_resolve(ctx, config->cache, &ccache);
     if (code != 0) {
         warn_krb5(ctx, code, "error opening ticket cache");
@@ -193,6 +520,16 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
         }
     }
 
+    /*
+     * With -r, start renewing the service tickets first so that they're
+     * renewed at the same time as the ticket-granting ticket.  All of the
+     * workers have to finish reading the ticket cache before we reinitialize
+     * it.
+     */
+    if (internal->renew_services)
+        if (find_services(ctx, ccache, user, &services))
+            services_run(ctx, config, user, &services, false);
+
     /*
      * If we just can't renew or store tickets, we keep trying unless -x was
      * given, which means we return an error code and let the framework handle
@@ -200,6 +537,8 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
      */
     code = krb5_get_renewed_creds(ctx, &creds, user, ccache, NULL);
     creds_valid = true;
+    if (internal->renew_services)
+        services_run(ctx, config, user, &services, true);
     if (code != 0) {
         warn_krb5(ctx, code, "error renewing credentials");
         goto done;
@@ -210,13 +549,14 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
      * just store the new credentials.  By reinitializing the cache, we create
      * a window where the credentials aren't valid.  However, I don't know how
      * to just store the renewed credentials without creating a cache that
-     * grows forever.
+     * grows forever.  With -r, the service tickets are put back afterwards.
      */
     code = krb5_cc_initialize(ctx, ccache, user);
     if (code != 0) {
         warn_krb5(ctx, code, "error reinitializing cache");
         goto done;
     }
+    reinitialized = true;
     code = krb5_cc_store_cred(ctx, ccache, &creds);
     if (code != 0) {
         warn_krb5(ctx, code, "error storing credentials");
@@ -224,6 +564,14 @@ renew(krb5_context ctx, struct config *config, krb5_error_code status)
     }
 
 done:
+    /*
+     * Store any renewed service tickets even if we couldn't renew the
+     * ticket-granting ticket, but only put back the old ones if we
+     * reinitialized the cache.  Failing to store a service ticket isn't
+     * fatal, since the program using the cache can still get a new one.
+     */
+    if (services.count > 0)
+        services_store(ctx, ccache, &services, reinitialized);
     if (ccache != NULL)
         krb5_cc_close(ctx, ccache);
     if (user != NULL)
@@ -252,42 +600,77 @@ int
 main(int argc, char *argv[])
 {
     int option;
+    long repeats;
+    long check = 0;
+    const char *command_cache;
+    char **scan = NULL;
+    size_t scan_count = 0;
     krb5_context ctx;
     krb5_error_code code;
     struct config config;
     struct krenew_internal internal;
     krb5_ccache ccache;
     bool run_as_daemon;
+    static const char optstring[] =
+        "A:abC:c:E:H:hiJj:K:k:LMN:O:p:QqrstvW:w:xz";
 
     /* Initialize logging. */
     message_program_name = "krenew";
 
+    /* Start our clock and anything else that must precede allocation. */
+    start_framework();
+
     /* Set up configuration and parse command-line options. */
     memset(&config, 0, sizeof(config));
     memset(&internal, 0, sizeof(internal));
     config.internal.krenew = &internal;
     config.auth = renew;
     config.cleanup = cleanup;
-    while ((option = getopt(argc, argv, "abc:H:hiK:k:Lp:qstvx")) != EOF)
+    config.aklog_timeout = DEFAULT_AKLOG_TIMEOUT;
+    config.jobs = DEFAULT_JOBS;
+    while ((option = getopt(argc, argv, optstring)) != EOF)
         switch (option) {
+        case 'A':
+            scan = xreallocarray(scan, scan_count + 2, sizeof(char *));
+            scan[scan_count++] = optarg;
+            scan[scan_count] = NULL;
+            break;
         case 'a':
             config.always_renew = true;
             break;
         case 'b':
             config.background = true;
             break;
+        case 'C':
+            tokens_add_cell(&config, optarg);
+            config.do_aklog = true;
+            break;
         case 'c':
             config.childfile = optarg;
             break;
+        case 'E':
+            check = convert_number(optarg, 10);
+            if (check <= 0)
+                die("-E minutes argument %s invalid", optarg);
+            break;
         case 'i':
             config.ignore_errors = true;
             break;
         case 'k':
             config.cache = optarg;
             break;
+        case 'O':
+            config.statusfile = optarg;
+            break;
         case 'p':
             config.pidfile = optarg;
             break;
+        case 'Q':
+            config.queue_logs = true;
+            break;
+        case 'r':
+            internal.renew_services = true;
+            break;
         case 's':
             internal.signal_child = true;
             break;
@@ -297,9 +680,23 @@ main(int argc, char *argv[])
         case 'v':
             config.verbose = true;
             break;
+        case 'W':
+            repeats = convert_number(optarg, 10);
+            if (repeats <= 0)
+                die("-W interval argument %s invalid", optarg);
+            message_limit_repeats((time_t) repeats);
+            break;
+        case 'w':
+            config.aklog_timeout = convert_number(optarg, 10);
+            if (config.aklog_timeout < 0)
+                die("-w timeout argument %s invalid", optarg);
+            break;
         case 'x':
             config.exit_errors = true;
             break;
+        case 'z':
+            config.compact = true;
+            break;
 
         case 'H':
             config.happy_ticket = convert_number(optarg, 10);
@@ -308,12 +705,29 @@ main(int argc, char *argv[])
             break;
         case 'h':
             usage(0);
+        case 'J':
+            config.attach = true;
+            break;
+        case 'j':
+            config.jobs = convert_number(optarg, 10);
+            if (config.jobs <= 0)
+                die("-j jobs argument %s invalid", optarg);
+            break;
         case 'K':
             config.keep_ticket = convert_number(optarg, 10);
             if (config.keep_ticket <= 0)
                 die("-K interval argument %s invalid", optarg);
             break;
+        case 'M':
+            config.memfd = true;
+            break;
+        case 'N':
+            config.token_window = convert_number(optarg, 10);
+            if (config.token_window <= 0)
+                die("-N window argument %s invalid", optarg);
+            break;
         case 'L':
+            config.log_syslog = true;
             openlog(message_program_name, LOG_PID, LOG_DAEMON);
             message_handlers_notice(2, message_log_stdout,
                                     message_log_syslog_notice);
@@ -328,36 +742,84 @@ main(int argc, char *argv[])
         }
 
     /* Parse arguments.  If any are given, they will be the command to run. */
-    argc -= optind;
-    argv += optind;
-    if (argc > 0)
-        config.command = argv;
+    if (optind < argc)
+        config.command = argv + optind;
 
-    /* Check the arguments for consistency. */
-    run_as_daemon = (config.keep_ticket != 0 || config.command != NULL);
+    /*
+     * Check the arguments for consistency.  Scan mode renews many caches, so
+     * the options that apply to a single cache don't make sense with it.
+     */
+    if (scan != NULL
+        && (config.always_renew || config.do_aklog || config.childfile != NULL
+            || check > 0 || config.happy_ticket > 0 || config.cache != NULL
+            || config.statusfile != NULL || config.queue_logs
+            || internal.signal_child || config.command != NULL))
+        die("-A option cannot be used with -a, -C, -c, -E, -H, -k, -O, -Q,"
+            " -s, -t, or a command");
+    if (config.attach && config.command == NULL)
+        die("-J option only makes sense with a command to run");
+    if (config.attach
+        && (config.background || config.do_aklog || config.childfile != NULL
+            || config.pidfile != NULL || config.statusfile != NULL
+            || internal.signal_child))
+        die("-J option cannot be used with -b, -C, -c, -O, -p, -s, or -t");
+    run_as_daemon = (config.keep_ticket != 0 || config.command != NULL
+                     || scan != NULL);
     if (config.always_renew && !run_as_daemon)
         die("-a only makes sense with -K or a command to run");
     if (config.background && !run_as_daemon)
         die("-b only makes sense with -K or a command to run");
-    if (config.happy_ticket > 0 && config.command != NULL)
+    if (config.statusfile != NULL && !run_as_daemon)
+        die("-O only makes sense with -K or a command to run");
+    if (config.compact && (!run_as_daemon || scan != NULL))
+        die("-z only makes sense with -K or a command to run");
+    if (config.happy_ticket > 0 && config.command != NULL && !config.attach)
         die("-H option cannot be used with a command");
     if (config.childfile != NULL && config.command == NULL)
         die("-c option only makes sense with a command to run");
     if (internal.signal_child && config.command == NULL)
         die("-s option only makes sense with a command to run");
+    if (config.token_window > 0 && !config.do_aklog)
+        die("-N option requires -t or -C");
+    if (config.memfd && config.command == NULL)
+        die("-M option only makes sense with a command to run");
+    if (config.memfd && (config.background || config.attach))
+        die("-M option cannot be used with -b or -J");
+
+    /*
+     * In check mode, only look at the ticket cache, before creating a
+     * Kerberos context since that's most of the cost of a check.
+     */
+    if (check > 0) {
+        if (config.command != NULL || config.keep_ticket > 0
+            || config.happy_ticket > 0 || config.background)
+            die("-E option cannot be used with -H, -K, -b, or a command");
+        exit(check_ticket(config.cache, check));
+    }
 
     /* Establish a Kerberos context and set the ticket cache. */
     code = krb5_init_context(&ctx);
     if (code != 0)
         die_krb5(ctx, code, "error initializing Kerberos");
+
+    /* In scan mode, there is no one ticket cache to set up. */
+    if (scan != NULL)
+        run_scan(ctx, &config, scan);
     if (config.cache == NULL)
         code = krb5_cc_default(ctx, &ccache);
     else
         code = krb5_cc_resolve(ctx, config.cache, &ccache);
     if (code != 0)
         die_krb5(ctx, code, "error opening default ticket cache");
-    if (config.command != NULL) {
-        config.cache = copy_cache(ctx, &ccache);
+    if (config.attach) {
+        attach_command(ctx, &config, ccache);
+        config.command = NULL;
+        if (config.keep_ticket == 0)
+            config.keep_ticket = 60;
+        config.cache = copy_cache(ctx, &ccache, config.memfd);
+        config.clean_cache = true;
+    } else if (config.command != NULL) {
+        config.cache = copy_cache(ctx, &ccache, config.memfd);
         config.clean_cache = true;
     }
     if (config.cache == NULL) {
@@ -365,10 +827,13 @@ main(int argc, char *argv[])
         if (code != 0)
             die_krb5(ctx, code, "error getting ticket cache name");
     } else {
-        if (setenv("KRB5CCNAME", config.cache, 1) != 0)
+        command_cache = config.memfd ? memfd_cache_init() : config.cache;
+        if (setenv("KRB5CCNAME", command_cache, 1) != 0)
             die("cannot set KRB5CCNAME environment variable");
     }
     krb5_cc_close(ctx, ccache);
+    if (config.compact && cache_path(config.cache) == NULL)
+        die("-z option requires a FILE ticket cache");
 
     /* Do the actual work. */
     run_framework(ctx, &config);
@@ -0,0 +1,278 @@
+/*
+ * Report the status of k5start and krenew daemons.
+ *
+ * Reads the status files published by k5start and krenew run with -O and
+ * prints a summary of each daemon: its principal and ticket cache, when it
+ * last authenticated and how long that took, when it will next check the
+ * ticket, the last error, and the PID of any command it's running.  The files
+ * are read without any communication with the daemons and without touching
+ * the ticket caches, so this is cheap enough for monitoring to run often on
+ * hosts with many daemons.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <util/messages.h>
+#include <util/status.h>
+#include <util/xmalloc.h>
+
+/* The usage message. */
+static const char usage_message[] = "\
+Usage: kstart-status [-hp] [path ...]\n\
+   -h                   Display this usage message and exit\n\
+   -p                   Print tab-separated fields for parsing\n\
+\n\
+Each path may be a status file written by k5start -O or krenew -O or a\n\
+directory of them.  The default is to read all status files in\n\
+" STATUS_DIR ".\n";
+
+
+/*
+ * Print out the usage message and then exit with the status given as the
+ * only argument.  If status is zero, the message is printed to standard
+ * output; otherwise, it is sent to standard error.
+ */
+__attribute__((__noreturn__)) static void
+usage(int status)
+{
+    fprintf((status == 0) ? stdout : stderr, "%s", usage_message);
+    exit(status);
+}
+
+
+/*
+ * Compare two strings through pointers for qsort.
+ */
+static int
+compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+/*
+ * Return the state of a daemon: dead if its process no longer exists,
+ * failing if its last authentication failed, and otherwise ok.
+ */
+static const char *
+daemon_state(const struct status_record *record)
+{
+    if (kill((pid_t) record->pid, 0) < 0 && errno == ESRCH)
+        return "dead";
+    if (record->last_failure > record->last_success)
+        return "failing";
+    return "ok";
+}
+
+
+/*
+ * Format a timestamp into the provided buffer, using the given string if it
+ * is zero.
+ */
+static const char *
+format_time(char *buffer, size_t size, int64_t when, const char *none)
+{
+    time_t t = (time_t) when;
+    struct tm *tm;
+
+    if (when == 0)
+        return none;
+    tm = localtime(&t);
+    if (tm == NULL || strftime(buffer, size, "%Y-%m-%d %H:%M:%S", tm) == 0)
+        snprintf(buffer, size, "%lld", (long long) when);
+    return buffer;
+}
+
+
+/*
+ * Print the status of a daemon in the human-readable format.
+ */
+static void
+print_human(const struct status_record *record)
+{
+    char success[32], wakeup[32], failure[32], latency[32], child[32];
+    unsigned long long usec;
+
+    /*
+     * Format the latency in milliseconds with integer arithmetic so that it
+     * always fits in the buffer, whatever is in the status file.
+     */
+    if (record->successes + record->failures == 0)
+        strcpy(latency, "-");
+    else {
+        usec = 0;
+        if (record->latency > 0)
+            usec = (unsigned long long) record->latency;
+        snprintf(latency, sizeof(latency), "%llu.%03llus", usec / 1000000,
+                 usec / 1000 % 1000);
+    }
+    if (record->child == 0)
+        strcpy(child, "-");
+    else
+        snprintf(child, sizeof(child), "%lld", (long long) record->child);
+    printf("%-7lld %-8s %-7s %-19s %-19s %8s %7s %s %s\n",
+           (long long) record->pid, record->program, daemon_state(record),
+           format_time(success, sizeof(success), record->last_success,
+                       "never"),
+           format_time(wakeup, sizeof(wakeup), record->next_wakeup, "-"),
+           latency, child, record->principal[0] ? record->principal : "-",
+           record->cache[0] ? record->cache : "-");
+    if (record->last_failure > record->last_success)
+        printf("        error at %s: %s\n",
+               format_time(failure, sizeof(failure), record->last_failure,
+                           "-"),
+               record->error);
+}
+
+
+/*
+ * Print the status of a daemon as tab-separated fields.
+ */
+static void
+print_parsed(const char *path, const struct status_record *record)
+{
+    printf("%s\t%s\t%lld\t%s\t%lld\t%s\t%s\t%lld\t%lld\t%lld\t%lld\t%lld"
+           "\t%llu\t%llu\t%s\n",
+           path, record->program, (long long) record->pid,
+           daemon_state(record), (long long) record->child, record->principal,
+           record->cache, (long long) record->started,
+           (long long) record->last_success, (long long) record->last_failure,
+           (long long) record->next_wakeup, (long long) record->latency,
+           (unsigned long long) record->successes,
+           (unsigned long long) record->failures, record->error);
+}
+
+
+/*
+ * Read and print one status file.  If quiet is set, files that aren't status
+ * files are silently skipped, which is used when reading a directory.
+ * Returns false if the file couldn't be read.
+ */
+static bool
+show_file(const char *path, bool parsed, bool quiet)
+{
+    struct status_record record;
+
+    if (!status_read(path, &record)) {
+        if (errno == EINVAL && quiet)
+            return true;
+        if (errno == EINVAL)
+            warn("%s is not a status file", path);
+        else if (errno == EAGAIN)
+            warn("%s is not consistent (daemon died while updating it?)",
+                 path);
+        else
+            syswarn("cannot read %s", path);
+        return false;
+    }
+    if (parsed)
+        print_parsed(path, &record);
+    else
+        print_human(&record);
+    return true;
+}
+
+
+/*
+ * Read and print all of the status files in a directory, in sorted order.
+ * If missing_okay is set, a directory that doesn't exist is treated as
+ * empty.  Returns false if anything couldn't be read.
+ */
+static bool
+show_directory(const char *path, bool parsed, bool missing_okay)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **files = NULL;
+    size_t count = 0, size = 0, i;
+    bool okay = true;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        if (errno == ENOENT && missing_okay)
+            return true;
+        syswarn("cannot open directory %s", path);
+        return false;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (count == size) {
+            size = (size == 0) ? 16 : size * 2;
+            files = xreallocarray(files, size, sizeof(char *));
+        }
+        xasprintf(&files[count], "%s/%s", path, entry->d_name);
+        count++;
+    }
+    closedir(dir);
+    if (count > 0)
+        qsort(files, count, sizeof(char *), compare_paths);
+    for (i = 0; i < count; i++) {
+        if (!show_file(files[i], parsed, true))
+            okay = false;
+        xfree(files[i]);
+    }
+    xfree(files);
+    return okay;
+}
+
+
+/*
+ * Read and print a path, which may be a status file or a directory.
+ */
+static bool
+show_path(const char *path, bool parsed)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return show_directory(path, parsed, false);
+    return show_file(path, parsed, false);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int option, i;
+    bool parsed = false;
+    bool okay = true;
+
+    message_program_name = "kstart-status";
+    while ((option = getopt(argc, argv, "hp")) != EOF)
+        switch (option) {
+        case 'h':
+            usage(0);
+        case 'p':
+            parsed = true;
+            break;
+        default:
+            usage(1);
+        }
+    argc -= optind;
+    argv += optind;
+
+    /* Print the header and then each status file. */
+    if (!parsed)
+        printf("%-7s %-8s %-7s %-19s %-19s %8s %7s %s %s\n", "PID", "PROGRAM",
+               "STATE", "LAST SUCCESS", "NEXT WAKEUP", "LATENCY", "CHILD",
+               "PRINCIPAL", "CACHE");
+    if (argc == 0)
+        okay = show_directory(STATUS_DIR, parsed, true);
+    else
+        for (i = 0; i < argc; i++)
+            if (!show_path(argv[i], parsed))
+                okay = false;
+    exit(okay ? 0 : 1);
+}
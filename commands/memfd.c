@@ -0,0 +1,295 @@
+/*
+ * Ticket caches in memory for k5start and krenew -M.
+ *
+ * When running a command, k5start and krenew normally keep the command's
+ * ticket cache in a temporary file in /tmp, which is rewritten on every
+ * renewal and is left behind if they are killed.  With -M, they instead keep
+ * the tickets in a MEMORY cache and, after each authentication, write them
+ * out in the FILE cache format to an anonymous memory file created with
+ * memfd_create.  The command is given FILE:/proc/<pid>/fd/<fd> as its ticket
+ * cache, which any process running as the same user can open.
+ *
+ * The Kerberos libraries can't write a FILE cache at that path, since they
+ * recreate the file when initializing the cache, so we write the format
+ * ourselves.  Each update writes a complete new memory file and then moves
+ * it to the published descriptor number with dup3, so a reader opening the
+ * path sees either the old tickets or the new ones, never a partial write.
+ * The memory file goes away when we exit, however we exit.
+ *
+ * This requires memfd_create and the MIT Kerberos creds structure, and is
+ * disabled elsewhere.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_MEMFD_CREATE
+#    include <sys/mman.h>
+#endif
+
+#include <commands/internal.h>
+#include <util/macros.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Whether we can support -M. */
+#if defined(HAVE_MEMFD_CREATE) && !defined(HAVE_KRB5_CREDS_SESSION)
+#    define MEMFD_SUPPORTED 1
+#endif
+
+/* The FILE cache format version we write. */
+#define FCC_VERSION_4 0x0504
+
+#ifdef MEMFD_SUPPORTED
+
+/* The published descriptor number and the path to it. */
+static int memfd_number = -1;
+static char *memfd_path = NULL;
+
+/* A growing buffer holding the serialized cache. */
+struct buffer {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+
+/*
+ * Append data to the buffer, growing it if necessary.
+ */
+static void
+buffer_append(struct buffer *buffer, const void *data, size_t length)
+{
+    if (buffer->size - buffer->used < length) {
+        while (buffer->size - buffer->used < length)
+            buffer->size = (buffer->size == 0) ? 4096 : buffer->size * 2;
+        buffer->data = xrealloc(buffer->data, buffer->size);
+    }
+    memcpy(buffer->data + buffer->used, data, length);
+    buffer->used += length;
+}
+
+
+/*
+ * Append integers in network byte order, as used by version 4 caches.
+ */
+static void
+buffer_uint16(struct buffer *buffer, uint32_t value)
+{
+    unsigned char data[2];
+
+    data[0] = (unsigned char) ((value >> 8) & 0xff);
+    data[1] = (unsigned char) (value & 0xff);
+    buffer_append(buffer, data, sizeof(data));
+}
+
+static void
+buffer_uint32(struct buffer *buffer, uint32_t value)
+{
+    unsigned char data[4];
+
+    data[0] = (unsigned char) ((value >> 24) & 0xff);
+    data[1] = (unsigned char) ((value >> 16) & 0xff);
+    data[2] = (unsigned char) ((value >> 8) & 0xff);
+    data[3] = (unsigned char) (value & 0xff);
+    buffer_append(buffer, data, sizeof(data));
+}
+
+
+/*
+ * Append counted data: a 32-bit length followed by the data.
+ */
+static void
+buffer_counted(struct buffer *buffer, const void *data, size_t length)
+{
+    buffer_uint32(buffer, (uint32_t) length);
+    if (length > 0)
+        buffer_append(buffer, data, length);
+}
+
+
+/*
+ * Append a principal: its name type, number of components, realm, and
+ * components.
+ */
+static void
+buffer_principal(struct buffer *buffer, krb5_const_principal princ)
+{
+    krb5_int32 i;
+
+    buffer_uint32(buffer, (uint32_t) princ->type);
+    buffer_uint32(buffer, (uint32_t) princ->length);
+    buffer_counted(buffer, princ->realm.data, princ->realm.length);
+    for (i = 0; i < princ->length; i++)
+        buffer_counted(buffer, princ->data[i].data, princ->data[i].length);
+}
+
+
+/*
+ * Append a set of credentials.
+ */
+static void
+buffer_creds(struct buffer *buffer, const krb5_creds *creds)
+{
+    size_t i, count;
+    unsigned char skey;
+
+    buffer_principal(buffer, creds->client);
+    buffer_principal(buffer, creds->server);
+    buffer_uint16(buffer, (uint32_t) creds->keyblock.enctype);
+    buffer_counted(buffer, creds->keyblock.contents, creds->keyblock.length);
+    buffer_uint32(buffer, (uint32_t) creds->times.authtime);
+    buffer_uint32(buffer, (uint32_t) creds->times.starttime);
+    buffer_uint32(buffer, (uint32_t) creds->times.endtime);
+    buffer_uint32(buffer, (uint32_t) creds->times.renew_till);
+    skey = creds->is_skey ? 1 : 0;
+    buffer_append(buffer, &skey, 1);
+    buffer_uint32(buffer, (uint32_t) creds->ticket_flags);
+    for (count = 0; creds->addresses && creds->addresses[count]; count++)
+        ;
+    buffer_uint32(buffer, (uint32_t) count);
+    for (i = 0; i < count; i++) {
+        buffer_uint16(buffer, (uint32_t) creds->addresses[i]->addrtype);
+        buffer_counted(buffer, creds->addresses[i]->contents,
+                       creds->addresses[i]->length);
+    }
+    for (count = 0; creds->authdata && creds->authdata[count]; count++)
+        ;
+    buffer_uint32(buffer, (uint32_t) count);
+    for (i = 0; i < count; i++) {
+        buffer_uint16(buffer, (uint32_t) creds->authdata[i]->ad_type);
+        buffer_counted(buffer, creds->authdata[i]->contents,
+                       creds->authdata[i]->length);
+    }
+    buffer_counted(buffer, creds->ticket.data, creds->ticket.length);
+    buffer_counted(buffer, creds->second_ticket.data,
+                   creds->second_ticket.length);
+}
+
+
+/*
+ * Serialize the given cache into a buffer in the FILE cache format.  Returns
+ * a Kerberos error code.
+ */
+static krb5_error_code
+serialize_cache(krb5_context ctx, krb5_ccache ccache, struct buffer *buffer)
+{
+    krb5_error_code code;
+    krb5_principal princ;
+    krb5_cc_cursor cursor;
+    krb5_creds creds;
+
+    code = krb5_cc_get_principal(ctx, ccache, &princ);
+    if (code != 0)
+        return code;
+    buffer_uint16(buffer, FCC_VERSION_4);
+    buffer_uint16(buffer, 0);
+    buffer_principal(buffer, princ);
+    krb5_free_principal(ctx, princ);
+    code = krb5_cc_start_seq_get(ctx, ccache, &cursor);
+    if (code != 0)
+        return code;
+    while ((code = krb5_cc_next_cred(ctx, ccache, &cursor, &creds)) == 0) {
+        buffer_creds(buffer, &creds);
+        krb5_free_cred_contents(ctx, &creds);
+    }
+    krb5_cc_end_seq_get(ctx, ccache, &cursor);
+    return (code == KRB5_CC_END) ? 0 : code;
+}
+
+
+/*
+ * Create the memory file that will hold the ticket cache for the command and
+ * return the FILE cache name for it.  Dies on failure, since this is done
+ * while setting up.
+ */
+const char *
+memfd_cache_init(void)
+{
+    memfd_number = memfd_create("krb5cc", MFD_CLOEXEC);
+    if (memfd_number < 0)
+        sysdie("cannot create memory file for ticket cache");
+    xasprintf(&memfd_path, "FILE:/proc/%lu/fd/%d", (unsigned long) getpid(),
+              memfd_number);
+    return memfd_path;
+}
+
+
+/*
+ * Write the current contents of the ticket cache we maintain to a new memory
+ * file and publish it in place of the old one.  Returns a Kerberos error code
+ * or errno value after reporting any errors.
+ */
+krb5_error_code
+memfd_cache_export(krb5_context ctx, struct config *config)
+{
+    krb5_error_code code;
+    krb5_ccache ccache;
+    struct buffer buffer = {NULL, 0, 0};
+    size_t written = 0;
+    ssize_t status;
+    int fd, oerrno;
+
+    code = krb5_cc_resolve(ctx, config->cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error opening ticket cache");
+        return code;
+    }
+    code = serialize_cache(ctx, ccache, &buffer);
+    krb5_cc_close(ctx, ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error reading ticket cache");
+        xfree(buffer.data);
+        return code;
+    }
+    fd = memfd_create("krb5cc", MFD_CLOEXEC);
+    if (fd < 0)
+        goto fail;
+    while (written < buffer.used) {
+        status = write(fd, buffer.data + written, buffer.used - written);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status < 0)
+            goto fail;
+        written += (size_t) status;
+    }
+    if (dup3(fd, memfd_number, O_CLOEXEC) < 0)
+        goto fail;
+    close(fd);
+    explicit_bzero(buffer.data, buffer.used);
+    xfree(buffer.data);
+    return 0;
+
+fail:
+    oerrno = errno;
+    syswarn("cannot write ticket cache to memory file");
+    if (fd >= 0)
+        close(fd);
+    explicit_bzero(buffer.data, buffer.used);
+    xfree(buffer.data);
+    return oerrno;
+}
+
+#else /* !MEMFD_SUPPORTED */
+
+const char *
+memfd_cache_init(void)
+{
+    die("-M is not supported on this system");
+}
+
+krb5_error_code
+memfd_cache_export(krb5_context ctx UNUSED, struct config *config UNUSED)
+{
+    return KRB5_CC_NOSUPP;
+}
+
+#endif /* !MEMFD_SUPPORTED */
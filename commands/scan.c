@@ -0,0 +1,615 @@
+/*
+ * Scan mode for krenew.
+ *
+ * With -A, a single krenew renews every ticket cache it finds in the given
+ * directories rather than maintaining one cache.  This replaces running a
+ * separate krenew for each user (see examples/krenew-agent), which on a busy
+ * login node means thousands of processes.
+ *
+ * Ticket caches are files whose names start with krb5cc, and DIR collections
+ * are directories whose names start with krb5cc containing caches whose
+ * names start with tkt.  The index of caches is kept up to date with inotify
+ * where available, so the directories are only read once, and otherwise they
+ * are rescanned at each check interval.  The expiration of each cache is read
+ * directly from the file (see commands/check.c), and each cache is renewed
+ * when it would expire before the next check, as in the normal daemon mode.
+ * Renewals are done in child processes, up to the number of jobs set with
+ * -j, each running with the identity of the owner of the cache and using the
+ * same renewal code as the normal mode.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <grp.h>
+#include <signal.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#    include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+#    include <sys/select.h>
+#endif
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <commands/internal.h>
+#include <util/clock.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The prefix of ticket cache file names and DIR collection directories. */
+#define CACHE_PREFIX "krb5cc"
+
+/* The prefix of ticket cache file names inside a DIR collection. */
+#define COLLECTION_PREFIX "tkt"
+
+/* Seconds to wait before retrying a renewal that failed. */
+#define RETRY_DELAY 60
+
+/* A directory being scanned, either from -A or a DIR collection in one. */
+struct scan_dir {
+    char *path;
+    int watch;       /* inotify watch descriptor, or -1. */
+    bool collection; /* Whether this is a DIR collection. */
+};
+
+/* A ticket cache in the index. */
+struct scan_cache {
+    char *path;
+    size_t dir;         /* Index of the directory holding it. */
+    uid_t uid;          /* Owner of the cache, whose identity we renew as. */
+    gid_t gid;          /* Group of the cache. */
+    time_t endtime;     /* Expiration of the ticket, or 0 if unknown. */
+    time_t renewed;     /* When we last renewed it, or 0. */
+    time_t due;         /* When to renew it, or 0 if it can't be renewed. */
+    pid_t worker;       /* PID of the worker renewing it, or 0. */
+    bool dirty;         /* Whether its times need to be read again. */
+    bool seen;          /* Whether it was seen during a rescan. */
+};
+
+/* The index of directories and caches. */
+static struct scan_dir *dirs = NULL;
+static size_t dir_count = 0;
+static struct scan_cache *caches = NULL;
+static size_t cache_count = 0;
+static size_t cache_size = 0;
+
+/* The number of running workers. */
+static long workers = 0;
+
+/* The inotify file descriptor, or -1 if we're rescanning instead. */
+static int inotify_fd = -1;
+
+/* Set by the signal handlers. */
+static volatile sig_atomic_t alarm_signaled = 0;
+static volatile sig_atomic_t exit_signaled = 0;
+
+
+/*
+ * Signal handlers, which just record the signal for the main loop.  SIGCHLD
+ * needs a handler so that it interrupts the wait, but workers are reaped on
+ * every pass through the loop.
+ */
+static void
+alarm_handler(int s UNUSED)
+{
+    alarm_signaled = 1;
+}
+
+static void
+exit_handler(int s UNUSED)
+{
+    exit_signaled = 1;
+}
+
+static void
+child_handler(int s UNUSED)
+{
+}
+
+
+/*
+ * Return true if the file name starts with the given prefix.
+ */
+static bool
+has_prefix(const char *name, const char *prefix)
+{
+    return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+
+/*
+ * Find a cache in the index by path or by worker PID, returning its index or
+ * -1 if it is not found.
+ */
+static ssize_t
+cache_find(const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < cache_count; i++)
+        if (strcmp(caches[i].path, path) == 0)
+            return (ssize_t) i;
+    return -1;
+}
+
+static ssize_t
+cache_find_worker(pid_t pid)
+{
+    size_t i;
+
+    for (i = 0; i < cache_count; i++)
+        if (caches[i].worker == pid)
+            return (ssize_t) i;
+    return -1;
+}
+
+
+/*
+ * Remove a cache from the index.  If a worker is still renewing it, the
+ * worker is left to finish and is then ignored.
+ */
+static void
+cache_remove(struct config *config, size_t i)
+{
+    if (config->verbose)
+        notice("no longer watching %s", caches[i].path);
+    if (caches[i].worker != 0)
+        workers--;
+    xfree(caches[i].path);
+    cache_count--;
+    if (i != cache_count)
+        caches[i] = caches[cache_count];
+}
+
+
+/*
+ * Add a cache to the index, or mark it to be read again if it's already
+ * there.  Anything that isn't a regular file, and when not running as root
+ * anything not owned by us, is ignored.  Whether the file is really a ticket
+ * cache is determined when its times are read.
+ */
+static void
+cache_add(const char *path, size_t dir)
+{
+    struct stat st;
+    ssize_t found;
+    struct scan_cache *cache;
+
+    if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    if (geteuid() != 0 && st.st_uid != geteuid())
+        return;
+    found = cache_find(path);
+    if (found >= 0) {
+        cache = &caches[found];
+        cache->dirty = true;
+        cache->seen = true;
+        return;
+    }
+    if (cache_count == cache_size) {
+        cache_size = (cache_size == 0) ? 64 : cache_size * 2;
+        caches = xreallocarray(caches, cache_size, sizeof(*caches));
+    }
+    cache = &caches[cache_count++];
+    memset(cache, 0, sizeof(*cache));
+    cache->path = xstrdup(path);
+    cache->dir = dir;
+    cache->dirty = true;
+    cache->seen = true;
+}
+
+
+/*
+ * Read the times of a cache and decide when to renew it.  As in the normal
+ * daemon mode, a cache is renewed when it would expire within the check
+ * interval plus some fudge, and is checked at most once per interval after
+ * we renew it.  A cache whose ticket has expired, can't be renewed any
+ * further, or can't be parsed is left alone until it changes.
+ */
+static void
+cache_schedule(struct config *config, struct scan_cache *cache)
+{
+    struct stat st;
+    time_t endtime, renew_till, now, offset;
+    bool was_known = (cache->endtime != 0);
+
+    cache->dirty = false;
+    cache->due = 0;
+    cache->endtime = 0;
+    if (lstat(cache->path, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+    cache->uid = st.st_uid;
+    cache->gid = st.st_gid;
+    if (!cache_times(cache->path, &st, &endtime, &renew_till)
+        || endtime == 0)
+        return;
+    now = clock_now();
+    cache->endtime = endtime;
+    offset = 60 * config->keep_ticket + EXPIRE_FUDGE;
+    if (endtime > now && renew_till > endtime) {
+        cache->due = endtime - offset;
+        if (cache->renewed != 0
+            && cache->due < cache->renewed + 60 * config->keep_ticket)
+            cache->due = cache->renewed + 60 * config->keep_ticket;
+        if (cache->due < now)
+            cache->due = now;
+    }
+    if (config->verbose && !was_known) {
+        if (cache->due == 0)
+            notice("watching %s, which cannot be renewed", cache->path);
+        else
+            notice("watching %s, renewing in %ld minutes", cache->path,
+                   (long) (cache->due - now) / 60);
+    }
+}
+
+
+/*
+ * Add a directory to the index and watch it if we can.  Returns the index of
+ * the directory.
+ */
+static size_t
+dir_add(const char *path, bool collection)
+{
+    struct scan_dir *dir;
+
+    dirs = xreallocarray(dirs, dir_count + 1, sizeof(*dirs));
+    dir = &dirs[dir_count];
+    dir->path = xstrdup(path);
+    dir->watch = -1;
+    dir->collection = collection;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (inotify_fd >= 0) {
+        dir->watch = inotify_add_watch(inotify_fd, path,
+                                       IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                           | IN_MOVED_FROM | IN_MOVED_TO
+                                           | IN_ONLYDIR);
+        if (dir->watch < 0)
+            syswarn("cannot watch %s, rescanning it instead", path);
+    }
+#endif
+    return dir_count++;
+}
+
+
+/*
+ * Scan a directory for ticket caches and DIR collections, adding them to the
+ * index.  Returns false if the directory couldn't be read.
+ */
+static bool
+dir_scan(size_t index)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+    const char *prefix;
+    size_t i;
+    bool found;
+
+    dir = opendir(dirs[index].path);
+    if (dir == NULL)
+        return false;
+    prefix = dirs[index].collection ? COLLECTION_PREFIX : CACHE_PREFIX;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!has_prefix(entry->d_name, prefix))
+            continue;
+        xasprintf(&path, "%s/%s", dirs[index].path, entry->d_name);
+        if (!dirs[index].collection && lstat(path, &st) == 0
+            && S_ISDIR(st.st_mode)) {
+            found = false;
+            for (i = 0; i < dir_count; i++)
+                if (strcmp(dirs[i].path, path) == 0)
+                    found = true;
+            if (!found)
+                dir_scan(dir_add(path, true));
+        } else {
+            cache_add(path, index);
+        }
+        xfree(path);
+    }
+    closedir(dir);
+    return true;
+}
+
+
+/*
+ * Rescan the given directory, or all directories if index is -1, dropping
+ * any caches in them that have disappeared.  Used when inotify isn't
+ * available and after the inotify queue overflows.
+ */
+static void
+rescan(struct config *config, ssize_t index)
+{
+    size_t i;
+
+    for (i = 0; i < cache_count; i++)
+        if (index < 0 || caches[i].dir == (size_t) index)
+            caches[i].seen = false;
+    for (i = 0; i < dir_count; i++)
+        if (index < 0 || i == (size_t) index)
+            dir_scan(i);
+    for (i = 0; i < cache_count;) {
+        if ((index < 0 || caches[i].dir == (size_t) index) && !caches[i].seen)
+            cache_remove(config, i);
+        else
+            i++;
+    }
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Process all pending inotify events, updating the index.
+ */
+static void
+read_events(struct config *config)
+{
+    char buffer[4096] __attribute__((__aligned__(8)));
+    const struct inotify_event *event;
+    ssize_t length, found;
+    size_t i, dir;
+    char *path;
+
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (i = 0; i < (size_t) length; i += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *) (void *) (buffer + i);
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan(config, -1);
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+            for (dir = 0; dir < dir_count; dir++)
+                if (dirs[dir].watch == event->wd)
+                    break;
+            if (dir == dir_count)
+                continue;
+            xasprintf(&path, "%s/%s", dirs[dir].path, event->name);
+            if (event->mask & IN_ISDIR) {
+                if ((event->mask & (IN_CREATE | IN_MOVED_TO))
+                    && !dirs[dir].collection
+                    && has_prefix(event->name, CACHE_PREFIX))
+                    dir_scan(dir_add(path, true));
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                found = cache_find(path);
+                if (found >= 0)
+                    cache_remove(config, (size_t) found);
+            } else {
+                if (has_prefix(event->name, dirs[dir].collection
+                                                ? COLLECTION_PREFIX
+                                                : CACHE_PREFIX))
+                    cache_add(path, dir);
+            }
+            xfree(path);
+        }
+    }
+    if (length < 0 && errno != EAGAIN && errno != EINTR)
+        syswarn("cannot read inotify events");
+}
+#endif
+
+
+/*
+ * Start a worker to renew a cache.  The worker takes on the identity of the
+ * owner of the cache if we're running as root, so that it can't be tricked
+ * into writing somewhere else and so that the cache keeps its ownership.
+ */
+static void
+worker_start(krb5_context ctx, struct config *config,
+             struct scan_cache *cache)
+{
+    struct config worker;
+    krb5_error_code code;
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        syswarn("cannot fork to renew %s", cache->path);
+        cache->due = clock_now() + RETRY_DELAY;
+        return;
+    } else if (pid > 0) {
+        cache->worker = pid;
+        workers++;
+        return;
+    }
+
+    /* In the child. */
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (geteuid() == 0 && cache->uid != 0) {
+#ifdef HAVE_SETGROUPS
+        if (setgroups(1, &cache->gid) < 0) {
+            syswarn("cannot set groups to renew %s", cache->path);
+            _exit(1);
+        }
+#endif
+        if (setgid(cache->gid) < 0 || setuid(cache->uid) < 0) {
+            syswarn("cannot change identity to renew %s", cache->path);
+            _exit(1);
+        }
+    }
+    worker = *config;
+    worker.cache = cache->path;
+    worker.client = NULL;
+    worker.ignore_errors = true;
+    code = config->auth(ctx, &worker, KRB5KRB_AP_ERR_TKT_EXPIRED);
+    fflush(stdout);
+    _exit(code == 0 ? 0 : 1);
+}
+
+
+/*
+ * Reap any workers that have finished and update their caches.  A successful
+ * renewal is rescheduled from the new times in the cache, and a failure is
+ * retried after a delay.
+ */
+static void
+workers_reap(krb5_context ctx, struct config *config)
+{
+    pid_t pid;
+    ssize_t found;
+    int status;
+    struct scan_cache *cache;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        found = cache_find_worker(pid);
+        if (found < 0)
+            continue;
+        cache = &caches[found];
+        cache->worker = 0;
+        workers--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            cache->renewed = clock_now();
+            cache->dirty = true;
+            continue;
+        }
+        warn("cannot renew %s", cache->path);
+        if (config->exit_errors)
+            exit_cleanup(ctx, config, 1);
+        cache->due = clock_now() + RETRY_DELAY;
+        if (cache->endtime != 0 && cache->due >= cache->endtime)
+            cache->due = 0;
+    }
+}
+
+
+/*
+ * The main loop of scan mode.  Find all the caches, then repeatedly renew the
+ * caches that are due and wait for the next one to come due, a change to one
+ * of the directories, a worker to finish, or a signal.
+ */
+void
+run_scan(krb5_context ctx, struct config *config, char **paths)
+{
+    sigset_t block, mask;
+    time_t now, next, rescan_time = 0;
+    struct timespec timeout;
+    fd_set fds;
+    double left;
+    size_t i, found;
+    int maxfd;
+
+    if (config->keep_ticket == 0)
+        config->keep_ticket = 60;
+
+    /* Build the initial index. */
+#ifdef HAVE_SYS_INOTIFY_H
+    inotify_fd = inotify_init1(IN_NONBLOCK);
+    if (inotify_fd >= 0 && inotify_fd >= FD_SETSIZE) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (inotify_fd < 0)
+        syswarn("cannot initialize inotify, rescanning instead");
+#endif
+    for (i = 0; paths[i] != NULL; i++)
+        if (!dir_scan(dir_add(paths[i], false))) {
+            syswarn("cannot read directory %s", paths[i]);
+            exit_cleanup(ctx, config, 1);
+        }
+    if (config->verbose) {
+        for (i = 0, found = 0; i < cache_count; i++) {
+            cache_schedule(config, &caches[i]);
+            if (caches[i].endtime != 0)
+                found++;
+        }
+        notice("found %lu ticket caches in %lu directories",
+               (unsigned long) found, (unsigned long) dir_count);
+    }
+
+    /* Background and write out the PID file, as in the normal mode. */
+    if (config->background)
+        if (daemon(0, 0) < 0) {
+            syswarn("cannot background");
+            exit_cleanup(ctx, config, 1);
+        }
+    if (config->pidfile != NULL)
+        write_pidfile(config->pidfile, getpid());
+
+    /*
+     * As in run_framework, the signals we handle are blocked except while
+     * waiting so that none are lost between checking for them and waiting.
+     */
+    add_handler(ctx, config, alarm_handler, SIGALRM, "SIGALRM");
+    add_handler(ctx, config, child_handler, SIGCHLD, "SIGCHLD");
+    add_handler(ctx, config, exit_handler, SIGHUP, "SIGHUP");
+    add_handler(ctx, config, exit_handler, SIGINT, "SIGINT");
+    add_handler(ctx, config, exit_handler, SIGTERM, "SIGTERM");
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigaddset(&block, SIGCHLD);
+    sigaddset(&block, SIGHUP);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &mask);
+    while (1) {
+        workers_reap(ctx, config);
+        if (exit_signaled)
+            exit_cleanup(ctx, config, 0);
+        now = clock_now();
+
+        /* Update the index. */
+#ifdef HAVE_SYS_INOTIFY_H
+        if (inotify_fd >= 0)
+            read_events(config);
+#endif
+        if (now >= rescan_time) {
+            for (i = 0; i < dir_count; i++)
+                if (dirs[i].watch < 0)
+                    rescan(config, (ssize_t) i);
+            rescan_time = now + 60 * config->keep_ticket;
+        }
+        for (i = 0; i < cache_count; i++)
+            if (caches[i].dirty && caches[i].worker == 0)
+                cache_schedule(config, &caches[i]);
+
+        /* On SIGALRM, renew everything that can be renewed now. */
+        if (alarm_signaled) {
+            for (i = 0; i < cache_count; i++)
+                if (caches[i].due != 0)
+                    caches[i].due = now;
+            alarm_signaled = 0;
+        }
+
+        /* Start workers for the caches that are due. */
+        next = rescan_time;
+        for (i = 0; i < cache_count; i++) {
+            if (caches[i].worker != 0 || caches[i].due == 0)
+                continue;
+            if (caches[i].due <= now && workers < config->jobs)
+                worker_start(ctx, config, &caches[i]);
+            else if (caches[i].due > now && caches[i].due < next)
+                next = caches[i].due;
+        }
+
+        /*
+         * Wait.  If we have workers and all job slots are busy, there may be
+         * more caches that are due, which we'll get to when a worker exits.
+         */
+        left = clock_interval((double) (next - clock_now()));
+        if (left < 0)
+            left = 0;
+        timeout.tv_sec = (time_t) left;
+        timeout.tv_nsec = (long) ((left - (double) timeout.tv_sec) * 1e9);
+        FD_ZERO(&fds);
+        maxfd = 0;
+        if (inotify_fd >= 0) {
+            FD_SET(inotify_fd, &fds);
+            maxfd = inotify_fd + 1;
+        }
+        pselect(maxfd, &fds, NULL, NULL, &timeout, &mask);
+    }
+}
@@ -0,0 +1,786 @@
+/*
+ * Native AFS token handling for k5start and krenew.
+ *
+ * Rather than running an external aklog program, k5start and krenew can
+ * obtain AFS tokens for a list of cells themselves.  For each cell, get an
+ * afs service ticket using the ticket cache we're maintaining, derive the
+ * rxkad session key from the ticket session key, and install the result as
+ * an rxkad-k5 token in the kernel.  For OpenAFS, this is done with the
+ * VIOCSETTOK pioctl.  For the Linux kafs module, this is done by adding an
+ * rxrpc key to the session keyring.  This avoids a fork and exec plus all of
+ * aklog's Kerberos setup on every refresh.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/kafs.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#ifdef HAVE_LIBKEYUTILS
+#    include <keyutils.h>
+#endif
+
+#include <commands/internal.h>
+#include <util/macros.h>
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The pioctls used to get and set tokens, if not provided by kafs.h. */
+#if defined(HAVE_KAFS) && !defined(VIOCGETTOK)
+#    define VIOCGETTOK _IOW('V', 8, struct ViceIoctl)
+#endif
+#if defined(HAVE_KAFS) && !defined(VIOCSETTOK)
+#    define VIOCSETTOK _IOW('V', 3, struct ViceIoctl)
+#endif
+#if defined(HAVE_KAFS) && !defined(VIOC_GET_WS_CELL)
+#    define VIOC_GET_WS_CELL _IOW('V', 31, struct ViceIoctl)
+#endif
+
+/* The kafs file holding the name of the local cell. */
+#define KAFS_ROOTCELL "/proc/fs/afs/rootcell"
+
+/* The kvno that marks the token as containing a full Kerberos v5 ticket. */
+#define RXKAD_TKT_TYPE_KERBEROS_V5 256
+
+/* The maximum size of a ticket that AFS will accept. */
+#define MAXKTCTICKETLEN 12000
+
+/* The size of an encoded ClearToken struct. */
+#define CLEAR_TOKEN_SIZE 24
+
+/* The size of the header of a version 1 rxrpc key payload. */
+#define RXRPC_KEY_V1_SIZE 24
+
+/* The rxrpc security index for rxkad. */
+#define RXRPC_SECURITY_RXKAD 2
+
+/* Portability between the MIT and Heimdal key and checksum structs. */
+#ifdef HAVE_KRB5_CREDS_SESSION
+#    define creds_key(c) (&(c)->session)
+#else
+#    define creds_key(c) (&(c)->keyblock)
+#endif
+#ifdef HAVE_KRB5_KEYBLOCK_KEYVALUE
+#    define key_type(k)   ((k)->keytype)
+#    define key_data(k)   ((k)->keyvalue.data)
+#    define key_length(k) ((k)->keyvalue.length)
+#else
+#    define key_type(k)   ((k)->enctype)
+#    define key_data(k)   ((k)->contents)
+#    define key_length(k) ((k)->length)
+#endif
+#ifdef HAVE_KRB5_CHECKSUM_CHECKSUM
+#    define checksum_data(c)   ((c)->checksum.data)
+#    define checksum_length(c) ((c)->checksum.length)
+#else
+#    define checksum_data(c)   ((c)->contents)
+#    define checksum_length(c) ((c)->length)
+#endif
+
+/* The DES weak and semi-weak keys, with odd parity. */
+static const unsigned char weak_keys[16][8] = {
+    {0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01},
+    {0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE},
+    {0x1F, 0x1F, 0x1F, 0x1F, 0x0E, 0x0E, 0x0E, 0x0E},
+    {0xE0, 0xE0, 0xE0, 0xE0, 0xF1, 0xF1, 0xF1, 0xF1},
+    {0x01, 0xFE, 0x01, 0xFE, 0x01, 0xFE, 0x01, 0xFE},
+    {0xFE, 0x01, 0xFE, 0x01, 0xFE, 0x01, 0xFE, 0x01},
+    {0x1F, 0xE0, 0x1F, 0xE0, 0x0E, 0xF1, 0x0E, 0xF1},
+    {0xE0, 0x1F, 0xE0, 0x1F, 0xF1, 0x0E, 0xF1, 0x0E},
+    {0x01, 0xE0, 0x01, 0xE0, 0x01, 0xF1, 0x01, 0xF1},
+    {0xE0, 0x01, 0xE0, 0x01, 0xF1, 0x01, 0xF1, 0x01},
+    {0x1F, 0xFE, 0x1F, 0xFE, 0x0E, 0xFE, 0x0E, 0xFE},
+    {0xFE, 0x1F, 0xFE, 0x1F, 0xFE, 0x0E, 0xFE, 0x0E},
+    {0x01, 0x1F, 0x01, 0x1F, 0x01, 0x0E, 0x01, 0x0E},
+    {0x1F, 0x01, 0x1F, 0x01, 0x0E, 0x01, 0x0E, 0x01},
+    {0xE0, 0xFE, 0xE0, 0xFE, 0xF1, 0xFE, 0xF1, 0xFE},
+    {0xFE, 0xE0, 0xFE, 0xE0, 0xFE, 0xF1, 0xFE, 0xF1},
+};
+
+
+/*
+ * Add a cell to the list of cells for which to obtain tokens natively.
+ */
+void
+tokens_add_cell(struct config *config, const char *cell)
+{
+    size_t count = 0;
+
+    if (config->cells != NULL)
+        while (config->cells[count] != NULL)
+            count++;
+    config->cells = xreallocarray(config->cells, count + 2, sizeof(char *));
+    config->cells[count] = xstrdup(cell);
+    config->cells[count + 1] = NULL;
+}
+
+
+/*
+ * Compute the HMAC-MD5 of a message with the given key, storing the result
+ * in output, which must have room for 16 bytes.  The Kerberos libraries
+ * provide MD5 as an unkeyed checksum, which is all that's needed to build
+ * HMAC.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+hmac_md5(krb5_context ctx, const unsigned char *key, size_t keylen,
+         const unsigned char *message, size_t length, unsigned char *output)
+{
+    unsigned char pad[64 + 64];
+    krb5_checksum cksum;
+    krb5_data data;
+    krb5_error_code code;
+    size_t i;
+
+    /* Keys longer than the block size would have to be hashed first. */
+    if (keylen > 64 || length > 64)
+        return KRB5_BAD_MSIZE;
+
+    /* Inner hash: MD5((key XOR ipad) || message). */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keylen);
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x36;
+    memcpy(pad + 64, message, length);
+    data.data = (char *) pad;
+    data.length = (unsigned int) (64 + length);
+    code = krb5_c_make_checksum(ctx, CKSUMTYPE_RSA_MD5, NULL, 0, &data,
+                                &cksum);
+    if (code != 0)
+        return code;
+    if (checksum_length(&cksum) != 16) {
+        krb5_free_checksum_contents(ctx, &cksum);
+        return KRB5_BAD_MSIZE;
+    }
+
+    /* Outer hash: MD5((key XOR opad) || inner). */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keylen);
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x5c;
+    memcpy(pad + 64, checksum_data(&cksum), 16);
+    krb5_free_checksum_contents(ctx, &cksum);
+    data.length = 64 + 16;
+    code = krb5_c_make_checksum(ctx, CKSUMTYPE_RSA_MD5, NULL, 0, &data,
+                                &cksum);
+    explicit_bzero(pad, sizeof(pad));
+    if (code != 0)
+        return code;
+    memcpy(output, checksum_data(&cksum), 16);
+    krb5_free_checksum_contents(ctx, &cksum);
+    return 0;
+}
+
+
+/*
+ * Set odd parity on a DES key and return true if the result is one of the
+ * weak or semi-weak DES keys.
+ */
+static bool
+des_fix_parity(unsigned char *key)
+{
+    size_t i;
+    unsigned char bits, byte;
+
+    for (i = 0; i < 8; i++) {
+        byte = key[i] & 0xfe;
+        for (bits = 0; byte != 0; byte &= byte - 1)
+            bits++;
+        key[i] = (key[i] & 0xfe) | ((bits % 2 == 0) ? 1 : 0);
+    }
+    for (i = 0; i < ARRAY_SIZE(weak_keys); i++)
+        if (memcmp(key, weak_keys[i], 8) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Remove the parity bits from a triple DES key, packing the 56 bits of key
+ * material in each 8-byte DES key into seven bytes.  The low bit of each of
+ * the first seven bytes holds a bit taken from the eighth byte.  Updates
+ * length to the new length.
+ */
+static void
+compress_parity_bits(unsigned char *key, size_t *length)
+{
+    size_t i, j, count;
+    unsigned char bits;
+
+    count = *length / 8;
+    for (i = 0; i < count; i++) {
+        bits = key[8 * i + 7] >> 1;
+        for (j = 0; j < 7; j++) {
+            key[8 * i + j] = (key[8 * i + j] & 0xfe) | (bits & 1);
+            bits >>= 1;
+        }
+    }
+    for (i = 1; i < count; i++)
+        memmove(key + 7 * i, key + 8 * i, 7);
+    *length = 7 * count;
+}
+
+
+/*
+ * Derive the 8-byte DES key used by rxkad from a ticket session key.  DES
+ * session keys are used directly.  Other enctypes use rxkad-kdf: the first
+ * 8 bytes of HMAC-MD5(key, counter || "rxkad\0" || 64) for the first counter
+ * value that doesn't produce a weak key, with triple DES keys first having
+ * their parity bits removed.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+derive_des_key(krb5_context ctx, const krb5_keyblock *key,
+               unsigned char *output)
+{
+    unsigned char input[64], message[1 + 6 + 4], hash[16];
+    size_t length;
+    unsigned int i;
+    krb5_error_code code;
+
+    length = key_length(key);
+    if (length > sizeof(input))
+        return KRB5_BAD_KEYSIZE;
+    memcpy(input, key_data(key), length);
+    switch (key_type(key)) {
+    case 1: /* des-cbc-crc */
+    case 2: /* des-cbc-md4 */
+    case 3: /* des-cbc-md5 */
+        if (length != 8)
+            return KRB5_BAD_KEYSIZE;
+        memcpy(output, input, 8);
+        return 0;
+    case 0:
+    case 4:
+    case 6:
+    case 8:
+    case 9:
+    case 10:
+    case 11:
+    case 12:
+    case 13:
+    case 14:
+    case 15:
+        return KRB5_PROG_ETYPE_NOSUPP;
+    case 5:  /* des3-cbc-md5 */
+    case 7:  /* des3-cbc-sha1 (old) */
+    case 16: /* des3-cbc-sha1-kd */
+        if (length % 8 != 0)
+            return KRB5_BAD_KEYSIZE;
+        compress_parity_bits(input, &length);
+        break;
+    default:
+        break;
+    }
+    if (length < 7)
+        return KRB5_BAD_KEYSIZE;
+
+    /* The label includes its trailing nul, followed by the key size. */
+    memcpy(message + 1, "rxkad", 6);
+    memcpy(message + 7, "\0\0\0\x40", 4);
+    for (i = 1; i < 256; i++) {
+        message[0] = (unsigned char) i;
+        code = hmac_md5(ctx, input, length, message, sizeof(message), hash);
+        if (code != 0)
+            goto done;
+        memcpy(output, hash, 8);
+        if (!des_fix_parity(output))
+            goto done;
+    }
+    code = KRB5_BAD_KEYSIZE;
+
+done:
+    explicit_bzero(input, sizeof(input));
+    explicit_bzero(hash, sizeof(hash));
+    return code;
+}
+
+
+/*
+ * Obtain a service ticket for the given AFS cell from our ticket cache.  Try
+ * afs/<cell>@<realm> first, where realm is the realm of the cache principal,
+ * and fall back on afs@<realm> if that principal doesn't exist.  Stores the
+ * credentials in creds and returns a Kerberos error code, reporting any
+ * errors.
+ */
+static krb5_error_code
+get_afs_creds(krb5_context ctx, struct config *config, const char *cell,
+              krb5_creds **creds)
+{
+    krb5_ccache ccache = NULL;
+    krb5_creds in;
+    krb5_principal client = NULL;
+    const char *realm;
+    krb5_error_code code;
+
+    memset(&in, 0, sizeof(in));
+    code = krb5_cc_resolve(ctx, config->cache, &ccache);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error opening ticket cache");
+        goto done;
+    }
+    code = krb5_cc_get_principal(ctx, ccache, &client);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error reading ticket cache");
+        goto done;
+    }
+    realm = krb5_principal_get_realm(ctx, client);
+    if (realm == NULL) {
+        code = KRB5_CONFIG_NODEFREALM;
+        warn_krb5(ctx, code, "cannot get client realm");
+        goto done;
+    }
+    in.client = client;
+    code = krb5_build_principal(ctx, &in.server, (unsigned int) strlen(realm),
+                                realm, "afs", cell, (const char *) NULL);
+    if (code != 0) {
+        warn_krb5(ctx, code, "error creating AFS principal name");
+        goto done;
+    }
+    code = krb5_get_credentials(ctx, 0, ccache, &in, creds);
+    if (code == KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN) {
+        krb5_free_principal(ctx, in.server);
+        in.server = NULL;
+        code = krb5_build_principal(ctx, &in.server,
+                                    (unsigned int) strlen(realm), realm,
+                                    "afs", (const char *) NULL);
+        if (code != 0) {
+            warn_krb5(ctx, code, "error creating AFS principal name");
+            goto done;
+        }
+        code = krb5_get_credentials(ctx, 0, ccache, &in, creds);
+    }
+    if (code != 0)
+        warn_krb5(ctx, code, "error getting AFS service ticket for %s", cell);
+
+done:
+    if (in.server != NULL)
+        krb5_free_principal(ctx, in.server);
+    if (client != NULL)
+        krb5_free_principal(ctx, client);
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    return code;
+}
+
+
+/*
+ * Append a 32-bit integer in host byte order to a buffer and return the new
+ * end of the buffer.  Used to build the VIOCSETTOK argument and the rxrpc key
+ * payload.
+ */
+#if defined(HAVE_KAFS) || defined(HAVE_LIBKEYUTILS)
+static char *
+append_int32(char *p, int32_t value)
+{
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+#endif
+
+
+/*
+ * Install an rxkad-k5 token for a cell using the VIOCSETTOK pioctl.  The
+ * argument is the ticket length, the ticket, the size of the ClearToken
+ * struct, the ClearToken (kvno, session key, ViceId, start time, and end
+ * time), a flag saying whether this is the primary cell, and the
+ * nul-terminated cell name, all in host byte order.  Returns 0 on success
+ * and an errno value on failure, reporting any errors.
+ */
+#ifdef HAVE_KAFS
+static krb5_error_code
+set_token(const char *cell, krb5_creds *creds, const unsigned char *key)
+{
+    struct ViceIoctl iob;
+    char *buffer, *p;
+    size_t size;
+    int32_t start, end;
+    krb5_error_code code = 0;
+
+    if (creds->ticket.length > MAXKTCTICKETLEN) {
+        warn("AFS service ticket for %s too long", cell);
+        return EINVAL;
+    }
+    size = 4 + creds->ticket.length + 4 + CLEAR_TOKEN_SIZE + 4;
+    size += strlen(cell) + 1;
+    buffer = xmalloc(size);
+
+    /* AFS requires an even token lifetime. */
+    start = (int32_t) creds->times.starttime;
+    if (start == 0)
+        start = (int32_t) creds->times.authtime;
+    end = (int32_t) creds->times.endtime;
+    if ((end - start) % 2 != 0)
+        start++;
+
+    /* Build the pioctl argument. */
+    p = append_int32(buffer, (int32_t) creds->ticket.length);
+    memcpy(p, creds->ticket.data, creds->ticket.length);
+    p += creds->ticket.length;
+    p = append_int32(p, CLEAR_TOKEN_SIZE);
+    p = append_int32(p, RXKAD_TKT_TYPE_KERBEROS_V5);
+    memcpy(p, key, 8);
+    p += 8;
+    p = append_int32(p, (int32_t) getuid());
+    p = append_int32(p, start);
+    p = append_int32(p, end);
+    p = append_int32(p, 0);
+    memcpy(p, cell, strlen(cell) + 1);
+
+    /* Install the token. */
+    iob.in = buffer;
+    iob.in_size = (short) size;
+    iob.out = NULL;
+    iob.out_size = 0;
+    if (k_pioctl(NULL, VIOCSETTOK, &iob, 0) != 0) {
+        code = errno;
+        syswarn("cannot set AFS token for %s", cell);
+    }
+    explicit_bzero(buffer, size);
+    xfree(buffer);
+    return code;
+}
+#else
+static krb5_error_code
+set_token(const char *cell, krb5_creds *creds UNUSED,
+          const unsigned char *key UNUSED)
+{
+    warn("cannot set AFS token for %s: AFS support is not available", cell);
+    return ENOSYS;
+}
+#endif
+
+
+/*
+ * Install an rxkad-k5 token for a cell for the Linux kafs module by adding an
+ * rxrpc key named afs@<cell> to the session keyring.  The payload is the
+ * version 1 rxrpc key format: the interface version, the security index, the
+ * ticket length, the expiration time, the kvno, the session key, and the
+ * ticket, all in host byte order.  Returns 0 on success and an errno value on
+ * failure, reporting any errors.
+ */
+#ifdef HAVE_LIBKEYUTILS
+static krb5_error_code
+set_key(const char *cell, krb5_creds *creds, const unsigned char *key)
+{
+    char *description, *payload, *p;
+    size_t size;
+    uint16_t value;
+    krb5_error_code code = 0;
+
+    if (creds->ticket.length > MAXKTCTICKETLEN) {
+        warn("AFS service ticket for %s too long", cell);
+        return EINVAL;
+    }
+    size = RXRPC_KEY_V1_SIZE + creds->ticket.length;
+    payload = xmalloc(size);
+
+    /* Build the key payload. */
+    p = append_int32(payload, 1);
+    value = RXRPC_SECURITY_RXKAD;
+    memcpy(p, &value, sizeof(value));
+    p += sizeof(value);
+    value = (uint16_t) creds->ticket.length;
+    memcpy(p, &value, sizeof(value));
+    p += sizeof(value);
+    p = append_int32(p, (int32_t) creds->times.endtime);
+    p = append_int32(p, RXKAD_TKT_TYPE_KERBEROS_V5);
+    memcpy(p, key, 8);
+    p += 8;
+    memcpy(p, creds->ticket.data, creds->ticket.length);
+
+    /* Add the key, replacing any existing key for this cell. */
+    xasprintf(&description, "afs@%s", cell);
+    if (add_key("rxrpc", description, payload, size, KEY_SPEC_SESSION_KEYRING)
+        < 0) {
+        code = errno;
+        syswarn("cannot add rxrpc key for %s", cell);
+    }
+    free(description);
+    explicit_bzero(payload, size);
+    free(payload);
+    return code;
+}
+#else
+static krb5_error_code
+set_key(const char *cell, krb5_creds *creds UNUSED,
+        const unsigned char *key UNUSED)
+{
+    warn("cannot set kafs token for %s: built without libkeyutils", cell);
+    return ENOSYS;
+}
+#endif
+
+
+/*
+ * Read a 32-bit integer in host byte order from a buffer at the given offset,
+ * checking that it's within a buffer of the given length.  Returns false if
+ * the integer would run past the end of the buffer.  Only used to parse the
+ * result of VIOCGETTOK.
+ */
+#ifdef HAVE_KAFS
+static bool
+read_int32(const char *buffer, size_t length, size_t offset, int32_t *value)
+{
+    if (offset > length || length - offset < sizeof(*value))
+        return false;
+    memcpy(value, buffer + offset, sizeof(*value));
+    return true;
+}
+
+
+/*
+ * Return the expiration time of the OpenAFS token for a cell, or 0 if there is
+ * no such token or it couldn't be read.  Tokens are retrieved by index with
+ * the VIOCGETTOK pioctl, which returns the same layout as VIOCSETTOK takes,
+ * until the index is out of range.
+ */
+static time_t
+token_expiration(const char *cell)
+{
+    struct ViceIoctl iob;
+    char *buffer;
+    size_t size = MAXKTCTICKETLEN + 1024;
+    size_t offset, length;
+    int32_t index, value, end;
+    time_t expires = 0;
+
+    buffer = xmalloc(size);
+    for (index = 0; index < 1024; index++) {
+        iob.in = &index;
+        iob.in_size = sizeof(index);
+        iob.out = buffer;
+        iob.out_size = (short) size;
+        if (k_pioctl(NULL, VIOCGETTOK, &iob, 0) != 0)
+            break;
+
+        /* Skip the ticket and find the end time in the ClearToken. */
+        length = size - 1;
+        buffer[length] = '\0';
+        if (!read_int32(buffer, length, 0, &value) || value < 0)
+            continue;
+        offset = 4 + (size_t) value;
+        if (!read_int32(buffer, length, offset, &value)
+            || value != CLEAR_TOKEN_SIZE)
+            continue;
+        if (!read_int32(buffer, length, offset + 4 + 20, &end))
+            continue;
+        offset += 4 + CLEAR_TOKEN_SIZE + 4;
+        if (offset >= length)
+            continue;
+
+        /* Check the cell name and return the expiration if it matches. */
+        if (strcmp(buffer + offset, cell) == 0) {
+            expires = end;
+            break;
+        }
+    }
+    explicit_bzero(buffer, size);
+    xfree(buffer);
+    return expires;
+}
+#else
+static time_t
+token_expiration(const char *cell UNUSED)
+{
+    return 0;
+}
+#endif
+
+
+/*
+ * Return the expiration time of the kafs rxrpc key for a cell in the session
+ * keyring, or 0 if there is no such key or it couldn't be read.  Reading an
+ * rxrpc key returns its tokens in XDR: flags, the cell name as a counted and
+ * padded string, the token count, and then for each token its size, security
+ * index, and (for rxkad) ViceId, kvno, session key, start time, and expiration
+ * time.
+ */
+#ifdef HAVE_LIBKEYUTILS
+static time_t
+key_expiration(const char *cell)
+{
+    key_serial_t *keys = NULL;
+    char *description = NULL, *wanted;
+    unsigned char *payload = NULL;
+    const char *name;
+    long size, length;
+    size_t i, offset;
+    uint32_t value;
+    time_t expires = 0;
+
+    size = keyctl_read_alloc(KEY_SPEC_SESSION_KEYRING, (void **) &keys);
+    if (size < 0)
+        return 0;
+    xasprintf(&wanted, "afs@%s", cell);
+    for (i = 0; i < (size_t) size / sizeof(key_serial_t); i++) {
+        free(description);
+        description = NULL;
+        if (keyctl_describe_alloc(keys[i], &description) < 0)
+            continue;
+        if (strncmp(description, "rxrpc;", strlen("rxrpc;")) != 0)
+            continue;
+        name = strrchr(description, ';') + 1;
+        if (strcmp(name, wanted) != 0)
+            continue;
+
+        /*
+         * Parse enough of the XDR token to find the expiration time.  The
+         * payload includes the session key, so clear it before freeing it.
+         */
+        length = keyctl_read_alloc(keys[i], (void **) &payload);
+        if (length < 0)
+            break;
+        if (length >= 12) {
+            memcpy(&value, payload + 4, sizeof(value));
+            offset = 8 + ((ntohl(value) + 3) & ~3U);
+            offset += 4 + 4 + 4 + 4 + 4 + 8 + 4;
+            if (offset + 4 <= (size_t) length) {
+                memcpy(&value, payload + offset, sizeof(value));
+                expires = (time_t) ntohl(value);
+            }
+        }
+        explicit_bzero(payload, (size_t) length);
+        free(payload);
+        break;
+    }
+    free(description);
+    xfree(wanted);
+    free(keys);
+    return expires;
+}
+#else
+static time_t
+key_expiration(const char *cell UNUSED)
+{
+    return 0;
+}
+#endif
+
+
+/*
+ * Return the name of the local cell, which is the cell for which aklog gets
+ * tokens when run without arguments, in newly allocated memory, or NULL if it
+ * can't be determined.  Ask OpenAFS with the VIOC_GET_WS_CELL pioctl and
+ * otherwise read it from the kafs proc file.
+ */
+static char *
+local_cell(bool openafs)
+{
+    FILE *file;
+    char buffer[BUFSIZ];
+#ifdef HAVE_KAFS
+    struct ViceIoctl iob;
+
+    if (openafs) {
+        memset(buffer, 0, sizeof(buffer));
+        iob.in = NULL;
+        iob.in_size = 0;
+        iob.out = buffer;
+        iob.out_size = (short) (sizeof(buffer) - 1);
+        if (k_pioctl(NULL, VIOC_GET_WS_CELL, &iob, 0) != 0)
+            return NULL;
+        return (buffer[0] == '\0') ? NULL : xstrdup(buffer);
+    }
+#else
+    if (openafs)
+        return NULL;
+#endif
+    file = fopen(KAFS_ROOTCELL, "r");
+    if (file == NULL)
+        return NULL;
+    if (fgets(buffer, sizeof(buffer), file) == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    buffer[strcspn(buffer, " \t\n")] = '\0';
+    return (buffer[0] == '\0') ? NULL : xstrdup(buffer);
+}
+
+
+/*
+ * Return the expiration time of our AFS tokens, or 0 if they are missing or
+ * their expiration time could not be determined.  If cells were configured
+ * with -C, this is the earliest expiration time of the tokens for those
+ * cells, and any missing token counts as expired.  Otherwise, it's the
+ * expiration time of the token for the local cell, since that's the token
+ * aklog refreshes, and tokens for other cells are ignored.
+ */
+time_t
+tokens_expiration(struct config *config)
+{
+    time_t (*expiration)(const char *);
+    time_t end, expires = 0;
+    char *cell;
+    size_t i;
+
+    if (k_hasafs())
+        expiration = token_expiration;
+    else if (has_kafs())
+        expiration = key_expiration;
+    else
+        return 0;
+    if (config->cells == NULL) {
+        cell = local_cell(expiration == token_expiration);
+        if (cell == NULL)
+            return 0;
+        expires = expiration(cell);
+        xfree(cell);
+        return expires;
+    }
+    for (i = 0; config->cells[i] != NULL; i++) {
+        end = expiration(config->cells[i]);
+        if (end == 0)
+            return 0;
+        if (expires == 0 || end < expires)
+            expires = end;
+    }
+    return expires;
+}
+
+
+/*
+ * Obtain AFS tokens for a cell without running aklog, using the ticket cache
+ * we're maintaining.  Use the OpenAFS pioctl interface if it is available and
+ * otherwise the Linux kafs keyring interface.  Returns a Kerberos error code
+ * or errno value, having already reported any errors.
+ */
+krb5_error_code
+tokens_set(krb5_context ctx, struct config *config, const char *cell)
+{
+    krb5_creds *creds = NULL;
+    unsigned char key[8];
+    krb5_error_code code;
+    bool use_kafs = false;
+
+    if (!k_hasafs()) {
+        if (!has_kafs()) {
+            warn("cannot set AFS token for %s: AFS is not running", cell);
+            return ENOSYS;
+        }
+        use_kafs = true;
+    }
+    code = get_afs_creds(ctx, config, cell, &creds);
+    if (code != 0)
+        return code;
+    code = derive_des_key(ctx, creds_key(creds), key);
+    if (code != 0)
+        warn_krb5(ctx, code, "cannot derive AFS session key for %s", cell);
+    else {
+        if (use_kafs)
+            code = set_key(cell, creds, key);
+        else
+            code = set_token(cell, creds, key);
+        if (code == 0 && config->verbose)
+            notice("set AFS token for %s", cell);
+    }
+    explicit_bzero(key, sizeof(key));
+    krb5_free_creds(ctx, creds);
+    return code;
+}
@@ -0,0 +1,1371 @@
+/*
+ * A stand-in KDC that replays recorded Kerberos exchanges.
+ *
+ * Usage: replay [-l log] [-P portfile] keytab transcript
+ *
+ * Reads a transcript of KDC exchanges written by tests/data/kdc-proxy -w and
+ * answers requests from it on an unused port on the loopback interface, for
+ * both UDP and TCP, writing the port to the portfile once it is ready.  This
+ * lets the benchmarks run k5start and krenew against the same KDC replies
+ * every time without the cost or the variability of a real KDC.
+ *
+ * Recorded replies can't be sent back unchanged, since the client checks that
+ * a reply has the nonce from its request and times close to the current time,
+ * and a TGS reply is encrypted in the subkey the client chose for that
+ * request.  So the encrypted part of each recorded reply is decrypted when the
+ * transcript is loaded: AS replies with the matching key from the keytab and
+ * TGS replies with the key from the authenticator of the recorded request,
+ * which is decrypted with the session key of the ticket it used.  That ticket
+ * must have been issued by an earlier reply in the same transcript.
+ *
+ * Each new request is answered from the first recorded exchange whose request
+ * has the same shape: the same message type, KDC options, service, and
+ * pre-authentication data types.  Error replies, such as the request for
+ * pre-authentication, are sent unchanged.  Otherwise, the recorded reply is
+ * re-encrypted with the nonce of the new request, its times shifted so that
+ * it was issued now, and, for TGS requests, the key from the new
+ * authenticator.  The tickets in the replies are sent unchanged, since the
+ * client never decrypts them, and are recognized again when the client uses
+ * them in a later request.
+ *
+ * One line per request is appended to the log file giving the request number,
+ * the protocol, and the time in milliseconds it took to build the reply, the
+ * same as the start of each line of a kdc-proxy transcript.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#ifdef HAVE_SYS_SELECT_H
+#    include <sys/select.h>
+#endif
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <util/messages-krb5.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Key usage numbers, from RFC 4120 section 7.5.1 and RFC 6806. */
+#define USAGE_AS_REP          3
+#define USAGE_TGS_AUTH        7
+#define USAGE_TGS_REP_SESSION 8
+#define USAGE_TGS_REP_SUBKEY  9
+#define USAGE_AS_REQ          56
+
+/* Pre-authentication data types that we look at. */
+#define PA_TGS_REQ        1
+#define PA_REQ_ENC_PA_REP 149
+
+/* DER tags of the elements that we look at. */
+#define TAG_INTEGER       0x02
+#define TAG_SEQUENCE      0x30
+#define TAG_AUTHENTICATOR 0x62
+#define TAG_AS_REQ        0x6a
+#define TAG_AS_REP        0x6b
+#define TAG_TGS_REQ       0x6c
+#define TAG_TGS_REP       0x6d
+#define TAG_AP_REQ        0x6e
+#define TAG_ENC_AS_REP    0x79
+#define TAG_ENC_TGS_REP   0x7a
+#define TAG_CONTEXT(n)    ((unsigned char) (0xa0 + (n)))
+
+/* The fields of EncKDCRepPart holding the ticket times, in order. */
+#define FIELD_AUTHTIME   5
+#define FIELD_STARTTIME  6
+#define FIELD_ENDTIME    7
+#define FIELD_RENEW_TILL 8
+
+/* The largest message accepted over TCP and how long to wait for it. */
+#define MAX_MESSAGE (1024 * 1024)
+#define TCP_TIMEOUT 10
+
+/* Portability between the MIT and Heimdal key and checksum structs. */
+#ifdef HAVE_KRB5_KEYBLOCK_KEYVALUE
+#    define key_type(k)   ((k)->keytype)
+#    define key_data(k)   ((k)->keyvalue.data)
+#    define key_length(k) ((k)->keyvalue.length)
+#else
+#    define key_type(k)   ((k)->enctype)
+#    define key_data(k)   ((k)->contents)
+#    define key_length(k) ((k)->length)
+#endif
+#ifdef HAVE_KRB5_CHECKSUM_CHECKSUM
+#    define checksum_data(c)   ((c)->checksum.data)
+#    define checksum_length(c) ((c)->checksum.length)
+#else
+#    define checksum_data(c)   ((c)->contents)
+#    define checksum_length(c) ((c)->length)
+#endif
+
+/*
+ * A parsed DER element.  Elements point into the buffer they were parsed
+ * from, which must outlive them.  der_set replaces the contents of a
+ * primitive element with a copy and marks it changed, and encoding an element
+ * re-encodes only the changed elements and the elements that contain them.
+ */
+struct der {
+    unsigned char tag;
+    const unsigned char *raw; /* Original encoding, including the header. */
+    size_t raw_length;
+    const unsigned char *data; /* Current contents. */
+    size_t length;
+    unsigned char *copy;  /* Replaced contents, if any. */
+    struct der *children; /* Parsed contents of a constructed element. */
+    size_t count;
+    bool changed;
+};
+
+/* A recorded exchange from the transcript. */
+struct exchange {
+    unsigned char *request;
+    size_t request_length;
+    unsigned char *reply;
+    size_t reply_length;
+    unsigned char *shape; /* Summary of the request used for matching. */
+    size_t shape_length;
+    struct der message;         /* The parsed reply. */
+    struct der plain;           /* Its decrypted encrypted part. */
+    unsigned char *plain_data;  /* The buffer holding the decrypted part. */
+    krb5_keyblock key;          /* Reply key for an AS exchange. */
+    time_t times[4];            /* Original ticket times, 0 if absent. */
+    time_t issued;              /* When the reply was issued. */
+    bool usable;
+};
+
+/* A ticket issued by a recorded reply and its session key. */
+struct ticket {
+    const unsigned char *data;
+    size_t length;
+    krb5_keyblock key;
+};
+
+/* All of the state of the stand-in KDC. */
+struct replay {
+    krb5_context ctx;
+    krb5_keyblock *keys;
+    size_t nkeys;
+    struct exchange *exchanges;
+    size_t nexchanges;
+    struct ticket *tickets;
+    size_t ntickets;
+};
+
+
+/*
+ * Free a parsed DER element, but not the element itself.
+ */
+static void
+der_free(struct der *der)
+{
+    size_t i;
+
+    for (i = 0; i < der->count; i++)
+        der_free(&der->children[i]);
+    xfree(der->children);
+    xfree(der->copy);
+    memset(der, 0, sizeof(*der));
+}
+
+
+/*
+ * Parse one DER element from the start of a buffer, storing the number of
+ * bytes it used.  Constructed elements are parsed recursively.  Returns false
+ * if the buffer doesn't start with a valid element.  Kerberos only uses
+ * single-byte tags and definite lengths.
+ */
+static bool der_parse(const unsigned char *, size_t, struct der *, size_t *);
+
+static bool
+der_parse_children(struct der *der)
+{
+    size_t offset = 0;
+    size_t used;
+
+    while (offset < der->length) {
+        der->children =
+            xreallocarray(der->children, der->count + 1, sizeof(struct der));
+        if (!der_parse(der->data + offset, der->length - offset,
+                       &der->children[der->count], &used))
+            return false;
+        der->count++;
+        offset += used;
+    }
+    return true;
+}
+
+static bool
+der_parse(const unsigned char *buffer, size_t buflen, struct der *der,
+          size_t *used)
+{
+    size_t header = 2;
+    size_t length, i, n;
+
+    memset(der, 0, sizeof(*der));
+    if (buflen < 2 || (buffer[0] & 0x1f) == 0x1f)
+        return false;
+    der->tag = buffer[0];
+    length = buffer[1];
+    if (length & 0x80) {
+        n = length & 0x7f;
+        if (n == 0 || n > sizeof(size_t) || buflen < 2 + n)
+            return false;
+        length = 0;
+        for (i = 0; i < n; i++)
+            length = (length << 8) | buffer[2 + i];
+        header += n;
+    }
+    if (length > buflen - header)
+        return false;
+    der->raw = buffer;
+    der->raw_length = header + length;
+    der->data = buffer + header;
+    der->length = length;
+    if (used != NULL)
+        *used = der->raw_length;
+    if ((der->tag & 0x20) && !der_parse_children(der)) {
+        der_free(der);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Return whether an element or anything inside it has been changed.
+ */
+static bool
+der_changed(const struct der *der)
+{
+    size_t i;
+
+    if (der->changed)
+        return true;
+    for (i = 0; i < der->count; i++)
+        if (der_changed(&der->children[i]))
+            return true;
+    return false;
+}
+
+
+/*
+ * Return the number of bytes after the first needed to encode a length.
+ */
+static size_t
+der_length_bytes(size_t length)
+{
+    size_t n;
+
+    if (length < 0x80)
+        return 0;
+    for (n = 1; n < sizeof(size_t) && length >> (8 * n) > 0; n++)
+        ;
+    return n;
+}
+
+
+/*
+ * Return the length of the contents of an element and the length of its whole
+ * encoding as it will be written.
+ */
+static size_t der_size(const struct der *);
+
+static size_t
+der_content_size(const struct der *der)
+{
+    size_t i;
+    size_t length = 0;
+
+    if (!(der->tag & 0x20))
+        return der->length;
+    for (i = 0; i < der->count; i++)
+        length += der_size(&der->children[i]);
+    return length;
+}
+
+static size_t
+der_size(const struct der *der)
+{
+    size_t length;
+
+    if (!der_changed(der))
+        return der->raw_length;
+    length = der_content_size(der);
+    return 2 + der_length_bytes(length) + length;
+}
+
+
+/*
+ * Write an element to the given buffer, which must be large enough, and
+ * return a pointer to the byte after it.
+ */
+static unsigned char *
+der_write(const struct der *der, unsigned char *p)
+{
+    size_t length, n, i;
+
+    if (!der_changed(der)) {
+        memcpy(p, der->raw, der->raw_length);
+        return p + der->raw_length;
+    }
+    length = der_content_size(der);
+    *p++ = der->tag;
+    n = der_length_bytes(length);
+    if (n == 0)
+        *p++ = (unsigned char) length;
+    else {
+        *p++ = (unsigned char) (0x80 | n);
+        for (i = n; i > 0; i--)
+            *p++ = (unsigned char) ((length >> (8 * (i - 1))) & 0xff);
+    }
+    if (der->tag & 0x20) {
+        for (i = 0; i < der->count; i++)
+            p = der_write(&der->children[i], p);
+    } else {
+        memcpy(p, der->data, der->length);
+        p += der->length;
+    }
+    return p;
+}
+
+
+/*
+ * Encode an element into newly allocated memory, storing its length.
+ */
+static unsigned char *
+der_encode(const struct der *der, size_t *length)
+{
+    unsigned char *buffer;
+
+    *length = der_size(der);
+    buffer = xmalloc(*length);
+    der_write(der, buffer);
+    return buffer;
+}
+
+
+/*
+ * Replace the contents of a primitive element.
+ */
+static void
+der_set(struct der *der, const void *data, size_t length)
+{
+    unsigned char *copy;
+
+    copy = xmalloc(length > 0 ? length : 1);
+    memcpy(copy, data, length);
+    xfree(der->copy);
+    der->copy = copy;
+    der->data = copy;
+    der->length = length;
+    der->changed = true;
+}
+
+
+/*
+ * Return the inner SEQUENCE of an element with the given application tag, or
+ * NULL if the element is something else.  Accepts NULL to allow chaining.
+ */
+static struct der *
+der_body(struct der *der, unsigned char tag)
+{
+    if (der == NULL || der->tag != tag || der->count != 1)
+        return NULL;
+    if (der->children[0].tag != TAG_SEQUENCE)
+        return NULL;
+    return &der->children[0];
+}
+
+
+/*
+ * Return the element inside explicitly tagged field n of a SEQUENCE, or NULL
+ * if that field isn't present.  Accepts NULL to allow chaining.
+ */
+static struct der *
+der_field(struct der *seq, int n)
+{
+    size_t i;
+
+    if (seq == NULL)
+        return NULL;
+    for (i = 0; i < seq->count; i++)
+        if (seq->children[i].tag == TAG_CONTEXT(n)) {
+            if (seq->children[i].count != 1)
+                return NULL;
+            return &seq->children[i].children[0];
+        }
+    return NULL;
+}
+
+
+/*
+ * Read a DER INTEGER that fits in a long.
+ */
+static bool
+der_int(const struct der *der, long *value)
+{
+    unsigned long result;
+    size_t i;
+
+    if (der == NULL || der->tag != TAG_INTEGER || der->length == 0
+        || der->length > sizeof(long))
+        return false;
+    result = (der->data[0] & 0x80) ? ~0UL : 0;
+    for (i = 0; i < der->length; i++)
+        result = (result << 8) | der->data[i];
+    *value = (long) result;
+    return true;
+}
+
+
+/*
+ * Set a DER INTEGER to a value, using the shortest encoding.
+ */
+static void
+der_set_int(struct der *der, long value)
+{
+    unsigned char bytes[sizeof(long)];
+    unsigned long bits = (unsigned long) value;
+    size_t i, start;
+
+    for (i = sizeof(bytes); i > 0; i--) {
+        bytes[i - 1] = (unsigned char) (bits & 0xff);
+        bits >>= 8;
+    }
+    for (start = 0; start < sizeof(bytes) - 1; start++) {
+        if (bytes[start] == 0 && !(bytes[start + 1] & 0x80))
+            continue;
+        if (bytes[start] == 0xff && (bytes[start + 1] & 0x80))
+            continue;
+        break;
+    }
+    der_set(der, bytes + start, sizeof(bytes) - start);
+}
+
+
+/*
+ * Read a KerberosTime, a GeneralizedTime of the form YYYYMMDDHHMMSSZ, and
+ * return it as seconds since the epoch, or 0 if it's invalid.
+ */
+static time_t
+der_time(const struct der *der)
+{
+    struct tm tm;
+    int fields[6];
+    const int widths[6] = {4, 2, 2, 2, 2, 2};
+    const unsigned char *p;
+    size_t i, j;
+
+    if (der == NULL || der->length != 15 || der->data[14] != 'Z')
+        return 0;
+    p = der->data;
+    for (i = 0; i < 6; i++) {
+        fields[i] = 0;
+        for (j = 0; j < (size_t) widths[i]; j++, p++) {
+            if (*p < '0' || *p > '9')
+                return 0;
+            fields[i] = fields[i] * 10 + (*p - '0');
+        }
+    }
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = fields[0] - 1900;
+    tm.tm_mon = fields[1] - 1;
+    tm.tm_mday = fields[2];
+    tm.tm_hour = fields[3];
+    tm.tm_min = fields[4];
+    tm.tm_sec = fields[5];
+    return timegm(&tm);
+}
+
+
+/*
+ * Set a KerberosTime.
+ */
+static void
+der_set_time(struct der *der, time_t when)
+{
+    struct tm tm;
+    char buffer[32];
+
+    if (gmtime_r(&when, &tm) == NULL)
+        die("cannot convert time %ld", (long) when);
+    strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%SZ", &tm);
+    der_set(der, buffer, strlen(buffer));
+}
+
+
+/*
+ * Find the pre-authentication data of the given type in a SEQUENCE OF
+ * PA-DATA and return its OCTET STRING value, or NULL if it isn't there.
+ */
+static struct der *
+find_padata(struct der *padata, long type)
+{
+    struct der *entry;
+    size_t i;
+    long value;
+
+    if (padata == NULL)
+        return NULL;
+    for (i = 0; i < padata->count; i++) {
+        entry = &padata->children[i];
+        if (der_int(der_field(entry, 1), &value) && value == type)
+            return der_field(entry, 2);
+    }
+    return NULL;
+}
+
+
+/*
+ * Copy a key, allocating new memory for its contents.
+ */
+static void
+key_copy(krb5_keyblock *dst, const krb5_keyblock *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    key_type(dst) = key_type(src);
+    key_length(dst) = key_length(src);
+    key_data(dst) = xmalloc(key_length(src) > 0 ? key_length(src) : 1);
+    memcpy(key_data(dst), key_data(src), key_length(src));
+}
+
+
+/*
+ * Read an EncryptionKey into a newly allocated key.
+ */
+static bool
+der_key(struct der *der, krb5_keyblock *key)
+{
+    struct der *value;
+    long type;
+
+    value = der_field(der, 1);
+    if (!der_int(der_field(der, 0), &type) || value == NULL)
+        return false;
+    memset(key, 0, sizeof(*key));
+    key_type(key) = (krb5_enctype) type;
+    key_length(key) = (unsigned int) value->length;
+    key_data(key) = xmalloc(value->length > 0 ? value->length : 1);
+    memcpy(key_data(key), value->data, value->length);
+    return true;
+}
+
+
+/*
+ * Free a key allocated by key_copy or der_key.
+ */
+static void
+key_free(krb5_keyblock *key)
+{
+    if (key_data(key) != NULL)
+        explicit_bzero(key_data(key), key_length(key));
+    xfree(key_data(key));
+    memset(key, 0, sizeof(*key));
+}
+
+
+/*
+ * Decrypt an EncryptedData element with the given key and key usage and parse
+ * the result into plain.  The buffer holding the decrypted data, which plain
+ * points into, is stored in data and must be freed by the caller.
+ */
+static bool
+decrypt_part(krb5_context ctx, const krb5_keyblock *key, krb5_keyusage usage,
+             struct der *enc, struct der *plain, unsigned char **data)
+{
+    struct der *cipher;
+    krb5_enc_data in;
+    krb5_data out;
+    unsigned char *buffer;
+    long type;
+
+    cipher = der_field(enc, 2);
+    if (!der_int(der_field(enc, 0), &type) || cipher == NULL)
+        return false;
+    if (type != key_type(key))
+        return false;
+    memset(&in, 0, sizeof(in));
+    in.enctype = (krb5_enctype) type;
+    in.ciphertext.data = xmalloc(cipher->length);
+    in.ciphertext.length = (unsigned int) cipher->length;
+    memcpy(in.ciphertext.data, cipher->data, cipher->length);
+    buffer = xmalloc(cipher->length);
+    memset(&out, 0, sizeof(out));
+    out.data = (void *) buffer;
+    out.length = (unsigned int) cipher->length;
+    if (krb5_c_decrypt(ctx, key, usage, NULL, &in, &out) != 0
+        || !der_parse(buffer, out.length, plain, NULL)) {
+        xfree(in.ciphertext.data);
+        xfree(buffer);
+        return false;
+    }
+    xfree(in.ciphertext.data);
+    *data = buffer;
+    return true;
+}
+
+
+/*
+ * Encrypt an element with the given key and key usage and store it in an
+ * EncryptedData element, replacing what was there.
+ */
+static void
+encrypt_part(krb5_context ctx, const krb5_keyblock *key, krb5_keyusage usage,
+             const struct der *plain, struct der *enc)
+{
+    struct der *etype, *cipher;
+    krb5_data in;
+    krb5_enc_data out;
+    krb5_error_code code;
+    unsigned char *data;
+    size_t length, size;
+
+    etype = der_field(enc, 0);
+    cipher = der_field(enc, 2);
+    if (etype == NULL || cipher == NULL)
+        die("invalid encrypted part in recorded reply");
+    data = der_encode(plain, &length);
+    code = krb5_c_encrypt_length(ctx, key_type(key), length, &size);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot get encrypted length");
+    memset(&in, 0, sizeof(in));
+    in.data = (void *) data;
+    in.length = (unsigned int) length;
+    memset(&out, 0, sizeof(out));
+    out.ciphertext.data = xmalloc(size);
+    out.ciphertext.length = (unsigned int) size;
+    code = krb5_c_encrypt(ctx, key, usage, NULL, &in, &out);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot encrypt reply");
+    der_set(cipher, out.ciphertext.data, out.ciphertext.length);
+    der_set_int(etype, key_type(key));
+    xfree(out.ciphertext.data);
+    xfree(data);
+}
+
+
+/*
+ * Summarize a request for matching it against the recorded requests: its
+ * message type, KDC options, service, and pre-authentication data types.
+ * Returns the summary in newly allocated memory, or NULL if the request
+ * couldn't be parsed.
+ */
+static unsigned char *
+request_shape(struct der *request, size_t *length)
+{
+    struct der *body, *req, *options, *sname, *padata;
+    unsigned char *shape, *p;
+    size_t i;
+    long type;
+
+    body = der_body(request, request->tag);
+    req = der_field(body, 4);
+    if (req == NULL || req->tag != TAG_SEQUENCE)
+        return NULL;
+    options = der_field(req, 0);
+    sname = der_field(req, 3);
+    padata = der_field(body, 3);
+    *length = 1 + (options != NULL ? options->length : 0)
+              + (sname != NULL ? sname->raw_length : 0)
+              + (padata != NULL ? padata->count * sizeof(long) : 0);
+    shape = xmalloc(*length);
+    p = shape;
+    *p++ = request->tag;
+    if (options != NULL) {
+        memcpy(p, options->data, options->length);
+        p += options->length;
+    }
+    if (sname != NULL) {
+        memcpy(p, sname->raw, sname->raw_length);
+        p += sname->raw_length;
+    }
+    if (padata != NULL)
+        for (i = 0; i < padata->count; i++) {
+            if (!der_int(der_field(&padata->children[i], 1), &type))
+                type = -1;
+            memcpy(p, &type, sizeof(type));
+            p += sizeof(type);
+        }
+    return shape;
+}
+
+
+/*
+ * Remember a ticket issued by a recorded reply along with its session key.
+ */
+static void
+add_ticket(struct replay *replay, const struct der *ticket,
+           const krb5_keyblock *key)
+{
+    struct ticket *entry;
+
+    replay->tickets = xreallocarray(replay->tickets, replay->ntickets + 1,
+                                    sizeof(struct ticket));
+    entry = &replay->tickets[replay->ntickets++];
+    entry->data = ticket->raw;
+    entry->length = ticket->raw_length;
+    key_copy(&entry->key, key);
+}
+
+
+/*
+ * Find the session key for a ticket issued by a recorded reply, or return
+ * NULL if we don't know it.
+ */
+static const krb5_keyblock *
+find_ticket(struct replay *replay, const struct der *ticket)
+{
+    size_t i;
+
+    for (i = 0; i < replay->ntickets; i++)
+        if (replay->tickets[i].length == ticket->raw_length
+            && memcmp(replay->tickets[i].data, ticket->raw, ticket->raw_length)
+                   == 0)
+            return &replay->tickets[i].key;
+    return NULL;
+}
+
+
+/*
+ * Given a TGS-REQ, find the key the KDC encrypts its reply in and the key
+ * usage for it: the subkey from the authenticator if there is one, and
+ * otherwise the session key of the ticket.  The ticket must have been issued
+ * by a recorded reply, since otherwise we can't decrypt the authenticator.
+ * The key is newly allocated.
+ */
+static bool
+tgs_reply_key(struct replay *replay, struct der *request, krb5_keyblock *key,
+              krb5_keyusage *usage)
+{
+    struct der *value, *body, *subkey;
+    struct der ap_req, auth;
+    const krb5_keyblock *session;
+    unsigned char *data;
+    bool okay = false;
+
+    value = find_padata(der_field(der_body(request, TAG_TGS_REQ), 3),
+                        PA_TGS_REQ);
+    if (value == NULL || !der_parse(value->data, value->length, &ap_req, NULL))
+        return false;
+    body = der_body(&ap_req, TAG_AP_REQ);
+    session = (der_field(body, 3) == NULL)
+                  ? NULL
+                  : find_ticket(replay, der_field(body, 3));
+    if (session == NULL)
+        goto done;
+    if (!decrypt_part(replay->ctx, session, USAGE_TGS_AUTH, der_field(body, 4),
+                      &auth, &data))
+        goto done;
+    subkey = der_field(der_body(&auth, TAG_AUTHENTICATOR), 6);
+    if (subkey != NULL) {
+        okay = der_key(subkey, key);
+        *usage = USAGE_TGS_REP_SUBKEY;
+    } else {
+        key_copy(key, session);
+        *usage = USAGE_TGS_REP_SESSION;
+        okay = true;
+    }
+    der_free(&auth);
+    xfree(data);
+
+done:
+    der_free(&ap_req);
+    return okay;
+}
+
+
+/*
+ * Return the body of the decrypted part of a reply.
+ */
+static struct der *
+plain_body(struct exchange *exchange)
+{
+    struct der *body;
+
+    body = der_body(&exchange->plain, TAG_ENC_AS_REP);
+    if (body == NULL)
+        body = der_body(&exchange->plain, TAG_ENC_TGS_REP);
+    return body;
+}
+
+
+/*
+ * Decrypt the reply of a recorded exchange, returning false if we can't.
+ * For a successful reply, remember the ticket it issued and the ticket times.
+ */
+static bool
+decrypt_exchange(struct replay *replay, struct exchange *exchange,
+                 struct der *request)
+{
+    struct der *rep, *enc, *body, *ticket;
+    krb5_keyblock key, session;
+    krb5_keyusage usage;
+    size_t i;
+    long type;
+    int n;
+    bool okay = false;
+
+    rep = der_body(&exchange->message, exchange->message.tag);
+    enc = der_field(rep, 6);
+    ticket = der_field(rep, 5);
+    if (enc == NULL || ticket == NULL)
+        return false;
+    if (exchange->message.tag == TAG_AS_REP) {
+        if (!der_int(der_field(enc, 0), &type))
+            return false;
+        for (i = 0; i < replay->nkeys && !okay; i++) {
+            if (key_type(&replay->keys[i]) != type)
+                continue;
+            okay = decrypt_part(replay->ctx, &replay->keys[i], USAGE_AS_REP,
+                                enc, &exchange->plain, &exchange->plain_data);
+            if (okay)
+                key_copy(&exchange->key, &replay->keys[i]);
+        }
+    } else {
+        if (!tgs_reply_key(replay, request, &key, &usage))
+            return false;
+        okay = decrypt_part(replay->ctx, &key, usage, enc, &exchange->plain,
+                            &exchange->plain_data);
+        key_free(&key);
+    }
+    if (!okay)
+        return false;
+    body = plain_body(exchange);
+    if (body == NULL || !der_key(der_field(body, 0), &session))
+        return false;
+    add_ticket(replay, ticket, &session);
+    key_free(&session);
+    for (n = FIELD_AUTHTIME; n <= FIELD_RENEW_TILL; n++)
+        exchange->times[n - FIELD_AUTHTIME] = der_time(der_field(body, n));
+    exchange->issued = exchange->times[FIELD_STARTTIME - FIELD_AUTHTIME];
+    if (exchange->issued == 0)
+        exchange->issued = exchange->times[0];
+    return exchange->issued != 0;
+}
+
+
+/*
+ * Decode a string of hex digits into newly allocated memory, storing the
+ * length.  Returns NULL if the string isn't valid hex.
+ */
+static unsigned char *
+decode_hex(const char *hex, size_t *length)
+{
+    unsigned char *data;
+    size_t i;
+    unsigned int byte;
+
+    *length = strlen(hex) / 2;
+    if (strlen(hex) % 2 != 0 || *length == 0)
+        return NULL;
+    data = xmalloc(*length);
+    for (i = 0; i < *length; i++) {
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            xfree(data);
+            return NULL;
+        }
+        data[i] = (unsigned char) byte;
+    }
+    return data;
+}
+
+
+/*
+ * Load the transcript, decrypting each recorded reply.  Exchanges that can't
+ * be used, such as ones without a reply, are kept so that the request numbers
+ * in diagnostics match the transcript but are never replayed.
+ */
+static void
+load_transcript(struct replay *replay, const char *path)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t size = 0;
+    char *request, *reply;
+    struct exchange *exchange;
+    struct der parsed;
+    size_t usable = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysdie("cannot open %s", path);
+    while (getline(&line, &size, file) > 0) {
+        replay->exchanges =
+            xreallocarray(replay->exchanges, replay->nexchanges + 1,
+                          sizeof(struct exchange));
+        exchange = &replay->exchanges[replay->nexchanges++];
+        memset(exchange, 0, sizeof(*exchange));
+        line[strcspn(line, "\n")] = '\0';
+        request = NULL;
+        reply = strrchr(line, ' ');
+        if (reply != NULL) {
+            *reply++ = '\0';
+            request = strrchr(line, ' ');
+        }
+        if (request == NULL)
+            die("invalid transcript line %lu in %s",
+                (unsigned long) replay->nexchanges, path);
+        request++;
+        exchange->request = decode_hex(request, &exchange->request_length);
+        exchange->reply = decode_hex(reply, &exchange->reply_length);
+        if (exchange->request == NULL || exchange->reply == NULL)
+            continue;
+        if (!der_parse(exchange->request, exchange->request_length, &parsed,
+                       NULL))
+            continue;
+        exchange->shape = request_shape(&parsed, &exchange->shape_length);
+        if (exchange->shape != NULL
+            && der_parse(exchange->reply, exchange->reply_length,
+                         &exchange->message, NULL)) {
+            if (exchange->message.tag == TAG_AS_REP
+                || exchange->message.tag == TAG_TGS_REP)
+                exchange->usable =
+                    decrypt_exchange(replay, exchange, &parsed);
+            else
+                exchange->usable = true;
+            if (!exchange->usable)
+                warn("cannot decrypt reply %lu in %s",
+                     (unsigned long) replay->nexchanges, path);
+        }
+        der_free(&parsed);
+        if (exchange->usable)
+            usable++;
+    }
+    if (ferror(file))
+        sysdie("cannot read %s", path);
+    fclose(file);
+    free(line);
+    if (usable == 0)
+        die("no usable exchanges in %s", path);
+}
+
+
+/*
+ * Load all of the keys from the keytab.
+ */
+static void
+load_keytab(struct replay *replay, const char *path)
+{
+    krb5_keytab keytab;
+    krb5_kt_cursor cursor;
+    krb5_keytab_entry entry;
+    krb5_error_code code;
+
+    code = krb5_kt_resolve(replay->ctx, path, &keytab);
+    if (code != 0)
+        die_krb5(replay->ctx, code, "cannot open keytab %s", path);
+    code = krb5_kt_start_seq_get(replay->ctx, keytab, &cursor);
+    if (code != 0)
+        die_krb5(replay->ctx, code, "cannot read keytab %s", path);
+    while (krb5_kt_next_entry(replay->ctx, keytab, &entry, &cursor) == 0) {
+        replay->keys = xreallocarray(replay->keys, replay->nkeys + 1,
+                                     sizeof(krb5_keyblock));
+        key_copy(&replay->keys[replay->nkeys++], &entry.key);
+        krb5_free_keytab_entry_contents(replay->ctx, &entry);
+    }
+    krb5_kt_end_seq_get(replay->ctx, keytab, &cursor);
+    krb5_kt_close(replay->ctx, keytab);
+    if (replay->nkeys == 0)
+        die("no keys in keytab %s", path);
+}
+
+
+/*
+ * Shift the ticket times of a recorded reply so that it was issued now,
+ * keeping them within the times the new request asked for.
+ */
+static void
+update_times(struct exchange *exchange, struct der *body, struct der *req)
+{
+    time_t now, when, limit;
+    int n;
+
+    now = time(NULL);
+    for (n = FIELD_AUTHTIME; n <= FIELD_RENEW_TILL; n++) {
+        if (exchange->times[n - FIELD_AUTHTIME] == 0)
+            continue;
+        when = exchange->times[n - FIELD_AUTHTIME] + (now - exchange->issued);
+        limit = 0;
+        if (n == FIELD_ENDTIME)
+            limit = der_time(der_field(req, 5));
+        else if (n == FIELD_RENEW_TILL)
+            limit = der_time(der_field(req, 6));
+        if (limit > now && when > limit)
+            when = limit;
+        der_set_time(der_field(body, n), when);
+    }
+}
+
+
+/*
+ * Recompute the checksum of the request that the KDC includes in the
+ * encrypted part of its reply for RFC 6806 protected negotiation, if the
+ * recorded reply has one, since it covers the exact bytes of the request.
+ */
+static void
+update_checksum(krb5_context ctx, const krb5_keyblock *key, struct der *body,
+                const unsigned char *request, size_t length)
+{
+    struct der *value, *field;
+    struct der checksum;
+    krb5_checksum result;
+    krb5_data data;
+    krb5_error_code code;
+    unsigned char *encoded;
+    size_t size;
+    long type;
+
+    value = find_padata(der_field(body, 12), PA_REQ_ENC_PA_REP);
+    if (value == NULL)
+        return;
+    if (!der_parse(value->data, value->length, &checksum, NULL))
+        die("invalid request checksum in recorded reply");
+    field = der_field(&checksum, 1);
+    if (!der_int(der_field(&checksum, 0), &type) || field == NULL)
+        die("invalid request checksum in recorded reply");
+    memset(&data, 0, sizeof(data));
+    data.data = (void *) xmalloc(length);
+    data.length = (unsigned int) length;
+    memcpy(data.data, request, length);
+    code = krb5_c_make_checksum(ctx, (krb5_cksumtype) type, key, USAGE_AS_REQ,
+                                &data, &result);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot make request checksum");
+    der_set(field, checksum_data(&result), checksum_length(&result));
+    krb5_free_checksum_contents(ctx, &result);
+    xfree(data.data);
+    encoded = der_encode(&checksum, &size);
+    der_free(&checksum);
+    der_set(value, encoded, size);
+    xfree(encoded);
+}
+
+
+/*
+ * Build the reply to a request in newly allocated memory, storing its length,
+ * or return NULL if there's no recorded exchange we can answer it from.
+ */
+static unsigned char *
+build_reply(struct replay *replay, const unsigned char *data, size_t length,
+            size_t *reply_length)
+{
+    struct der request;
+    struct der *req, *body;
+    struct exchange *exchange = NULL;
+    unsigned char *shape;
+    unsigned char *reply = NULL;
+    size_t shape_length, i;
+    krb5_keyblock key;
+    krb5_keyusage usage;
+
+    if (!der_parse(data, length, &request, NULL))
+        return NULL;
+    if (request.tag != TAG_AS_REQ && request.tag != TAG_TGS_REQ)
+        goto done;
+    shape = request_shape(&request, &shape_length);
+    if (shape == NULL)
+        goto done;
+    for (i = 0; i < replay->nexchanges && exchange == NULL; i++)
+        if (replay->exchanges[i].usable
+            && replay->exchanges[i].shape_length == shape_length
+            && memcmp(replay->exchanges[i].shape, shape, shape_length) == 0)
+            exchange = &replay->exchanges[i];
+    xfree(shape);
+    if (exchange == NULL)
+        goto done;
+
+    /* Errors are sent unchanged. */
+    if (exchange->message.tag != TAG_AS_REP
+        && exchange->message.tag != TAG_TGS_REP) {
+        reply = xmalloc(exchange->reply_length);
+        memcpy(reply, exchange->reply, exchange->reply_length);
+        *reply_length = exchange->reply_length;
+        goto done;
+    }
+
+    /* Find the key to encrypt the reply in. */
+    if (request.tag == TAG_AS_REQ) {
+        key_copy(&key, &exchange->key);
+        usage = USAGE_AS_REP;
+    } else if (!tgs_reply_key(replay, &request, &key, &usage)) {
+        warn("TGS request with a ticket not in the transcript");
+        goto done;
+    }
+
+    /* Update the recorded reply for this request and encrypt it. */
+    req = der_field(der_body(&request, request.tag), 4);
+    body = plain_body(exchange);
+    if (der_field(req, 7) == NULL || der_field(body, 2) == NULL)
+        die("request or recorded reply has no nonce");
+    der_set(der_field(body, 2), der_field(req, 7)->data,
+            der_field(req, 7)->length);
+    update_times(exchange, body, req);
+    update_checksum(replay->ctx, &key, body, data, length);
+    encrypt_part(replay->ctx, &key, usage, &exchange->plain,
+                 der_field(der_body(&exchange->message, exchange->message.tag),
+                           6));
+    key_free(&key);
+    reply = der_encode(&exchange->message, reply_length);
+
+done:
+    der_free(&request);
+    return reply;
+}
+
+
+/*
+ * Answer one request, logging it.  Returns the reply or NULL.
+ */
+static unsigned char *
+handle_request(struct replay *replay, FILE *log, const char *protocol,
+               const unsigned char *request, size_t length,
+               size_t *reply_length)
+{
+    static unsigned long number = 0;
+    struct timeval start, end;
+    unsigned char *reply;
+    double elapsed;
+
+    gettimeofday(&start, NULL);
+    reply = build_reply(replay, request, length, reply_length);
+    gettimeofday(&end, NULL);
+    number++;
+    if (reply == NULL)
+        warn("no recorded exchange for request %lu", number);
+    if (log != NULL) {
+        elapsed = (double) (end.tv_sec - start.tv_sec) * 1000.0
+                  + (double) (end.tv_usec - start.tv_usec) / 1000.0;
+        fprintf(log, "%lu %s %.3f\n", number, protocol, elapsed);
+        fflush(log);
+    }
+    return reply;
+}
+
+
+/*
+ * Read or write exactly the given number of bytes on a stream socket.
+ */
+static bool
+read_all(int fd, unsigned char *buffer, size_t length)
+{
+    ssize_t status;
+    size_t offset = 0;
+
+    while (offset < length) {
+        status = read(fd, buffer + offset, length - offset);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        offset += (size_t) status;
+    }
+    return true;
+}
+
+static bool
+write_all(int fd, const unsigned char *buffer, size_t length)
+{
+    ssize_t status;
+    size_t offset = 0;
+
+    while (offset < length) {
+        status = write(fd, buffer + offset, length - offset);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        offset += (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Handle a TCP connection, which carries one length-prefixed request.
+ */
+static void
+handle_tcp(struct replay *replay, FILE *log, int fd)
+{
+    struct timeval timeout = {TCP_TIMEOUT, 0};
+    unsigned char prefix[4];
+    unsigned char *request, *reply;
+    size_t length, reply_length;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!read_all(fd, prefix, sizeof(prefix)))
+        return;
+    length = ((size_t) prefix[0] << 24) | ((size_t) prefix[1] << 16)
+             | ((size_t) prefix[2] << 8) | prefix[3];
+    if (length == 0 || length > MAX_MESSAGE)
+        return;
+    request = xmalloc(length);
+    if (read_all(fd, request, length)) {
+        reply = handle_request(replay, log, "tcp", request, length,
+                               &reply_length);
+        if (reply != NULL) {
+            prefix[0] = (unsigned char) ((reply_length >> 24) & 0xff);
+            prefix[1] = (unsigned char) ((reply_length >> 16) & 0xff);
+            prefix[2] = (unsigned char) ((reply_length >> 8) & 0xff);
+            prefix[3] = (unsigned char) (reply_length & 0xff);
+            if (write_all(fd, prefix, sizeof(prefix)))
+                write_all(fd, reply, reply_length);
+            xfree(reply);
+        }
+    }
+    xfree(request);
+}
+
+
+/*
+ * Listen on the same unused port on the loopback interface for both UDP and
+ * TCP, retrying if another process has the UDP port the kernel picked for
+ * TCP.  Returns the port.
+ */
+static unsigned short
+listen_loopback(int *tcp, int *udp)
+{
+    struct sockaddr_in addr;
+    socklen_t size;
+    int tries, on = 1;
+
+    for (tries = 0; tries < 10; tries++) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *tcp = socket(AF_INET, SOCK_STREAM, 0);
+        if (*tcp < 0)
+            sysdie("cannot create TCP socket");
+        setsockopt(*tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        size = sizeof(addr);
+        if (bind(*tcp, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(*tcp, 16) < 0
+            || getsockname(*tcp, (struct sockaddr *) &addr, &size) < 0)
+            sysdie("cannot listen on TCP");
+        *udp = socket(AF_INET, SOCK_DGRAM, 0);
+        if (*udp < 0)
+            sysdie("cannot create UDP socket");
+        if (bind(*udp, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            return ntohs(addr.sin_port);
+        close(*udp);
+        close(*tcp);
+    }
+    sysdie("cannot listen on UDP");
+}
+
+
+/*
+ * Write the port to the port file, atomically so that the caller never sees
+ * a partial port.
+ */
+static void
+write_port(const char *path, unsigned short port)
+{
+    char *tmp;
+    FILE *file;
+
+    xasprintf(&tmp, "%s.new", path);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        sysdie("cannot create %s", tmp);
+    fprintf(file, "%u\n", (unsigned int) port);
+    if (fclose(file) == EOF)
+        sysdie("cannot flush %s", tmp);
+    if (rename(tmp, path) < 0)
+        sysdie("cannot rename %s to %s", tmp, path);
+    xfree(tmp);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct replay replay;
+    const char *portfile = NULL;
+    FILE *log = NULL;
+    unsigned char buffer[65536];
+    unsigned char *reply;
+    struct sockaddr_storage peer;
+    socklen_t peer_size;
+    fd_set fds;
+    ssize_t length;
+    size_t reply_length;
+    unsigned short port;
+    int option, tcp, udp, fd;
+    krb5_error_code code;
+
+    message_program_name = "replay";
+    while ((option = getopt(argc, argv, "l:P:")) != EOF)
+        switch (option) {
+        case 'l':
+            log = fopen(optarg, "a");
+            if (log == NULL)
+                sysdie("cannot open %s", optarg);
+            break;
+        case 'P':
+            portfile = optarg;
+            break;
+        default:
+            die("usage: replay [-l log] [-P portfile] keytab transcript");
+        }
+    if (argc - optind != 2)
+        die("usage: replay [-l log] [-P portfile] keytab transcript");
+
+    /* Load the keys and the transcript. */
+    memset(&replay, 0, sizeof(replay));
+    code = krb5_init_context(&replay.ctx);
+    if (code != 0)
+        die_krb5(NULL, code, "cannot initialize Kerberos");
+    load_keytab(&replay, argv[optind]);
+    load_transcript(&replay, argv[optind + 1]);
+
+    /* Tell the caller which port to use. */
+    port = listen_loopback(&tcp, &udp);
+    if (portfile != NULL)
+        write_port(portfile, port);
+    else {
+        printf("%u\n", (unsigned int) port);
+        fflush(stdout);
+    }
+
+    /* Answer requests one at a time until killed. */
+    while (1) {
+        FD_ZERO(&fds);
+        FD_SET(tcp, &fds);
+        FD_SET(udp, &fds);
+        if (select((tcp > udp ? tcp : udp) + 1, &fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            sysdie("cannot wait for requests");
+        }
+        if (FD_ISSET(udp, &fds)) {
+            peer_size = sizeof(peer);
+            length = recvfrom(udp, buffer, sizeof(buffer), 0,
+                              (struct sockaddr *) &peer, &peer_size);
+            if (length > 0) {
+                reply = handle_request(&replay, log, "udp", buffer,
+                                       (size_t) length, &reply_length);
+                if (reply != NULL) {
+                    sendto(udp, reply, reply_length, 0,
+                           (struct sockaddr *) &peer, peer_size);
+                    xfree(reply);
+                }
+            }
+        }
+        if (FD_ISSET(tcp, &fds)) {
+            fd = accept(tcp, NULL, NULL);
+            if (fd >= 0) {
+                handle_tcp(&replay, log, fd);
+                close(fd);
+            }
+        }
+    }
+}
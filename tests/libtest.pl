@@ -15,6 +15,7 @@ require 5.006;
 use strict;
 
 use Test::More;
+use Time::HiRes ();
 
 # Make a call to a command with the given arguments.  Returns the standard
 # output, the standard error, and the exit status as a list.
@@ -96,6 +97,168 @@ sub klist {
     return wantarray ? ($default, $service, $flags) : $default;
 }
 
+# Write a FILE ticket cache in the version 4 format without using the
+# Kerberos libraries.  Takes the path, the default principal, and a list of
+# anonymous arrays of server principal, lifetime in seconds, and optionally
+# renewable lifetime in seconds, and stores a ticket with a random key and
+# ticket for each, marked renewable if it has a renewable lifetime.
+# Principals must include the realm.
+sub write_ccache {
+    my ($path, $client, @tickets) = @_;
+    my $data = sub { pack ('N/a*', $_[0]) };
+    my $princ = sub {
+        my ($name, $realm) = split (/\@/, $_[0]);
+        my @components = split (m%/%, $name);
+        return pack ('NN', 1, scalar (@components)) . $data->($realm)
+            . join ('', map { $data->($_) } @components);
+    };
+    my $random = sub { join ('', map { chr (int (rand (256))) } 1 .. $_[0]) };
+    my $cache = pack ('nn', 0x0504, 0) . $princ->($client);
+    my $now = time;
+    for my $ticket (@tickets) {
+        my ($server, $lifetime, $renew) = @$ticket;
+        my $flags = $renew ? 0x00C00000 : 0x00400000;
+        $cache .= $princ->($client) . $princ->($server);
+        $cache .= pack ('n', 18) . $data->($random->(32));
+        $cache .= pack ('NNNN', $now, $now, $now + $lifetime,
+                        $renew ? $now + $renew : 0);
+        $cache .= pack ('CN', 0, $flags) . pack ('NN', 0, 0);
+        $cache .= $data->($random->(64)) . $data->('');
+    }
+    open (my $fh, '>', $path) or BAIL_OUT ("cannot create $path: $!");
+    print {$fh} $cache or BAIL_OUT ("cannot write to $path: $!");
+    close ($fh) or BAIL_OUT ("cannot flush $path: $!");
+    return;
+}
+
+# Wait for a stand-in KDC to write its port to the given file, and then write
+# a krb5.conf into the given temporary directory that points the given realm
+# at that port and set KRB5_CONFIG to use it.
+sub use_local_kdc {
+    my ($tmp, $realm, $portfile) = @_;
+    my $tries = 0;
+    while (not -s $portfile and $tries < 100) {
+        select (undef, undef, undef, 0.1);
+        $tries++;
+    }
+    my $port = contents ($portfile);
+    open (CONFIG, '>', "$tmp/krb5.conf")
+        or BAIL_OUT ("cannot create $tmp/krb5.conf: $!");
+    print CONFIG "[libdefaults]\n    default_realm = $realm\n";
+    print CONFIG "    dns_lookup_kdc = false\n";
+    print CONFIG "[realms]\n    $realm = {\n";
+    print CONFIG "        kdc = 127.0.0.1:$port\n    }\n";
+    close CONFIG;
+    $ENV{KRB5_CONFIG} = "$tmp/krb5.conf";
+    return;
+}
+
+# Start tests/data/kdc-proxy forwarding to the given KDC with the given fault
+# schedule and any additional proxy options, write a krb5.conf into the given
+# temporary directory that points the given realm at it, and set KRB5_CONFIG
+# to use it.  Returns the PID of the proxy.
+sub start_proxy {
+    my ($tmp, $kdc, $realm, $schedule, @opts) = @_;
+    my $proxy = "$ENV{C_TAP_SOURCE}/data/kdc-proxy";
+    unlink ("$tmp/proxy-port", "$tmp/proxy-log");
+    my $pid = fork;
+    if (!defined $pid) {
+        BAIL_OUT ("can't fork: $!");
+    } elsif ($pid == 0) {
+        exec ($proxy, '-l', "$tmp/proxy-log", '-P', "$tmp/proxy-port",
+              '-r', $realm, '-s', $schedule, @opts, $kdc)
+            or BAIL_OUT ("can't run $proxy: $!");
+    }
+    use_local_kdc ($tmp, $realm, "$tmp/proxy-port");
+    return $pid;
+}
+
+# Stop a proxy started by start_proxy and clean up after it.  Returns the
+# requests the proxy saw as a list of anonymous arrays of protocol, action,
+# and the time in milliseconds the proxy took to reply.
+sub stop_proxy {
+    my ($tmp, $pid) = @_;
+    kill (15, $pid);
+    waitpid ($pid, 0);
+    my @requests;
+    if (open (LOG, '<', "$tmp/proxy-log")) {
+        while (<LOG>) {
+            my ($number, @request) = split;
+            push (@requests, [ @request ]);
+        }
+        close LOG;
+    }
+    unlink ("$tmp/proxy-port", "$tmp/proxy-log", "$tmp/krb5.conf");
+    delete $ENV{KRB5_CONFIG};
+    return @requests;
+}
+
+# Start tests/kdc/replay answering the given realm from a transcript recorded
+# by kdc-proxy -w, decrypting the recorded replies with the given keytab,
+# write a krb5.conf into the given temporary directory that points the realm
+# at it, and set KRB5_CONFIG to use it.  The replay logs each request to
+# replay-log in the temporary directory.  Returns the PID of the replay.
+sub start_replay {
+    my ($tmp, $realm, $keytab, $transcript) = @_;
+    my $replay = "$ENV{C_TAP_BUILD}/kdc/replay";
+    unlink ("$tmp/replay-port", "$tmp/replay-log");
+    my $pid = fork;
+    if (!defined $pid) {
+        BAIL_OUT ("can't fork: $!");
+    } elsif ($pid == 0) {
+        exec ($replay, '-l', "$tmp/replay-log", '-P', "$tmp/replay-port",
+              $keytab, $transcript)
+            or BAIL_OUT ("can't run $replay: $!");
+    }
+    use_local_kdc ($tmp, $realm, "$tmp/replay-port");
+    return $pid;
+}
+
+# Stop a replay started by start_replay and clean up after it.
+sub stop_replay {
+    my ($tmp, $pid) = @_;
+    kill (15, $pid);
+    waitpid ($pid, 0);
+    unlink ("$tmp/replay-port", "$tmp/replay-log", "$tmp/krb5.conf");
+    delete $ENV{KRB5_CONFIG};
+    return;
+}
+
+# Run a command the given number of times against a replay started by
+# start_replay, given the path to its log, and measure each run.  Returns a
+# list of anonymous arrays of the wall clock time of the run and the time the
+# replay spent building replies, both in milliseconds, and the number of KDC
+# exchanges, or undef for any run where the command failed.  Requests logged
+# before this is called are ignored.
+sub bench_command {
+    my ($log, $count, $command, @args) = @_;
+    my @results;
+    open (my $fh, '<', $log) or BAIL_OUT ("cannot open $log: $!");
+    seek ($fh, 0, 2);
+    for my $i (1 .. $count) {
+        my $start = Time::HiRes::time ();
+        my ($out, $err, $status) = command ($command, @args);
+        my $wall = (Time::HiRes::time () - $start) * 1000;
+        my ($kdc, $exchanges) = (0, 0);
+        while (defined (my $line = <$fh>)) {
+            my ($number, $protocol, $elapsed) = split (' ', $line);
+            $kdc += $elapsed;
+            $exchanges++;
+        }
+        seek ($fh, 0, 1);
+        push (@results, ($status == 0) ? [ $wall, $kdc, $exchanges ] : undef);
+    }
+    close $fh;
+    return @results;
+}
+
+# Given a list of numbers, return the median and the 90th percentile.
+sub percentiles {
+    my @values = sort { $a <=> $b } @_;
+    return (0, 0) unless @values;
+    return ($values[int (@values / 2)], $values[int (@values * 0.9)]);
+}
+
 # Run tokens and return true if we have an AFS token, false otherwise.
 sub tokens {
     my $output = `tokens 2>&1`;
@@ -0,0 +1,89 @@
+/*
+ * Test suite for the scaled clock.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/process.h>
+#include <util/clock.h>
+#include <util/macros.h>
+
+
+/*
+ * Return whether two intervals are equal, allowing for rounding.
+ */
+static bool
+same_interval(double a, double b)
+{
+    return a - b < 0.000001 && b - a < 0.000001;
+}
+
+
+/*
+ * Parse an invalid scale, which should die.
+ */
+static void
+test_invalid(void *data)
+{
+    clock_parse_scale(data);
+}
+
+
+int
+main(void)
+{
+    struct timespec delay = {0, 20 * 1000 * 1000};
+    struct timeval tv;
+    time_t now, then;
+
+    plan(13 + 2 * 3);
+
+    /* With a scale of one, this is the real-time clock. */
+    clock_init(1);
+    now = time(NULL);
+    ok(clock_now() - now <= 1, "unscaled clock is real time");
+    is_int(now, clock_from_real(now), "unscaled times are not converted");
+    ok(same_interval(clock_interval(60), 60),
+       "unscaled intervals are not converted");
+
+    /* Run the clock 1000 times faster than real time. */
+    is_int(1000, clock_parse_scale("1000"), "scale is parsed");
+    clock_init(1000);
+    now = clock_now();
+    ok(now - time(NULL) <= 1, "scaled clock starts at the current time");
+    nanosleep(&delay, NULL);
+    then = clock_now();
+    ok(then - now >= 20, "scaled clock runs faster than real time");
+    ok(then - now < 200, "but not too fast");
+    clock_timeval(&tv);
+    ok(tv.tv_sec >= then && tv.tv_usec >= 0 && tv.tv_usec < 1000000,
+       "clock_timeval agrees with clock_now");
+    ok(same_interval(clock_interval(1000), 1), "intervals are scaled");
+    ok(same_interval(clock_interval(500), 0.5),
+       "fractional intervals are scaled");
+    is_int(0, clock_from_real(0), "zero times are not converted");
+    now = time(NULL);
+    is_int(36000, clock_from_real(now + 36) - clock_from_real(now),
+           "real times are scaled");
+    then = clock_from_real(now);
+    ok(then <= clock_now() && clock_now() - then <= 2000,
+       "and agree with the scaled clock");
+
+    /* Invalid scales. */
+    is_function_output(test_invalid, (void *) "0", 1,
+                       "KSTART_CLOCK_SCALE value 0 invalid\n",
+                       "scale of zero is rejected");
+    is_function_output(test_invalid, (void *) "10x", 1,
+                       "KSTART_CLOCK_SCALE value 10x invalid\n",
+                       "non-numeric scale is rejected");
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Test suite for command handling.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <util/command.h>
+
+
+/*
+ * Wait for the given child to exit and return its exit status as adjusted by
+ * command_finish, or -1 on error.
+ */
+static int
+wait_for(pid_t child)
+{
+    struct timespec delay = {0, 10 * 1000 * 1000};
+    int result, status;
+
+    while ((result = command_finish(child, &status)) == 0)
+        nanosleep(&delay, NULL);
+    return (result < 0) ? -1 : status;
+}
+
+
+int
+main(void)
+{
+    char *argv[4];
+    sigset_t block, mask;
+    pid_t child;
+    int fd;
+
+    plan(9);
+
+    /* Basic command_spawn behavior. */
+    child = command_spawn("false");
+    ok(child > 0, "command_spawn of false");
+    is_int(1, wait_for(child), "...and exit status is 1");
+    child = command_spawn("sh -c exit");
+    ok(child > 0, "command_spawn with arguments");
+    is_int(0, wait_for(child), "...and exit status is 0");
+    errno = 0;
+    is_int(-1, command_spawn(" \t"), "command_spawn of empty command fails");
+    is_int(ENOENT, errno, "...with ENOENT");
+
+    /* The command must not inherit open file descriptors. */
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+        sysbail("cannot open /dev/null");
+    if (fd != 9) {
+        if (dup2(fd, 9) < 0)
+            sysbail("cannot dup /dev/null to descriptor 9");
+        close(fd);
+    }
+    argv[0] = (char *) "sh";
+    argv[1] = (char *) "-c";
+    argv[2] = (char *) "exec 2>/dev/null; echo >&9";
+    argv[3] = NULL;
+    child = command_start(argv[0], argv);
+    ok(child > 0 && wait_for(child) != 0, "descriptors are not inherited");
+    ok(!(fcntl(9, F_GETFD) & FD_CLOEXEC), "...and ours are left alone");
+    close(9);
+
+    /* The command must not inherit our blocked signals. */
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &mask);
+    argv[2] = (char *) "kill -TERM $$; exit 0";
+    child = command_start(argv[0], argv);
+    is_int(128 + SIGTERM, wait_for(child), "signal mask is not inherited");
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    return 0;
+}
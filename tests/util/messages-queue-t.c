@@ -0,0 +1,183 @@
+/*
+ * Test suite for the queued message handlers.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+
+/*
+ * Set up a queue of the given size with the queue handlers for notice and
+ * warn.
+ */
+static void
+setup(size_t size)
+{
+    message_queue_init(size, LOG_DAEMON);
+    message_handlers_notice(1, message_log_queue_stdout);
+    message_handlers_warn(1, message_log_queue_stderr);
+}
+
+
+/*
+ * Test functions.
+ */
+static void
+test1(void *data UNUSED)
+{
+    setup(2);
+    message_program_name = "test1";
+    notice("one");
+    warn("two");
+    notice("three");
+    printf("queued\n");
+    fflush(stdout);
+    if (message_queue_drain())
+        printf("drained, %lu dropped\n", message_queue_dropped());
+}
+
+static void
+test2(void *data UNUSED)
+{
+    setup(4);
+    errno = EPERM;
+    syswarn("permissions");
+    message_queue_flush();
+}
+
+__attribute__((__noreturn__)) static void
+test3(void *data UNUSED)
+{
+    setup(4);
+    notice("queued");
+    die("fatal");
+}
+
+static void
+test4(void *data UNUSED)
+{
+    char *message;
+
+    setup(1);
+    message = xmalloc(MESSAGE_QUEUE_LINE * 2);
+    memset(message, 'a', MESSAGE_QUEUE_LINE * 2 - 1);
+    message[MESSAGE_QUEUE_LINE * 2 - 1] = '\0';
+    notice("%s", message);
+    free(message);
+    message_queue_drain();
+}
+
+static void
+test5(void *data UNUSED)
+{
+    setup(1);
+    notice("first");
+    message_queue_drain();
+    notice("second");
+    message_queue_drain();
+    message_handlers_reset();
+    notice("third");
+}
+
+/*
+ * Flush more output than fits in a small non-blocking socket while another
+ * process reads it slowly, which forces partial writes and waiting, and
+ * report how much the reader received.
+ */
+static void
+test6(void *data UNUSED)
+{
+    struct timespec delay = {0, 200 * 1000 * 1000};
+    char message[1000];
+    char buffer[4096];
+    int fds[2];
+    int i, flags;
+    int size = 4096;
+    ssize_t status;
+    unsigned long total = 0;
+    unsigned long lines = 0;
+    pid_t child;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        sysbail("cannot create socket pair");
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    fflush(stdout);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    if (child == 0) {
+        close(fds[1]);
+        nanosleep(&delay, NULL);
+        while ((status = read(fds[0], buffer, sizeof(buffer))) > 0) {
+            total += (unsigned long) status;
+            for (i = 0; i < status; i++)
+                if (buffer[i] == '\n')
+                    lines++;
+        }
+        printf("read %lu bytes in %lu lines\n", total, lines);
+        exit(0);
+    }
+    close(fds[0]);
+    setup(100);
+    memset(message, 'a', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+    for (i = 0; i < 100; i++)
+        notice("%s", message);
+    if (dup2(fds[1], STDOUT_FILENO) < 0)
+        sysbail("cannot dup socket to standard output");
+    close(fds[1]);
+    flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags < 0 || fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK) < 0)
+        sysbail("cannot make standard output non-blocking");
+    message_queue_flush();
+    close(STDOUT_FILENO);
+    waitpid(child, NULL, 0);
+}
+
+
+int
+main(void)
+{
+    char *expected;
+
+    plan(6 * 3);
+
+    is_function_output(test1, NULL, 0,
+                       "queued\ntest1: one\ntest1: two\n"
+                       "test1: 1 log messages dropped\n"
+                       "drained, 1 dropped\n",
+                       "drain writes messages and reports drops");
+    basprintf(&expected, "permissions: %s\n", strerror(EPERM));
+    is_function_output(test2, NULL, 0, expected, "errno is included");
+    free(expected);
+    is_function_output(test3, NULL, 1, "queued\nfatal\n",
+                       "die flushes the queue");
+    expected = bcalloc(MESSAGE_QUEUE_LINE, 1);
+    memset(expected, 'a', MESSAGE_QUEUE_LINE - 2);
+    expected[MESSAGE_QUEUE_LINE - 2] = '\n';
+    is_function_output(test4, NULL, 0, expected, "long messages truncated");
+    free(expected);
+    is_function_output(test5, NULL, 0, "first\nsecond\nthird\n",
+                       "queue reused after drain and reset");
+    is_function_output(test6, NULL, 0, "read 100000 bytes in 100 lines\n",
+                       "flush waits for a full non-blocking descriptor");
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Test suite for suppression of repeated warnings.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+
+/*
+ * Wait for the start of a new second so that the elapsed times in the
+ * summaries will be 0 seconds.
+ */
+static void
+sync_second(void)
+{
+    struct timespec delay = {0, 1000 * 1000};
+    time_t start;
+
+    start = time(NULL);
+    while (time(NULL) == start)
+        nanosleep(&delay, NULL);
+}
+
+
+/*
+ * Test functions.
+ */
+static void
+test1(void *data UNUSED)
+{
+    sync_second();
+    message_limit_repeats(3600);
+    warn("cannot contact KDC");
+    warn("cannot contact KDC");
+    warn("other error");
+    warn("cannot contact KDC");
+    message_repeats_flush();
+    warn("cannot contact KDC");
+}
+
+static void
+test2(void *data UNUSED)
+{
+    sync_second();
+    message_limit_repeats(3600);
+    errno = EPERM;
+    syswarn("open failed");
+    errno = ENOENT;
+    syswarn("open failed");
+    errno = EPERM;
+    syswarn("open failed");
+    notice("notice");
+    notice("notice");
+    message_repeats_flush();
+}
+
+static void
+test3(void *data UNUSED)
+{
+    int i;
+
+    sync_second();
+    message_limit_repeats(3600);
+    warn("first");
+    warn("first");
+    for (i = 0; i < 16; i++)
+        warn("warning %d", i);
+    warn("first");
+}
+
+static void
+test4(void *data UNUSED)
+{
+    sync_second();
+    message_limit_repeats(3600);
+    warn("error");
+    message_handlers_reset();
+    warn("error");
+}
+
+
+int
+main(void)
+{
+    char *expected, *more;
+    int i;
+
+    plan(4 * 3);
+
+    is_function_output(test1, NULL, 0,
+                       "cannot contact KDC\nother error\n"
+                       "cannot contact KDC (repeated 2 times in 0 seconds)\n"
+                       "cannot contact KDC\n",
+                       "repeated warnings are counted");
+    basprintf(&expected,
+              "open failed: %s\nopen failed: %s\nnotice\nnotice\n"
+              "open failed: %s (repeated 1 times in 0 seconds)\n",
+              strerror(EPERM), strerror(ENOENT), strerror(EPERM));
+    is_function_output(test2, NULL, 0, expected, "errno is part of the key");
+    free(expected);
+    expected = bstrdup("first\n");
+    for (i = 0; i < 16; i++) {
+        if (i == 15)
+            basprintf(&more, "%sfirst (repeated 1 times in 0 seconds)\n"
+                      "warning %d\n", expected, i);
+        else
+            basprintf(&more, "%swarning %d\n", expected, i);
+        free(expected);
+        expected = more;
+    }
+    basprintf(&more, "%sfirst\n", expected);
+    free(expected);
+    is_function_output(test3, NULL, 0, more, "evicted counts are reported");
+    free(more);
+    is_function_output(test4, NULL, 0, "error\nerror\n",
+                       "reset clears the table");
+    return 0;
+}
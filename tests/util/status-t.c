@@ -0,0 +1,208 @@
+/*
+ * Test suite for status files.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/status.h>
+
+/* The number of times to read the status file while it is being updated. */
+#define CONCURRENT_READS 2000
+
+
+/*
+ * Fill in a record in which every field is derived from the given value, so
+ * that a torn read can be detected.
+ */
+static void
+fill_record(struct status_record *record, long value)
+{
+    memset(record, 0, sizeof(*record));
+    record->pid = value;
+    record->child = value;
+    record->started = value;
+    record->last_success = value;
+    record->last_failure = value;
+    record->next_wakeup = value;
+    record->latency = value;
+    record->successes = (uint64_t) value;
+    record->failures = (uint64_t) value;
+    snprintf(record->program, sizeof(record->program), "%ld",
+             value % 1000000000L);
+    snprintf(record->principal, sizeof(record->principal), "%ld", value);
+    snprintf(record->cache, sizeof(record->cache), "%ld", value);
+    snprintf(record->error, sizeof(record->error), "%ld", value);
+}
+
+
+/*
+ * Check whether a record is one that fill_record could have produced, or the
+ * empty record from before the first update.
+ */
+static bool
+record_consistent(const struct status_record *record)
+{
+    struct status_record expected;
+    size_t body = offsetof(struct status_record, pid);
+
+    if (record->pid == 0)
+        memset(&expected, 0, sizeof(expected));
+    else
+        fill_record(&expected, (long) record->pid);
+    return memcmp((const char *) &expected + body,
+                  (const char *) record + body, sizeof(expected) - body)
+           == 0;
+}
+
+
+/*
+ * Set or clear the sequence number of the status file directly, simulating a
+ * writer that died in the middle of an update.
+ */
+static void
+set_sequence(const char *path, uint32_t sequence)
+{
+    struct status_record *record;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    record = mmap(NULL, sizeof(*record), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (record == MAP_FAILED)
+        sysbail("cannot map %s", path);
+    close(fd);
+    record->sequence = sequence;
+    munmap(record, sizeof(*record));
+}
+
+
+int
+main(void)
+{
+    struct status *status;
+    struct status_record record, result;
+    struct stat st;
+    char *tmpdir, *path, *junk;
+    FILE *file;
+    pid_t writer;
+    long value;
+    int i, torn;
+
+    plan(24);
+
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/status", tmpdir);
+    basprintf(&junk, "%s/junk", tmpdir);
+
+    /* Create a status file and read the initial record. */
+    unlink(path);
+    status = status_open(path);
+    ok(status != NULL, "status_open succeeds");
+    if (status == NULL)
+        bail("cannot continue without a status file");
+    ok(stat(path, &st) == 0, "status file exists");
+    is_int(sizeof(struct status_record), st.st_size, "with the right size");
+    ok(status_read(path, &result), "status_read of a new file succeeds");
+    is_int(0, result.pid, "initial PID is zero");
+    is_string("", result.principal, "initial principal is empty");
+
+    /* Publish a record and read it back. */
+    memset(&record, 0, sizeof(record));
+    record.pid = 1234;
+    record.child = 5678;
+    record.last_success = 1000000;
+    record.latency = 2500;
+    record.successes = 3;
+    strcpy(record.program, "krenew");
+    strcpy(record.principal, "test@EXAMPLE.ORG");
+    strcpy(record.cache, "/tmp/krb5cc_test");
+    ok(status_read(path, &result) && result.pid == 0,
+       "nothing changes until publish");
+    status_publish(status, &record);
+    ok(status_read(path, &result), "status_read after publish succeeds");
+    is_int(1234, result.pid, "PID");
+    is_int(5678, result.child, "child PID");
+    is_int(1000000, result.last_success, "last success");
+    is_int(2500, result.latency, "latency");
+    is_int(3, (long) result.successes, "successes");
+    is_string("krenew", result.program, "program");
+    is_string("test@EXAMPLE.ORG", result.principal, "principal");
+    is_string("/tmp/krb5cc_test", result.cache, "cache");
+
+    /* A writer that dies in the middle of an update. */
+    set_sequence(path, 7);
+    ok(!status_read(path, &result) && errno == EAGAIN,
+       "abandoned update is reported");
+
+    /* Errors reading files that aren't status files. */
+    ok(!status_read(junk, &result) && errno == ENOENT,
+       "missing file is reported");
+    file = fopen(junk, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", junk);
+    fputs("not a status file\n", file);
+    fclose(file);
+    ok(!status_read(junk, &result) && errno == EINVAL,
+       "short file is rejected");
+    if (truncate(junk, sizeof(struct status_record)) < 0)
+        sysbail("cannot extend %s", junk);
+    ok(!status_read(junk, &result) && errno == EINVAL,
+       "file without the magic number is rejected");
+    unlink(junk);
+
+    /* Reopening completes the abandoned update and starts over. */
+    status_close(status, false);
+    status = status_open(path);
+    ok(status != NULL && status_read(path, &result) && result.pid == 0,
+       "reopening resets an abandoned file");
+
+    /*
+     * Read the file while another process updates it as fast as it can, and
+     * check that no read sees a mix of two updates.
+     */
+    fflush(stdout);
+    writer = fork();
+    if (writer < 0)
+        sysbail("cannot fork");
+    else if (writer == 0) {
+        alarm(30);
+        for (value = 1;; value++) {
+            fill_record(&record, value);
+            status_publish(status, &record);
+        }
+    }
+    torn = 0;
+    for (i = 0; i < CONCURRENT_READS; i++)
+        if (!status_read(path, &result) || !record_consistent(&result))
+            torn++;
+    kill(writer, SIGTERM);
+    waitpid(writer, NULL, 0);
+    is_int(0, torn, "no torn reads during concurrent updates");
+    ok(result.pid > 0, "and the updates were seen");
+
+    /* Closing with removal removes the file. */
+    status_close(status, true);
+    ok(access(path, F_OK) < 0, "status_close removes the file");
+
+    /* Clean up. */
+    free(path);
+    free(junk);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
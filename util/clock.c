@@ -0,0 +1,142 @@
+/*
+ * Clock for k5start and krenew.
+ *
+ * All time reads and waits in the daemon loop go through these functions so
+ * that the test suite can run the clock faster than real time.  The scaled
+ * clock is an affine transformation of the real-time clock anchored at the
+ * time clock_init was called: a second of real time is scale seconds of our
+ * time.  Since it's anchored on the real-time clock rather than advanced
+ * explicitly, it needs no cooperation from whatever the daemon is waiting on
+ * and a suspend or clock change still behaves as it would unscaled.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+
+#include <util/clock.h>
+#include <util/messages.h>
+
+/* The factor by which our clock runs faster than real time. */
+static long clock_scale = 1;
+
+/* The real time at which the scaled clock was started. */
+static struct timeval clock_base;
+
+
+/*
+ * Initialize the clock with the given scale.
+ */
+void
+clock_init(long scale)
+{
+    clock_scale = (scale > 1) ? scale : 1;
+    if (clock_scale > 1)
+        gettimeofday(&clock_base, NULL);
+}
+
+
+/*
+ * Parse a clock scale, dying if it is not a positive number.
+ */
+long
+clock_parse_scale(const char *value)
+{
+    char *end;
+    long scale;
+
+    errno = 0;
+    scale = strtol(value, &end, 10);
+    if (errno != 0 || *value == '\0' || *end != '\0' || scale < 1)
+        die("KSTART_CLOCK_SCALE value %s invalid", value);
+    return scale;
+}
+
+
+/*
+ * Given an offset in microseconds on the real-time clock from the start of
+ * the scaled clock, store the corresponding time on our clock.  The offset is
+ * scaled in integer microseconds to avoid losing precision for large scale
+ * factors, and may be negative for times before the clock was started.
+ */
+static void
+clock_scale_offset(long long offset, struct timeval *tv)
+{
+    long long usec;
+
+    usec = offset * clock_scale + clock_base.tv_usec;
+    tv->tv_sec = clock_base.tv_sec + (time_t) (usec / 1000000LL);
+    tv->tv_usec = (suseconds_t) (usec % 1000000LL);
+    if (tv->tv_usec < 0) {
+        tv->tv_sec--;
+        tv->tv_usec += 1000000;
+    }
+}
+
+
+/*
+ * Return the current time on our clock with microseconds.
+ */
+void
+clock_timeval(struct timeval *tv)
+{
+    struct timeval now;
+    long long offset;
+
+    gettimeofday(&now, NULL);
+    if (clock_scale == 1) {
+        *tv = now;
+        return;
+    }
+    offset = (long long) (now.tv_sec - clock_base.tv_sec) * 1000000LL
+             + (now.tv_usec - clock_base.tv_usec);
+    clock_scale_offset(offset, tv);
+}
+
+
+/*
+ * Return the current time on our clock.
+ */
+time_t
+clock_now(void)
+{
+    struct timeval now;
+
+    if (clock_scale == 1)
+        return time(NULL);
+    clock_timeval(&now);
+    return now.tv_sec;
+}
+
+
+/*
+ * Convert a real-time timestamp to our clock.
+ */
+time_t
+clock_from_real(time_t when)
+{
+    struct timeval tv;
+    long long offset;
+
+    if (clock_scale == 1 || when == 0)
+        return when;
+    offset = (long long) (when - clock_base.tv_sec) * 1000000LL
+             - clock_base.tv_usec;
+    clock_scale_offset(offset, &tv);
+    return tv.tv_sec;
+}
+
+
+/*
+ * Convert an interval on our clock to real time.
+ */
+double
+clock_interval(double interval)
+{
+    return interval / (double) clock_scale;
+}
@@ -0,0 +1,61 @@
+/*
+ * Prototypes for the clock used by k5start and krenew.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef UTIL_CLOCK_H
+#define UTIL_CLOCK_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+#include <sys/time.h>
+#include <time.h>
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Initialize the clock.  With a scale of one, the clock is the system
+ * real-time clock.  With a larger scale, the clock instead runs that many
+ * times faster than real time, starting from the time at which clock_init
+ * was called.  Ticket times from the KDC and intervals spent waiting are
+ * scaled to match, so a daemon run against a KDC issuing correspondingly
+ * short tickets behaves as it would over a much longer period.  Calling it
+ * again restarts the scaled clock.
+ */
+void clock_init(long scale);
+
+/*
+ * Parse a clock scale from a string, such as the KSTART_CLOCK_SCALE
+ * environment variable used by the test suite, and die if it is invalid.
+ */
+long clock_parse_scale(const char *) __attribute__((__nonnull__));
+
+/* Return the current time, or the current time with microseconds. */
+time_t clock_now(void);
+void clock_timeval(struct timeval *);
+
+/*
+ * Convert a timestamp from the real-time clock, such as a ticket expiration
+ * time from the KDC, to our clock.  Zero is returned unchanged.
+ */
+time_t clock_from_real(time_t);
+
+/*
+ * Convert an interval in seconds on our clock to the corresponding interval
+ * of real time, such as for a timeout or a requested ticket lifetime.
+ */
+double clock_interval(double);
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_CLOCK_H */
@@ -14,34 +14,182 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <dirent.h>
+#include <errno.h>
 #include <signal.h>
+#ifdef HAVE_SPAWN_H
+#    include <spawn.h>
+#endif
 #include <sys/wait.h>
 
 #include <util/command.h>
 #include <util/macros.h>
 #include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * Use posix_spawnp only if it can be asked to close the descriptors we don't
+ * want the child to inherit.  Otherwise, fork and close them in the child,
+ * which leaves our own descriptors alone.
+ */
+#if defined(HAVE_POSIX_SPAWNP) \
+    && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#    define USE_POSIX_SPAWN 1
+#endif
+
+/* Used by posix_spawnp to find the environment to pass to the child. */
+#if defined(USE_POSIX_SPAWN) && !HAVE_DECL_ENVIRON
+extern char **environ;
+#endif
 
 /* Global so that it can be used in signal handlers. */
 static pid_t global_child_pid;
 
+/* The last signal propagated to the child, or 0 if none. */
+static volatile sig_atomic_t global_signal = 0;
+
+
+/*
+ * Close all file descriptors other than standard input, output, and error.
+ * Used in the child process before running a command so that the command
+ * doesn't inherit our ticket cache, keytab, or other descriptors.  Only
+ * needed if we have to fork and exec.  Prefer a single system call and
+ * otherwise close only the descriptors listed in /proc/self/fd, so that the
+ * cost doesn't depend on the descriptor limit, falling back on trying every
+ * descriptor up to that limit.
+ */
+#ifndef USE_POSIX_SPAWN
+static void
+close_descriptors(void)
+{
+#    ifndef HAVE_CLOSEFROM
+    DIR *dir;
+    struct dirent *entry;
+    long max, fd;
+#    endif
+
+#    ifdef HAVE_CLOSE_RANGE
+    if (close_range(3, ~0U, 0) == 0)
+        return;
+#    endif
+#    ifdef HAVE_CLOSEFROM
+    closefrom(3);
+#    else
+    dir = opendir("/proc/self/fd");
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+                continue;
+            fd = strtol(entry->d_name, NULL, 10);
+            if (fd > 2 && fd != dirfd(dir))
+                close((int) fd);
+        }
+        closedir(dir);
+        return;
+    }
+    max = sysconf(_SC_OPEN_MAX);
+    if (max < 0)
+        max = 1024;
+    for (fd = 3; fd < max; fd++)
+        close((int) fd);
+#    endif
+}
+#endif
+
 
 /*
- * Run the given aklog command, returning its exit status.  The command must
- * be a fully-qualified path.
+ * Run the given program with the given argument vector (which includes
+ * argv[0]) without waiting for it, returning its PID or -1 on failure.  The
+ * program will be searched for on the path if not fully-qualified.
+ *
+ * The child is started with an empty signal mask, since the caller may have
+ * signals blocked, and with all file descriptors other than standard input,
+ * output, and error closed.  If posix_spawnp can close those descriptors, use
+ * it, which avoids copying the page tables of the parent process, and
+ * otherwise fork, close them in the child, and exec.
  */
-void
-command_run(const char *aklog, bool verbose)
+static pid_t
+spawn(const char *program, char **argv)
 {
+    sigset_t empty;
+    pid_t child;
+#ifdef USE_POSIX_SPAWN
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
     int status;
+#endif
+
+    sigemptyset(&empty);
+#ifdef USE_POSIX_SPAWN
+    status = posix_spawn_file_actions_init(&actions);
+    if (status != 0) {
+        errno = status;
+        return -1;
+    }
+    status = posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+    if (status == 0)
+        status = posix_spawnattr_init(&attr);
+    if (status == 0) {
+        status = posix_spawnattr_setsigmask(&attr, &empty);
+        if (status == 0)
+            status = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        if (status == 0)
+            status = posix_spawnp(&child, program, &actions, &attr, argv,
+                                  environ);
+        posix_spawnattr_destroy(&attr);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (status != 0) {
+        errno = status;
+        child = -1;
+    }
+#else
+    child = fork();
+    if (child == 0) {
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        close_descriptors();
+        execvp(program, argv);
+        _exit(127);
+    }
+#endif
+    return child;
+}
+
+
+/*
+ * Start the given aklog command without waiting for it, returning its PID or
+ * -1 on failure.  The command is split on whitespace into the program and its
+ * arguments and is run directly, not via the shell, so shell metacharacters
+ * have no special meaning.  Use command_finish to reap it.
+ */
+pid_t
+command_spawn(const char *aklog)
+{
+    char *copy, *word;
+    char **argv;
+    size_t count = 0;
+    pid_t child;
+    int oerrno;
+
+    /* Split the command into words. */
+    copy = xstrdup(aklog);
+    argv = xcalloc(strlen(aklog) / 2 + 2, sizeof(char *));
+    for (word = strtok(copy, " \t"); word != NULL; word = strtok(NULL, " \t"))
+        argv[count++] = word;
+    if (count == 0) {
+        xfree(argv);
+        xfree(copy);
+        errno = ENOENT;
+        return -1;
+    }
 
-    /*
-     * IRIX 6.5's WEXITSTATUS() macro is broken and can't cope with being
-     * called directly on the return value of system().
-     */
-    status = system(aklog);
-    status = WEXITSTATUS(status);
-    if (verbose)
-        notice("%s exited with status %d\n", aklog, status);
+    /* Start the child. */
+    child = spawn(argv[0], argv);
+    oerrno = errno;
+    xfree(argv);
+    xfree(copy);
+    errno = oerrno;
+    return child;
 }
 
 
@@ -64,6 +212,7 @@ child_handler(int sig UNUSED)
 static void
 propagate_handler(int sig)
 {
+    global_signal = sig;
     kill(global_child_pid, sig);
 }
 
@@ -71,7 +220,9 @@ propagate_handler(int sig)
 /*
  * Start a command, returning its PID.  Takes the command to run, which will
  * be searched for on the path if not fully-qualified, and then the arguments
- * to pass to it.  If execution fails for some reason, returns -1.
+ * to pass to it.  If execution fails for some reason, returns -1.  The
+ * command is started as described for spawn, so it doesn't inherit our
+ * signal mask or file descriptors.
  *
  * This function should only be called once before a call to finish_command;
  * otherwise, the signal handler code won't work properly.
@@ -102,16 +253,23 @@ command_start(const char *command, char **argv)
     if (sigaction(SIGTERM, &sa, NULL) < 0)
         return -1;
 
-    child = fork();
+    child = spawn(command, argv);
     if (child < 0)
         return -1;
-    else if (child == 0) {
-        execvp(command, argv);
-        return -1;
-    } else {
-        global_child_pid = child;
-        return child;
-    }
+    global_child_pid = child;
+    global_signal = 0;
+    return child;
+}
+
+
+/*
+ * Return the last signal propagated to the child started by command_start, or
+ * 0 if no signal has been propagated to it.
+ */
+int
+command_signal(void)
+{
+    return global_signal;
 }
 
 
@@ -27,7 +27,7 @@ BEGIN_DECLS
  * Run the given aklog command.  If verbose is true, print some more output to
  * standard output about the exit status.
  */
-void command_run(const char *aklog, bool verbose);
+pid_t command_spawn(const char *aklog);
 
 /*
  * Start a command, executing the given command with the given argument vector
@@ -44,6 +44,13 @@ pid_t command_start(const char *command, char **argv);
  */
 int command_finish(pid_t child, int *status);
 
+/*
+ * Return the last signal propagated to the command started by command_start,
+ * or 0 if none has been.  Used to tell whether the command exited because we
+ * were asked to stop it.
+ */
+int command_signal(void);
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 
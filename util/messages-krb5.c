@@ -83,7 +83,7 @@ warn_krb5(krb5_context ctx, krb5_error_code code, const char *format, ...)
         warn("%s", message);
     else
         warn("%s: %s", message, k5_msg);
-    free(message);
+    xfree(message);
     if (k5_msg != NULL)
         krb5_free_error_message(ctx, k5_msg);
 }
@@ -82,9 +82,16 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#ifndef _WIN32
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <sys/socket.h>
+#    include <sys/un.h>
+#endif
 #ifdef HAVE_SYSLOG_H
 #    include <syslog.h>
 #endif
+#include <time.h>
 
 #ifdef _WIN32
 #    include <windows.h>
@@ -116,6 +123,64 @@ int (*message_fatal_cleanup)(void) = NULL;
 /* If non-NULL, prepended (followed by ": ") to messages. */
 const char *message_program_name = NULL;
 
+/*
+ * Repeated warnings.  If interval is not 0, a warning identical to one in
+ * this table that was last reported less than interval seconds ago is not
+ * reported but counted, and the count is reported with the next copy of the
+ * warning after the interval has passed.  The table is small and the least
+ * recently reported entry is replaced when it is full.
+ */
+#define MESSAGE_REPEAT_SLOTS 16
+static time_t message_repeat_interval = 0;
+static struct message_repeat {
+    char *text;          /* The warning, including any errno message. */
+    time_t start;        /* When it was last reported. */
+    unsigned long count; /* How many times it was suppressed since then. */
+} message_repeats[MESSAGE_REPEAT_SLOTS];
+
+/* The path to the syslog socket, if the system headers don't tell us. */
+#ifndef _PATH_LOG
+#    define _PATH_LOG "/dev/log"
+#endif
+
+/*
+ * Where a queued message should go.  Syslog messages store their priority
+ * separately.
+ */
+enum message_queue_dest
+{
+    QUEUE_STDOUT,
+    QUEUE_STDERR,
+    QUEUE_SYSLOG
+};
+
+/* A queued message, formatted and ready to be written. */
+struct message_entry {
+    enum message_queue_dest dest;
+    int priority;
+    size_t length;
+    size_t written; /* Bytes already written to standard output or error. */
+    char text[MESSAGE_QUEUE_LINE];
+};
+
+/*
+ * The queue of messages for the message_log_queue_* handlers.  This is a ring
+ * buffer of size entries allocated by message_queue_init, holding count
+ * messages starting at head.  Messages that arrive while it is full are
+ * dropped and counted.  syslog_fd is our own non-blocking connection to the
+ * syslog socket, or -1 if we don't have one and have to call syslog.
+ */
+static struct {
+    struct message_entry *entries;
+    size_t size;
+    size_t head;
+    size_t count;
+    unsigned long dropped;
+    unsigned long reported;
+    int facility;
+    int syslog_fd;
+} message_queue = {NULL, 0, 0, 0, 0, 0, 0, -1};
+
 
 /*
  * Set the handlers for a particular message function.  Takes a pointer to the
@@ -127,7 +192,7 @@ message_handlers(message_handler_func **list, unsigned int count, va_list args)
     unsigned int i;
 
     if (*list != stdout_handlers && *list != stderr_handlers)
-        free(*list);
+        xfree(*list);
     *list = xcalloc(count + 1, sizeof(message_handler_func));
     for (i = 0; i < count; i++)
         (*list)[i] = (message_handler_func) va_arg(args, message_handler_func);
@@ -166,20 +231,29 @@ HANDLER_FUNCTION(die)
 void
 message_handlers_reset(void)
 {
-    free(debug_handlers);
+    size_t i;
+
+    xfree(debug_handlers);
     debug_handlers = NULL;
     if (notice_handlers != stdout_handlers) {
-        free(notice_handlers);
+        xfree(notice_handlers);
         notice_handlers = stdout_handlers;
     }
     if (warn_handlers != stderr_handlers) {
-        free(warn_handlers);
+        xfree(warn_handlers);
         warn_handlers = stderr_handlers;
     }
     if (die_handlers != stderr_handlers) {
-        free(die_handlers);
+        xfree(die_handlers);
         die_handlers = stderr_handlers;
     }
+    message_queue_free();
+    message_repeat_interval = 0;
+    for (i = 0; i < MESSAGE_REPEAT_SLOTS; i++) {
+        xfree(message_repeats[i].text);
+        message_repeats[i].text = NULL;
+        message_repeats[i].count = 0;
+    }
 }
 
 
@@ -282,6 +356,515 @@ SYSLOG_FUNCTION(crit,    CRIT)
 /* clang-format on */
 
 
+/*
+ * Open our own non-blocking connection to the syslog socket.  If this fails,
+ * queued syslog messages are written with syslog instead, which may block.
+ */
+static void
+message_queue_connect(void)
+{
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    int fd, flags;
+
+    if (message_queue.syslog_fd >= 0)
+        close(message_queue.syslog_fd);
+    message_queue.syslog_fd = -1;
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", _PATH_LOG);
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0
+        || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0
+        || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return;
+    }
+    message_queue.syslog_fd = fd;
+#endif
+}
+
+
+/*
+ * Set up the queue used by the message_log_queue_* handlers, which will hold
+ * up to count messages.  facility is the syslog facility used for queued
+ * syslog messages.  Calling this again discards any queued messages.
+ */
+void
+message_queue_init(size_t count, int facility)
+{
+    message_queue_free();
+
+    /*
+     * Queued messages bypass stdio, so write out anything stdio has buffered
+     * now.  After this point, standard output is only written through the
+     * queue, so we never need to flush stdio again, which could block.
+     */
+    fflush(stdout);
+    message_queue.entries = xcalloc(count, sizeof(struct message_entry));
+    message_queue.size = count;
+    message_queue.facility = facility;
+    message_queue_connect();
+}
+
+
+/*
+ * Free the queue and close our syslog connection, discarding any queued
+ * messages.
+ */
+void
+message_queue_free(void)
+{
+    xfree(message_queue.entries);
+    message_queue.entries = NULL;
+    message_queue.size = 0;
+    message_queue.head = 0;
+    message_queue.count = 0;
+    message_queue.dropped = 0;
+    message_queue.reported = 0;
+    if (message_queue.syslog_fd >= 0)
+        close(message_queue.syslog_fd);
+    message_queue.syslog_fd = -1;
+}
+
+
+/*
+ * Return the number of messages dropped because the queue was full.
+ */
+unsigned long
+message_queue_dropped(void)
+{
+    return message_queue.dropped;
+}
+
+
+/*
+ * Given the return value of snprintf and the size of the buffer it was given,
+ * return the number of characters actually written, not counting the nul.
+ */
+static size_t
+message_queue_clamp(int status, size_t size)
+{
+    if (status < 0 || size == 0)
+        return 0;
+    return ((size_t) status < size) ? (size_t) status : size - 1;
+}
+
+
+/*
+ * Add a message to the queue, formatting it as the non-queued handlers do.
+ * This never blocks.  If the queue is full or hasn't been set up, the message
+ * is dropped and counted.  Messages too long for a queue entry are truncated.
+ */
+static void __attribute__((__format__(printf, 3, 0)))
+message_queue_add(enum message_queue_dest dest, int priority, const char *fmt,
+                  va_list args, int err)
+{
+    struct message_entry *entry;
+    size_t length = 0;
+    size_t max = MESSAGE_QUEUE_LINE - 1;
+
+    if (message_queue.count >= message_queue.size) {
+        message_queue.dropped++;
+        return;
+    }
+    entry = &message_queue.entries[(message_queue.head + message_queue.count)
+                                   % message_queue.size];
+    if (dest != QUEUE_SYSLOG && message_program_name != NULL)
+        length = message_queue_clamp(
+            snprintf(entry->text, max, "%s: ", message_program_name), max);
+    length += message_queue_clamp(
+        vsnprintf(entry->text + length, max - length, fmt, args),
+        max - length);
+    if (err != 0)
+        length += message_queue_clamp(snprintf(entry->text + length,
+                                               max - length, ": %s",
+                                               strerror(err)),
+                                      max - length);
+    if (dest != QUEUE_SYSLOG)
+        entry->text[length++] = '\n';
+    entry->text[length] = '\0';
+    entry->length = length;
+    entry->written = 0;
+    entry->dest = dest;
+    entry->priority = priority;
+    message_queue.count++;
+}
+
+
+/*
+ * Queue handlers corresponding to message_log_stdout, message_log_stderr,
+ * and the message_log_syslog_* handlers.
+ */
+void
+message_log_queue_stdout(size_t len UNUSED, const char *fmt, va_list args,
+                         int err)
+{
+    message_queue_add(QUEUE_STDOUT, 0, fmt, args, err);
+}
+
+void
+message_log_queue_stderr(size_t len UNUSED, const char *fmt, va_list args,
+                         int err)
+{
+    message_queue_add(QUEUE_STDERR, 0, fmt, args, err);
+}
+
+/* clang-format off */
+#define QUEUE_FUNCTION(name, type)                                          \
+    void                                                                    \
+    message_log_queue_syslog_ ## name(size_t l UNUSED, const char *f,       \
+                                      va_list a, int e)                     \
+    {                                                                       \
+        message_queue_add(QUEUE_SYSLOG, LOG_ ## type, f, a, e);             \
+    }
+QUEUE_FUNCTION(notice,  NOTICE)
+QUEUE_FUNCTION(warning, WARNING)
+QUEUE_FUNCTION(err,     ERR)
+/* clang-format on */
+
+
+/*
+ * Wait until a descriptor can be written to, returning the poll events.  If
+ * block is false, only check whether it can be written to now.  Returns 0 if
+ * it can't or if poll fails.
+ */
+#ifndef _WIN32
+static short
+message_queue_poll(int fd, bool block)
+{
+    struct pollfd pfd;
+    int status;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    do {
+        status = poll(&pfd, 1, block ? -1 : 0);
+    } while (status < 0 && errno == EINTR);
+    return (status > 0) ? pfd.revents : 0;
+}
+#endif
+
+
+/*
+ * Write a single queued message.  If block is false, only write it if that
+ * can be done without blocking.  If block is true, wait until each message can
+ * be written, even if the descriptor is non-blocking.  Returns true if the
+ * message was written (or discarded after an error) and false if it should be
+ * retried later.
+ */
+static bool
+message_queue_write(struct message_entry *entry, bool block)
+{
+#ifdef _WIN32
+    if (entry->dest == QUEUE_SYSLOG)
+        return true;
+    fputs(entry->text, entry->dest == QUEUE_STDOUT ? stdout : stderr);
+    return true;
+#else
+    char header[64];
+    char buffer[sizeof(header) + MESSAGE_QUEUE_LINE];
+    struct tm tm;
+    time_t now;
+    ssize_t status;
+    short events;
+    int fd, length;
+
+    /* Syslog messages are sent to our own socket if we have one. */
+    if (entry->dest == QUEUE_SYSLOG) {
+        if (message_queue.syslog_fd < 0) {
+            syslog(entry->priority, "%s", entry->text);
+            return true;
+        }
+        now = time(NULL);
+        if (localtime_r(&now, &tm) == NULL
+            || strftime(header, sizeof(header), "%b %e %H:%M:%S", &tm) == 0)
+            header[0] = '\0';
+        length = snprintf(buffer, sizeof(buffer), "<%d>%s %s[%lu]: %s",
+                          message_queue.facility | entry->priority, header,
+                          message_program_name != NULL ? message_program_name
+                                                       : "",
+                          (unsigned long) getpid(), entry->text);
+        if (length < 0)
+            return true;
+        if ((size_t) length >= sizeof(buffer))
+            length = (int) sizeof(buffer) - 1;
+
+        /*
+         * The socket is non-blocking, so if we're allowed to block, wait for
+         * it to have room.  ENOBUFS doesn't wake poll, so sleep briefly.
+         */
+        while (1) {
+            status = send(message_queue.syslog_fd, buffer, (size_t) length,
+                          MSG_DONTWAIT);
+            if (status >= 0)
+                return true;
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                if (!block)
+                    return false;
+                poll(NULL, 0, 10);
+                continue;
+            }
+#    if EAGAIN != EWOULDBLOCK
+            if (errno == EWOULDBLOCK)
+                errno = EAGAIN;
+#    endif
+            if (errno != EAGAIN)
+                break;
+            if (!block)
+                return false;
+            message_queue_poll(message_queue.syslog_fd, true);
+        }
+
+        /* The syslog daemon may have restarted.  Reconnect and retry once. */
+        message_queue_connect();
+        if (message_queue.syslog_fd >= 0)
+            send(message_queue.syslog_fd, buffer, (size_t) length,
+                 MSG_DONTWAIT);
+        else
+            syslog(entry->priority, "%s", entry->text);
+        return true;
+    }
+
+    /*
+     * Write to standard output or error directly, bypassing stdio.  If block
+     * is false, only write if the descriptor is ready, and otherwise keep
+     * track of partial writes so that the rest of the message is written
+     * next time.  Give up on the message if the descriptor has an error.
+     */
+    fd = (entry->dest == QUEUE_STDOUT) ? STDOUT_FILENO : STDERR_FILENO;
+    while (entry->written < entry->length) {
+        if (!block) {
+            events = message_queue_poll(fd, false);
+            if ((events & POLLOUT) == 0)
+                return (events & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        }
+        status = write(fd, entry->text + entry->written,
+                       entry->length - entry->written);
+        if (status > 0) {
+            entry->written += (size_t) status;
+            continue;
+        }
+        if (status < 0 && errno == EINTR)
+            continue;
+#    if EAGAIN != EWOULDBLOCK
+        if (status < 0 && errno == EWOULDBLOCK)
+            errno = EAGAIN;
+#    endif
+        if (status < 0 && errno == EAGAIN) {
+            if (!block)
+                return false;
+            if (message_queue_poll(fd, true) == 0)
+                return true;
+            continue;
+        }
+        return true;
+    }
+    return true;
+#endif
+}
+
+
+/*
+ * Write queued messages.  If block is false, stop at the first message that
+ * can't be written without blocking.  After the queue has been emptied,
+ * report any newly dropped messages to standard error, also without blocking
+ * if block is false.  Returns true if the queue is now empty.
+ */
+static bool
+message_queue_write_all(bool block)
+{
+    struct message_entry *entry;
+    struct message_entry notice;
+    unsigned long dropped;
+    int length;
+
+    while (message_queue.count > 0) {
+        entry = &message_queue.entries[message_queue.head];
+        if (!message_queue_write(entry, block))
+            return false;
+        message_queue.head = (message_queue.head + 1) % message_queue.size;
+        message_queue.count--;
+    }
+    if (message_queue.dropped > message_queue.reported) {
+        dropped = message_queue.dropped - message_queue.reported;
+        memset(&notice, 0, sizeof(notice));
+        notice.dest = QUEUE_STDERR;
+        length = snprintf(notice.text, sizeof(notice.text),
+                          "%s%s%lu log messages dropped\n",
+                          message_program_name != NULL ? message_program_name
+                                                       : "",
+                          message_program_name != NULL ? ": " : "", dropped);
+        notice.length = message_queue_clamp(length, sizeof(notice.text));
+        if (!message_queue_write(&notice, block))
+            return false;
+        message_queue.reported = message_queue.dropped;
+    }
+    return true;
+}
+
+
+/*
+ * Write as many queued messages as possible without blocking.  This is meant
+ * to be called from a program's main loop.  Returns true if the queue is now
+ * empty and false if messages remain that should be retried later.
+ */
+bool
+message_queue_drain(void)
+{
+    return message_queue_write_all(false);
+}
+
+
+/*
+ * Write all queued messages, blocking if necessary.  Used before exiting so
+ * that no messages are lost.
+ */
+void
+message_queue_flush(void)
+{
+    message_queue_write_all(true);
+}
+
+
+/*
+ * Send a summary of a repeated warning to the warn handlers.  Takes a format
+ * and arguments like warn, but doesn't check for repeats.
+ */
+static void __attribute__((__format__(printf, 1, 2)))
+message_repeat_report(const char *format, ...)
+{
+    va_list args;
+    message_handler_func *log;
+    ssize_t length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    for (log = warn_handlers; *log != NULL; log++) {
+        va_start(args, format);
+        (**log)((size_t) length, format, args, 0);
+        va_end(args);
+    }
+}
+
+
+/*
+ * Set the interval in seconds during which identical warnings are suppressed
+ * and counted rather than reported.  0, the default, disables this.
+ */
+void
+message_limit_repeats(time_t interval)
+{
+    message_repeat_interval = interval;
+}
+
+
+/*
+ * Report the count of any suppressed warnings and clear the table of recent
+ * warnings.  Should be called before exiting so that counts aren't lost.
+ */
+void
+message_repeats_flush(void)
+{
+    struct message_repeat *repeat;
+    size_t i;
+
+    for (i = 0; i < MESSAGE_REPEAT_SLOTS; i++) {
+        repeat = &message_repeats[i];
+        if (repeat->text == NULL)
+            continue;
+        if (repeat->count > 0)
+            message_repeat_report(
+                "%s (repeated %lu times in %lu seconds)", repeat->text,
+                repeat->count, (unsigned long) (time(NULL) - repeat->start));
+        xfree(repeat->text);
+        repeat->text = NULL;
+        repeat->count = 0;
+    }
+}
+
+
+/*
+ * Check whether a warning is a repeat that should be suppressed.  Takes the
+ * format, arguments, and errno value of the warning.  Returns true if the
+ * warning should not be reported, either because it is being counted or
+ * because a summary including it was reported instead.
+ */
+static bool __attribute__((__format__(printf, 1, 0)))
+message_repeated(const char *format, va_list args, int err)
+{
+    struct message_repeat *repeat = NULL;
+    char *text, *full;
+    time_t now;
+    size_t i;
+
+    if (message_repeat_interval <= 0)
+        return false;
+    xvasprintf(&text, format, args);
+    if (err != 0) {
+        xasprintf(&full, "%s: %s", text, strerror(err));
+        xfree(text);
+        text = full;
+    }
+    now = time(NULL);
+
+    /* If this is a recent warning, count it or report it with its count. */
+    for (i = 0; i < MESSAGE_REPEAT_SLOTS; i++)
+        if (message_repeats[i].text != NULL
+            && strcmp(message_repeats[i].text, text) == 0) {
+            repeat = &message_repeats[i];
+            break;
+        }
+    if (repeat != NULL) {
+        if (now - repeat->start < message_repeat_interval
+            && now >= repeat->start) {
+            repeat->count++;
+            xfree(text);
+            return true;
+        }
+        if (repeat->count > 0)
+            message_repeat_report("%s (repeated %lu times in %lu seconds)",
+                                  text, repeat->count + 1,
+                                  (unsigned long) (now - repeat->start));
+        repeat->start = now;
+        xfree(text);
+        if (repeat->count == 0)
+            return false;
+        repeat->count = 0;
+        return true;
+    }
+
+    /* A new warning.  Replace the least recently reported entry. */
+    repeat = &message_repeats[0];
+    for (i = 0; i < MESSAGE_REPEAT_SLOTS; i++) {
+        if (message_repeats[i].text == NULL) {
+            repeat = &message_repeats[i];
+            break;
+        }
+        if (message_repeats[i].start < repeat->start)
+            repeat = &message_repeats[i];
+    }
+    if (repeat->text != NULL && repeat->count > 0)
+        message_repeat_report("%s (repeated %lu times in %lu seconds)",
+                              repeat->text, repeat->count,
+                              (unsigned long) (now - repeat->start));
+    xfree(repeat->text);
+    repeat->text = text;
+    repeat->start = now;
+    repeat->count = 0;
+    return false;
+}
+
+
 /*
  * All of the message handlers.  There's a lot of code duplication here too,
  * but each one is still *slightly* different and va_start has to be called
@@ -354,12 +937,20 @@ warn(const char *format, ...)
     va_list args;
     message_handler_func *log;
     ssize_t length;
+    bool repeated;
 
     va_start(args, format);
     length = vsnprintf(NULL, 0, format, args);
     va_end(args);
     if (length < 0)
         return;
+    if (message_repeat_interval > 0) {
+        va_start(args, format);
+        repeated = message_repeated(format, args, 0);
+        va_end(args);
+        if (repeated)
+            return;
+    }
     for (log = warn_handlers; *log != NULL; log++) {
         va_start(args, format);
         (**log)((size_t) length, format, args, 0);
@@ -373,6 +964,7 @@ syswarn(const char *format, ...)
     va_list args;
     message_handler_func *log;
     ssize_t length;
+    bool repeated;
     int error = errno;
 
     va_start(args, format);
@@ -380,6 +972,13 @@ syswarn(const char *format, ...)
     va_end(args);
     if (length < 0)
         return;
+    if (message_repeat_interval > 0) {
+        va_start(args, format);
+        repeated = message_repeated(format, args, error);
+        va_end(args);
+        if (repeated)
+            return;
+    }
     for (log = warn_handlers; *log != NULL; log++) {
         va_start(args, format);
         (**log)((size_t) length, format, args, error);
@@ -394,6 +993,10 @@ die(const char *format, ...)
     message_handler_func *log;
     ssize_t length;
 
+    /* Write any queued messages first so that they're not lost. */
+    if (message_queue.count > 0)
+        message_queue_flush();
+
     va_start(args, format);
     length = vsnprintf(NULL, 0, format, args);
     va_end(args);
@@ -414,6 +1017,10 @@ sysdie(const char *format, ...)
     ssize_t length;
     int error = errno;
 
+    /* Write any queued messages first so that they're not lost. */
+    if (message_queue.count > 0)
+        message_queue_flush();
+
     va_start(args, format);
     length = vsnprintf(NULL, 0, format, args);
     va_end(args);
@@ -35,8 +35,14 @@
 #include <config.h>
 #include <portable/macros.h>
 
+#include <portable/stdbool.h>
+
 #include <stdarg.h>
 #include <stddef.h>
+#include <time.h>
+
+/* The maximum length of a message queued by message_log_queue_*. */
+#define MESSAGE_QUEUE_LINE 1024
 
 BEGIN_DECLS
 
@@ -102,6 +108,44 @@ void message_log_syslog_err(size_t, const char *, va_list, int)
 void message_log_syslog_crit(size_t, const char *, va_list, int)
     __attribute__((__format__(printf, 2, 0), __nonnull__));
 
+/*
+ * Suppress repeated warnings.  After calling message_limit_repeats with a
+ * non-zero interval, a warning identical to one reported less than interval
+ * seconds ago is counted rather than reported, and the next copy after the
+ * interval has passed is reported as "<warning> (repeated N times in T
+ * seconds)".  message_repeats_flush reports any remaining counts and should
+ * be called before exiting.
+ */
+void message_limit_repeats(time_t interval);
+void message_repeats_flush(void);
+
+/*
+ * Handlers that queue messages rather than writing them, so that logging never
+ * blocks.  message_queue_init must be called first to allocate a queue that
+ * holds count messages and set the syslog facility.  Messages that arrive
+ * when the queue is full are dropped and counted.  The program should call
+ * message_queue_drain from its main loop, which writes as many messages as it
+ * can without blocking and returns true if the queue is empty, and should
+ * call message_queue_flush before exiting.  die and sysdie flush the queue
+ * before calling their handlers.  Messages longer than MESSAGE_QUEUE_LINE are
+ * truncated.
+ */
+void message_queue_init(size_t count, int facility);
+bool message_queue_drain(void);
+void message_queue_flush(void);
+void message_queue_free(void);
+unsigned long message_queue_dropped(void);
+void message_log_queue_stdout(size_t, const char *, va_list, int)
+    __attribute__((__format__(printf, 2, 0), __nonnull__));
+void message_log_queue_stderr(size_t, const char *, va_list, int)
+    __attribute__((__format__(printf, 2, 0), __nonnull__));
+void message_log_queue_syslog_notice(size_t, const char *, va_list, int)
+    __attribute__((__format__(printf, 2, 0), __nonnull__));
+void message_log_queue_syslog_warning(size_t, const char *, va_list, int)
+    __attribute__((__format__(printf, 2, 0), __nonnull__));
+void message_log_queue_syslog_err(size_t, const char *, va_list, int)
+    __attribute__((__format__(printf, 2, 0), __nonnull__));
+
 /* The type of a message handler. */
 typedef void (*message_handler_func)(size_t, const char *, va_list, int)
     __attribute__((__format__(printf, 2, 0)));
@@ -0,0 +1,253 @@
+/*
+ * Status files for k5start and krenew.
+ *
+ * A daemon run with -O keeps a small record of its state mapped from a file,
+ * normally under /run, so that monitoring can see the state of every daemon
+ * on a host by reading the files rather than by running klist on each ticket
+ * cache or signaling the daemons.  The record is protected with a seqlock
+ * (see util/status.h), so updates are a few memory writes and readers never
+ * block the daemon.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <util/messages.h>
+#include <util/status.h>
+#include <util/xmalloc.h>
+
+/*
+ * How many times a reader tries to get a consistent copy and how long it
+ * waits between tries, in nanoseconds.  An update takes microseconds, so
+ * running out of tries means the writer died in the middle of one.
+ */
+#define STATUS_TRIES 100
+#define STATUS_WAIT  (1000 * 1000)
+
+/* The part of the record copied by status_publish. */
+#define STATUS_BODY offsetof(struct status_record, pid)
+
+/*
+ * Memory ordering for the sequence number.  Use the compiler atomic builtins
+ * if available and fall back on full barriers otherwise.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#    define seq_load(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#    define seq_store(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#    define seq_fence_write() __atomic_thread_fence(__ATOMIC_RELEASE)
+#    define seq_fence_read()  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#    define seq_load(p) (__sync_synchronize(), *(volatile uint32_t *) (p))
+#    define seq_store(p, v) \
+        (__sync_synchronize(), *(volatile uint32_t *) (p) = (v))
+#    define seq_fence_write() __sync_synchronize()
+#    define seq_fence_read()  __sync_synchronize()
+#endif
+
+/* An open status file. */
+struct status {
+    char *path;
+    struct status_record *record;
+};
+
+
+/*
+ * Mark the record as being updated by making its sequence number odd.  Only
+ * the writer changes the sequence number, so it can be read without
+ * ordering.
+ */
+static void
+status_begin(struct status_record *record)
+{
+    uint32_t sequence = record->sequence;
+
+    seq_store(&record->sequence, sequence + 1);
+    seq_fence_write();
+}
+
+
+/*
+ * Mark an update as finished by advancing the sequence number to the next
+ * even value.
+ */
+static void
+status_end(struct status_record *record)
+{
+    seq_store(&record->sequence, record->sequence + 1);
+}
+
+
+/*
+ * Create or open the status file and map it.  A file left behind by an
+ * earlier daemon is reused and reinitialized.
+ */
+struct status *
+status_open(const char *path)
+{
+    struct status *status;
+    struct status_record *record;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        syswarn("cannot create status file %s", path);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct status_record)) < 0) {
+        syswarn("cannot size status file %s", path);
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, sizeof(struct status_record), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        syswarn("cannot map status file %s", path);
+        return NULL;
+    }
+    record = data;
+
+    /*
+     * Start from an even sequence number.  If an earlier daemon died in the
+     * middle of an update, this completes it.
+     */
+    if (record->sequence & 1U)
+        record->sequence++;
+    status_begin(record);
+    memset((char *) record + STATUS_BODY, 0,
+           sizeof(struct status_record) - STATUS_BODY);
+    record->magic = STATUS_MAGIC;
+    record->version = STATUS_VERSION;
+    record->size = sizeof(struct status_record);
+    status_end(record);
+
+    status = xmalloc(sizeof(struct status));
+    status->path = xstrdup(path);
+    status->record = record;
+    return status;
+}
+
+
+/*
+ * Publish a new record.
+ */
+void
+status_publish(struct status *status, const struct status_record *record)
+{
+    status_begin(status->record);
+    memcpy((char *) status->record + STATUS_BODY,
+           (const char *) record + STATUS_BODY,
+           sizeof(struct status_record) - STATUS_BODY);
+    status_end(status->record);
+}
+
+
+/*
+ * Unmap the status file and optionally remove it.
+ */
+void
+status_close(struct status *status, bool remove)
+{
+    if (status == NULL)
+        return;
+    munmap(status->record, sizeof(struct status_record));
+    if (remove)
+        unlink(status->path);
+    xfree(status->path);
+    xfree(status);
+}
+
+
+/*
+ * Copy a consistent record out of the mapped file, retrying while it is
+ * being updated.  Returns false if no consistent copy could be made.
+ */
+static bool
+status_copy(const struct status_record *mapped, struct status_record *record)
+{
+    struct timespec wait = {0, STATUS_WAIT};
+    uint32_t before, after;
+    int i;
+
+    for (i = 0; i < STATUS_TRIES; i++) {
+        before = seq_load(&mapped->sequence);
+        if ((before & 1U) == 0) {
+            memcpy(record, mapped, sizeof(struct status_record));
+            seq_fence_read();
+            after = seq_load(&mapped->sequence);
+            if (before == after)
+                return true;
+        }
+        nanosleep(&wait, NULL);
+    }
+    return false;
+}
+
+
+/*
+ * Read a status file.
+ */
+bool
+status_read(const char *path, struct status_record *record)
+{
+    struct stat st;
+    void *data;
+    int fd, oerrno;
+    bool okay;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        oerrno = errno;
+        close(fd);
+        errno = oerrno;
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)
+        || st.st_size < (off_t) sizeof(struct status_record)) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    data = mmap(NULL, sizeof(struct status_record), PROT_READ, MAP_SHARED, fd,
+                0);
+    oerrno = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        errno = oerrno;
+        return false;
+    }
+    if (((const struct status_record *) data)->magic != STATUS_MAGIC) {
+        munmap(data, sizeof(struct status_record));
+        errno = EINVAL;
+        return false;
+    }
+    okay = status_copy(data, record);
+    munmap(data, sizeof(struct status_record));
+    if (!okay) {
+        errno = EAGAIN;
+        return false;
+    }
+    if (record->magic != STATUS_MAGIC || record->version != STATUS_VERSION
+        || record->size != sizeof(struct status_record)) {
+        errno = EINVAL;
+        return false;
+    }
+    record->program[sizeof(record->program) - 1] = '\0';
+    record->principal[sizeof(record->principal) - 1] = '\0';
+    record->cache[sizeof(record->cache) - 1] = '\0';
+    record->error[sizeof(record->error) - 1] = '\0';
+    return true;
+}
@@ -0,0 +1,101 @@
+/*
+ * Prototypes and layout for the k5start and krenew status files.
+ *
+ * Copyright 2026 Russ Allbery <eagle@eyrie.org>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef UTIL_STATUS_H
+#define UTIL_STATUS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <stdint.h>
+
+/* The directory that kstart-status reads by default. */
+#define STATUS_DIR "/run/kstart"
+
+/* Identifies a status file and the version of its layout. */
+#define STATUS_MAGIC   0x6b737473
+#define STATUS_VERSION 1
+
+/* The size of the string fields, including the nul. */
+#define STATUS_STRING_SIZE 256
+
+/*
+ * The contents of a status file.  Times are in seconds since epoch on the
+ * daemon's clock and are 0 if the event hasn't happened.  The file is only
+ * read on the same host, so it uses host byte order.
+ *
+ * The sequence number implements a seqlock: the writer increments it to an
+ * odd number before changing the rest of the record and to the next even
+ * number afterwards, and a reader copies the record and retries if the
+ * sequence number was odd or changed while it was copying.  The writer
+ * therefore never waits for readers, and a reader never sees a partial
+ * update.
+ */
+struct status_record {
+    uint32_t magic;                       /* STATUS_MAGIC. */
+    uint32_t version;                     /* STATUS_VERSION. */
+    uint32_t sequence;                    /* Seqlock sequence number. */
+    uint32_t size;                        /* Size of the record. */
+    int64_t pid;                          /* PID of the daemon. */
+    int64_t child;                        /* PID of the command, or 0. */
+    int64_t started;                      /* When the daemon started. */
+    int64_t last_success;                 /* Last successful authentication. */
+    int64_t last_failure;                 /* Last failed authentication. */
+    int64_t next_wakeup;                  /* Next scheduled ticket check. */
+    int64_t latency;                      /* Last authentication in usec. */
+    uint64_t successes;                   /* Count of successes. */
+    uint64_t failures;                    /* Count of failures. */
+    char program[16];                     /* k5start or krenew. */
+    char principal[STATUS_STRING_SIZE];   /* Principal of the tickets. */
+    char cache[STATUS_STRING_SIZE];       /* Ticket cache being maintained. */
+    char error[STATUS_STRING_SIZE];       /* Message for the last failure. */
+};
+
+/* An open status file for writing. */
+struct status;
+
+BEGIN_DECLS
+
+/* Default to a hidden visibility for all util functions. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * Create or reuse the status file at the given path and map it.  Returns
+ * NULL after reporting an error if the file couldn't be created.
+ */
+struct status *status_open(const char *path) __attribute__((__nonnull__));
+
+/*
+ * Publish a new record to the status file.  Everything in the record other
+ * than the header fields is copied.
+ */
+void status_publish(struct status *, const struct status_record *)
+    __attribute__((__nonnull__));
+
+/*
+ * Unmap the status file and free the struct, removing the file if remove is
+ * true.  Accepts NULL.
+ */
+void status_close(struct status *, bool remove);
+
+/*
+ * Read a consistent copy of the status file at the given path.  Returns false
+ * and sets errno if the file can't be read, isn't a status file (EINVAL), or
+ * is being continuously updated or was abandoned in the middle of an update
+ * (EAGAIN).
+ */
+bool status_read(const char *path, struct status_record *)
+    __attribute__((__nonnull__));
+
+/* Undo default visibility change. */
+#pragma GCC visibility pop
+
+END_DECLS
+
+#endif /* UTIL_STATUS_H */
@@ -21,6 +21,7 @@
  *      xasprintf(&buffer, "%s", "some string");
  *      free(buffer);
  *      xvasprintf(&buffer, "%s", args);
+ *      xfree(buffer);
  *
  * xmalloc, xcalloc, xrealloc, and xstrdup behave exactly like their C library
  * counterparts without the leading x except that they will never return NULL.
@@ -51,6 +52,12 @@
  * a const char * (function name), size_t (bytes allocated), const char *
  * (file), and int (line).
  *
+ * xfree is free for memory allocated by these functions.  It is only needed
+ * for the live allocation counts kept when xmalloc_accounting is true; any
+ * memory not freed with it still shows up as allocated.  Accounting has to
+ * be turned on before the first allocation, since xfree can't tell whether a
+ * block was counted.
+ *
  * xmalloc will return a pointer to a valid memory region on an xmalloc of 0
  * bytes, ensuring this by allocating space for one character instead of 0
  * bytes.
@@ -90,6 +97,10 @@
 #include <config.h>
 #include <portable/system.h>
 
+#ifdef HAVE_MALLOC_H
+#    include <malloc.h>
+#endif
+
 #include <util/messages.h>
 #include <util/xmalloc.h>
 
@@ -111,6 +122,70 @@ xmalloc_fail(const char *function, size_t size, const char *file, int line)
 /* Assign to this variable to choose a handler other than the default. */
 xmalloc_handler_type xmalloc_error_handler = xmalloc_fail;
 
+/* Set to true to count allocations made through these functions. */
+bool xmalloc_accounting = false;
+
+/* The live allocation counts, updated if xmalloc_accounting is true. */
+static long xmalloc_count = 0;
+static long long xmalloc_bytes = 0;
+
+
+/*
+ * Return the size of an allocated block, or 0 if the system can't tell us.
+ * The size is only used for accounting, so the usable size is close enough.
+ */
+static size_t
+xmalloc_size(void *p)
+{
+#ifdef HAVE_MALLOC_USABLE_SIZE
+    return (p == NULL) ? 0 : malloc_usable_size(p);
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Record a new allocation if accounting is enabled.
+ */
+static void
+xmalloc_record(void *p)
+{
+    if (xmalloc_accounting) {
+        xmalloc_count++;
+        xmalloc_bytes += (long long) xmalloc_size(p);
+    }
+}
+
+
+/*
+ * Return allocation statistics: the number of allocations and bytes that
+ * were made while xmalloc_accounting was true and not yet freed with xfree.
+ * The byte count is 0 if the system can't tell us the size of a block.
+ */
+void
+xmalloc_stats(struct xmalloc_stats *stats)
+{
+    stats->count = xmalloc_count;
+    stats->bytes = xmalloc_bytes;
+}
+
+
+/*
+ * Free memory allocated by the x_* functions, updating the counts.
+ */
+void
+xfree(void *p)
+{
+    if (p == NULL)
+        return;
+    if (xmalloc_accounting) {
+        xmalloc_count--;
+        xmalloc_bytes -= (long long) xmalloc_size(p);
+    }
+    free(p);
+}
+
 
 void *
 x_malloc(size_t size, const char *file, int line)
@@ -124,6 +199,7 @@ x_malloc(size_t size, const char *file, int line)
         (*xmalloc_error_handler)("malloc", size, file, line);
         p = malloc(real_size);
     }
+    xmalloc_record(p);
     return p;
 }
 
@@ -140,20 +216,45 @@ x_calloc(size_t n, size_t size, const char *file, int line)
         (*xmalloc_error_handler)("calloc", n * size, file, line);
         p = calloc(n, size);
     }
+    xmalloc_record(p);
     return p;
 }
 
 
+/*
+ * Update the counts after a block of old_size bytes was resized to newp.
+ * fresh says whether there was no old block, and a NULL newp means the old
+ * block was freed.  The old pointer can't be passed in, since it may no
+ * longer be valid.
+ */
+static void
+xmalloc_resize(bool fresh, size_t old_size, void *newp)
+{
+    if (!xmalloc_accounting)
+        return;
+    if (fresh && newp != NULL)
+        xmalloc_count++;
+    else if (!fresh && newp == NULL)
+        xmalloc_count--;
+    xmalloc_bytes += (long long) xmalloc_size(newp) - (long long) old_size;
+}
+
+
 void *
 x_realloc(void *p, size_t size, const char *file, int line)
 {
     void *newp;
+    size_t old_size;
+    bool fresh;
 
+    fresh = (p == NULL);
+    old_size = xmalloc_size(p);
     newp = realloc(p, size);
     while (newp == NULL && size > 0) {
         (*xmalloc_error_handler)("realloc", size, file, line);
         newp = realloc(p, size);
     }
+    xmalloc_resize(fresh, old_size, newp);
     return newp;
 }
 
@@ -162,12 +263,17 @@ void *
 x_reallocarray(void *p, size_t n, size_t size, const char *file, int line)
 {
     void *newp;
+    size_t old_size;
+    bool fresh;
 
+    fresh = (p == NULL);
+    old_size = xmalloc_size(p);
     newp = reallocarray(p, n, size);
     while (newp == NULL && size > 0 && n > 0) {
         (*xmalloc_error_handler)("reallocarray", n * size, file, line);
         newp = reallocarray(p, n, size);
     }
+    xmalloc_resize(fresh, old_size, newp);
     return newp;
 }
 
@@ -184,6 +290,7 @@ x_strdup(const char *s, const char *file, int line)
         (*xmalloc_error_handler)("strdup", len, file, line);
         p = malloc(len);
     }
+    xmalloc_record(p);
     memcpy(p, s, len);
     return p;
 }
@@ -210,6 +317,7 @@ x_strndup(const char *s, size_t size, const char *file, int line)
         (*xmalloc_error_handler)("strndup", length + 1, file, line);
         copy = malloc(length + 1);
     }
+    xmalloc_record(copy);
     memcpy(copy, s, length);
     copy[length] = '\0';
     return copy;
@@ -236,6 +344,7 @@ x_vasprintf(char **strp, const char *fmt, va_list args, const char *file,
         status = vasprintf(strp, fmt, args_copy);
         va_end(args_copy);
     }
+    xmalloc_record(*strp);
 }
 
 
@@ -260,6 +369,7 @@ x_asprintf(char **strp, const char *file, int line, const char *fmt, ...)
         status = vasprintf(strp, fmt, args_copy);
         va_end(args_copy);
     }
+    xmalloc_record(*strp);
     va_end(args);
 }
 #else  /* !(HAVE_C99_VAMACROS || HAVE_GNU_VAMACROS) */
@@ -283,6 +393,7 @@ x_asprintf(char **strp, const char *fmt, ...)
         status = vasprintf(strp, fmt, args_copy);
         va_end(args_copy);
     }
+    xmalloc_record(*strp);
     va_end(args);
 }
 #endif /* !(HAVE_C99_VAMACROS || HAVE_GNU_VAMACROS) */
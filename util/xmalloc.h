@@ -33,6 +33,7 @@
 
 #include <config.h>
 #include <portable/macros.h>
+#include <portable/stdbool.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -119,6 +120,23 @@ void xmalloc_fail(const char *, size_t, const char *, int)
  */
 extern xmalloc_handler_type xmalloc_error_handler;
 
+/* Free memory allocated by the functions above. */
+void xfree(void *);
+
+/*
+ * Allocation statistics.  Set xmalloc_accounting to true to count the
+ * allocations made by the x_* functions and not yet released with xfree.
+ * It must be set before the first allocation, since freeing a block that
+ * wasn't counted throws off the counts.  bytes is 0 if the system can't
+ * report the size of an allocation.
+ */
+struct xmalloc_stats {
+    long count;      /* Live allocations. */
+    long long bytes; /* Live bytes allocated. */
+};
+extern bool xmalloc_accounting;
+void xmalloc_stats(struct xmalloc_stats *) __attribute__((__nonnull__));
+
 /* Undo default visibility change. */
 #pragma GCC visibility pop
 